@@ -33,9 +33,16 @@ static const int SCREEN_WIDTH  = 1024;
 static const int SCREEN_HEIGHT =  768;
 #endif
 
-void init_screen(const char * caption);
+/** Opens the window. Readback must be set if the frames are read after they are drawn (e.g. by SSAO, reprojection,
+ * capture or screenshots), in which case they are drawn into memory of the application. Otherwise they may be drawn
+ * directly into the memory of the texture that presents them, which is meant to be written only. */
+void init_screen(const char * caption, bool readback);
+/** Shows the contents of the screen surface. */
 void flip_screen();
 
+/** Returns the surface that is shown by the next flip_screen(), which has a depth buffer.
+ * Its pixel buffer may change on every flip_screen(), hence it must be obtained again after each flip.
+ * The previous contents of a new pixel buffer are undefined. */
 surface get_screen();
 
 void draw_box(glm::dmat3 orientation);
@@ -45,7 +45,8 @@ static SDL_Surface *screen = NULL;
     */
 static const glm::dmat4 frustum_matrix = glm::scale(glm::frustum<double>(frustum::left, frustum::right, frustum::bottom, frustum::top, frustum::near, frustum::far),glm::dvec3(1,1,-1));
 
-void init_screen(const char * caption) {
+// This backend has no surface that is drawn into, hence readback is ignored.
+void init_screen(const char * caption, bool) {
     // Initialize SDL 
     if (SDL_Init (SDL_INIT_VIDEO) < 0) {
         fprintf (stderr, "Couldn't initialize SDL: %s\n", SDL_GetError ());
@@ -30,12 +30,21 @@ SDL_Texture *texture = NULL;
 
 surface surf;
 
+// The frames are drawn directly into the memory of a locked streaming texture, if they are not read after drawing
+// and its rows are not padded. Two textures are used, such that the next frame can be drawn while the previous one
+// is presented. The locked memory is only written: with the software and OpenGL renderers of SDL it is ordinary
+// memory, but other renderers may return write-combined or mapped GPU memory, which is very slow to read.
+static bool zero_copy = false;
+static SDL_Texture *textures[2] = {NULL, NULL};
+static int back = 0;
+static uint32_t * depth = NULL;
+
 static void sdl_die(const char * message) {
     fprintf (stderr, "%s: %s\n", message, SDL_GetError ());
     exit(2);
 }
 
-void init_screen(const char * caption) {
+void init_screen(const char * caption, bool readback) {
     // Initialize SDL 
     if (SDL_Init (SDL_INIT_VIDEO) < 0) sdl_die("Couldn't initialize SDL");
     atexit (SDL_Quit);
@@ -61,17 +70,45 @@ void init_screen(const char * caption) {
         SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
     }
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
-    if (texture == NULL) sdl_die("Couldn't create texture");
+    for (int i=0; i<2; i++) {
+        textures[i] = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+        if (textures[i] == NULL) sdl_die("Couldn't create texture");
+    }
+    texture = textures[0];
 
     // set the pixel pointer
-    surf = surface(SCREEN_WIDTH, SCREEN_HEIGHT, true);
+    depth = new uint32_t[SCREEN_WIDTH * SCREEN_HEIGHT];
+    if (!readback) {
+        void * pixels;
+        int pitch;
+        if (SDL_LockTexture(textures[back], NULL, &pixels, &pitch)) sdl_die("Couldn't lock texture");
+        zero_copy = pitch == (int)(SCREEN_WIDTH * sizeof (uint32_t));
+        if (zero_copy) {
+            surf = surface(SCREEN_WIDTH, SCREEN_HEIGHT, (uint32_t*)pixels, depth);
+            return;
+        }
+        SDL_UnlockTexture(textures[back]);
+    }
+    surf = surface(SCREEN_WIDTH, SCREEN_HEIGHT, new uint32_t[SCREEN_WIDTH * SCREEN_HEIGHT], depth);
 }
 
 void flip_screen() {
-    SDL_UpdateTexture(texture, NULL, surf.data, SCREEN_WIDTH * sizeof (uint32_t));
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    if (!zero_copy) {
+        SDL_UpdateTexture(texture, NULL, surf.data, SCREEN_WIDTH * sizeof (uint32_t));
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+        return;
+    }
+    // Unlocking uploads the frame, after which the other texture is locked for drawing the next frame.
+    SDL_UnlockTexture(textures[back]);
+    SDL_RenderCopy(renderer, textures[back], NULL, NULL);
     SDL_RenderPresent(renderer);
+    back ^= 1;
+    texture = textures[back];
+    void * pixels;
+    int pitch;
+    if (SDL_LockTexture(textures[back], NULL, &pixels, &pitch)) sdl_die("Couldn't lock texture");
+    surf.data = (uint32_t*)pixels;
 }
 
 /** Draws a line. */
@@ -22,6 +22,8 @@
 #include <unistd.h>
 
 #include "pointset.h"
+#include "point_parser.h"
+#include "thread_pool.h"
 
 /* Accepts files with lines of the format:
  * x y z color
@@ -51,26 +53,20 @@ int main(int argc, char ** argv) {
   }
   
   // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
+  if (access(infile, R_OK)) {
     fprintf(stderr,"Failed to open '%s' for input.\n", infile);
     exit(2);
   }
   pointfile out(outfile);
+  thread_pool pool;
 
   // Do the conversion
-  point p;
-  int line=0;
-  for(;;) {
-    if(line%(1<<20)==0) fprintf(stderr,"line: %3dMi\n", line>>20);
-    int ret = scanf("%u %u %u %x\n", &p.x, &p.y, &p.z, &p.c);
-    if (ret < 4) break;
+  uint64_t lines = parse_points(infile, 0, out, pool, [](const char * s, const char * e, int, point &p) {
+    if (!(parse_uint(s,e,p.x) && parse_uint(s,e,p.y) && parse_uint(s,e,p.z) && parse_hex(s,e,p.c))) return false;
     p.c = ((p.c&0xff)<<16)|(p.c&0xff00)|((p.c&0xff0000)>>16);
-    out.add(p);
-    line++;
-  }
-  fprintf(stderr,"lines: %d\n", line);
+    return true;
+  });
+  fprintf(stderr,"lines: %lu\n", lines);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
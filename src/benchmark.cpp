@@ -24,20 +24,41 @@
 #include <cstring>
 
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <sys/stat.h>
 
 #include "timing.h"
+#ifdef FOUND_SDL2
 #include "art.h"
+#endif
 #include "octree.h"
+#include "octree_edit.h"
+#include "renderer.h"
 #include "ssao.h"
 
-// #define SSAA_TEST
-
 using namespace std;
 
+/* Renders a set of scenes and reports percentiles of their frame times.
+ *
+ * By default the frames are shown in a window. With -headless (or when compiled without SDL2),
+ * they are rendered into off-screen surfaces of the requested sizes, such that the benchmark can
+ * run on machines without a display. The results can be written as JSON and compared against
+ * the JSON of an earlier run, in which case the exit status is 1 if a scene became slower than
+ * the given tolerance.
+ */
+
 struct Scene {
+    string name;
+    string filename;
+    uint32_t background;
+    glm::dvec3 position;
+    glm::dmat3 orientation;
+};
+
+struct BuiltinScene {
     const char * filename;
     uint32_t background;
     glm::dvec3 position;
@@ -47,7 +68,7 @@ struct Scene {
 static const int32_t SCENE_DEPTH = 26;
 static const double SCALE = 1<<SCENE_DEPTH;
 
-static const Scene scene [] = {
+static const BuiltinScene builtin_scene [] = {
     {"sibenik",  0xaaccffu, glm::dvec3( 0.0000,  0.0000,  0.0000),  glm::dmat3(-0.119, -0.430, -0.895,   0.249,  0.860, -0.446,   0.961, -0.275,  0.005)},
     {"sibenik",  0xaaccffu, glm::dvec3(-0.0462, -0.0302,  0.0088),  glm::dmat3(-0.275,  0.188,  0.943,   0.091,  0.981, -0.170,  -0.957,  0.039, -0.286)},
     {"sibenik",  0xaaccffu, glm::dvec3( 0.0500, -0.0320,  0.0027),  glm::dmat3(-0.231, -0.166, -0.959,  -0.815,  0.572,  0.097,   0.532,  0.803, -0.267)},
@@ -65,100 +86,437 @@ static const Scene scene [] = {
     {"sponge",   0x666666u, glm::dvec3(-0.3950, -0.5224,  0.8151),  glm::dmat3(-0.211, -0.750,  0.627,  -0.848,  0.460,  0.265,  -0.487, -0.475, -0.733)},
 };
 
-static const int scenes = sizeof(scene)/sizeof(scene[0]);
-static double results[scenes];
+static const int builtin_scenes = sizeof(builtin_scene)/sizeof(builtin_scene[0]);
 
-#ifdef SSAA_TEST
-static const int N = 0;
-#else
-static const int N = 5;
-#endif
+/** The built-in scenes, which use the models in ../vxl. */
+static vector<Scene> default_scenes() {
+    vector<Scene> scenes;
+    for (int i=0; i<builtin_scenes; i++) {
+        const BuiltinScene &b = builtin_scene[i];
+        char name[64];
+        sprintf(name, "%s-%02d", b.filename, i);
+        scenes.push_back(Scene{name, string("../vxl/") + b.filename + ".oc2", b.background, b.position, b.orientation});
+    }
+    return scenes;
+}
+
+/** Reads scenes from a text file with a line per scene, containing: the name of the scene,
+ * the octree file, the background color (in hex), the position (relative to the size of the
+ * scene) and the 9 components of the orientation (in the order of glm::dmat3's constructor).
+ * Empty lines and lines starting with '#' are ignored. The name consists of printable characters
+ * other than '"', '\\' and '/'. */
+static vector<Scene> load_scenes(const char * filename) {
+    FILE * f = fopen(filename, "r");
+    if (!f) {perror("Could not open scene file"); exit(1);}
+    vector<Scene> scenes;
+    char line[1024];
+    int number = 0;
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        char name[256], file[512];
+        uint32_t background;
+        double v[12];
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) continue;
+        int n = sscanf(line, "%255s %511s %x %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", name, file, &background,
+            &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]);
+        if (n != 15) {
+            fprintf(stderr, "%s:%d: expected: name file background x y z and 9 orientation components\n", filename, number);
+            exit(1);
+        }
+        // The name is written unescaped into the JSON output and the screenshot file names.
+        for (const char * c = name; *c; c++) {
+            if (*c == '"' || *c == '\\' || *c == '/' || (unsigned char)*c < 0x20) {
+                fprintf(stderr, "%s:%d: scene name '%s' must not contain quotes, backslashes, slashes or control characters\n", filename, number, name);
+                exit(1);
+            }
+        }
+        scenes.push_back(Scene{name, file, background, glm::dvec3(v[0], v[1], v[2]),
+            glm::dmat3(v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11])});
+    }
+    fclose(f);
+    return scenes;
+}
+
+struct Result {
+    string scene;
+    uint32_t width, height;
+    double p50, p95, p99, mean, min, max; //< Frame times in milliseconds.
+    double prepare, query;                //< Average time per frame spent in the phases of the renderer.
+    render_stats last;                    //< Statistics of the last frame.
+};
+
+/** Returns the nearest-rank percentile of the sorted times. */
+static double percentile(const vector<double> &sorted, double p) {
+    size_t rank = (size_t)ceil(p / 100 * sorted.size());
+    return sorted[max<size_t>(rank, 1) - 1];
+}
+
+static void write_json(const char * filename, const vector<Result> &results, int frames, int warmup, int threads) {
+    FILE * f = fopen(filename, "w");
+    if (!f) {perror("Could not open JSON file"); exit(1);}
+    fprintf(f, "{\"frames\": %d, \"warmup\": %d, \"threads\": %d, \"results\": [\n", frames, warmup, threads);
+    for (size_t i=0; i<results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(f, "{\"scene\": \"%s\", \"width\": %u, \"height\": %u, "
+            "\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"mean\": %.3f, \"min\": %.3f, \"max\": %.3f, "
+            "\"prepare\": %.3f, \"query\": %.3f, "
+            "\"count\": %lu, \"count_oct\": %lu, \"count_quad\": %lu, \"culled_frustum\": %lu, \"culled_occlusion\": %lu, "
+            "\"pixels\": %lu, \"max_depth\": %u, \"beam_tiles\": %lu, \"beam_oct\": %lu, \"cached_tiles\": %lu}%s\n",
+            r.scene.c_str(), r.width, r.height, r.p50, r.p95, r.p99, r.mean, r.min, r.max, r.prepare, r.query,
+            r.last.count, r.last.count_oct, r.last.count_quad, r.last.culled_frustum, r.last.culled_occlusion,
+            r.last.pixels, r.last.max_depth, r.last.beam_tiles, r.last.beam_oct, r.last.cached_tiles, i+1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    if (fclose(f)) {perror("Could not write JSON file"); exit(1);}
+}
+
+/** Reads the p50 of each scene and size from a file written by write_json.
+ * As it only needs to read these files, it relies on each result being on a single line. */
+static map<string, double> read_baseline(const char * filename) {
+    FILE * f = fopen(filename, "r");
+    if (!f) {perror("Could not open baseline"); exit(1);}
+    map<string, double> baseline;
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char scene[256];
+        uint32_t width, height;
+        double p50;
+        const char * s = strstr(line, "{\"scene\": \"");
+        if (!s) continue;
+        if (sscanf(s, "{\"scene\": \"%255[^\"]\", \"width\": %u, \"height\": %u, \"p50\": %lf", scene, &width, &height, &p50) == 4) {
+            char key[300];
+            sprintf(key, "%s %ux%u", scene, width, height);
+            baseline[key] = p50;
+        }
+    }
+    fclose(f);
+    return baseline;
+}
+
+/** Compares the p50 frame times against the baseline. Returns the number of regressions. */
+static int compare(const vector<Result> &results, const map<string, double> &baseline, double tolerance) {
+    int regressions = 0;
+    printf("\n%-24s %-10s | %8s %8s %8s\n", "Scene", "Size", "Baseline", "p50", "Change");
+    for (const Result &r : results) {
+        char key[300], size[32];
+        sprintf(key, "%s %ux%u", r.scene.c_str(), r.width, r.height);
+        sprintf(size, "%ux%u", r.width, r.height);
+        auto b = baseline.find(key);
+        if (b == baseline.end()) {
+            printf("%-24.24s %-10s | %8s %8.2f %8s\n", r.scene.c_str(), size, "-", r.p50, "new");
+            continue;
+        }
+        double change = (r.p50 / b->second - 1) * 100;
+        bool regression = change > tolerance;
+        regressions += regression;
+        printf("%-24.24s %-10s | %8.2f %8.2f %+7.1f%%%s\n", r.scene.c_str(), size, b->second, r.p50, change, regression ? " REGRESSION" : "");
+    }
+    return regressions;
+}
+
+/** Checks that the SSAO computed at 1/scale of the resolution matches the SSAO of every pixel on images that
+ * have no occlusion at all: a flat wall and a near pole in front of it, whose silhouette has blocks of mixed depth.
+ * Returns the number of images that differ. */
+static int verify_ssao_scale(uint32_t width, uint32_t height, int scale, int threads) {
+    ssao full(25, 0.1, width, 1, threads);
+    ssao scaled(25, 0.1, width, scale, threads);
+    int mismatches = 0;
+    for (int pole=0; pole<2; pole++) {
+        surface a(width, height, true), b(width, height, true);
+        for (uint32_t y=0; y<height; y++) {
+            for (uint32_t x=0; x<width; x++) {
+                uint32_t i = x + y * width;
+                bool near = pole && x >= width/2 && x < width/2 + 7;
+                a.data[i] = (x * 0x010203 + y * 0x030201) & 0xffffff;
+                a.depth[i] = near ? 1 << 20 : 1 << 24;
+            }
+        }
+        b.copy(a);
+        memcpy(b.depth, a.depth, width * (size_t)height * sizeof(uint32_t));
+        full.apply(a);
+        scaled.apply(b);
+        if (memcmp(a.data, b.data, width * (size_t)height * sizeof(uint32_t))) {
+            fprintf(stderr, "SSAO at 1/%d of the resolution differs on the %s image.\n", scale, pole ? "silhouette" : "flat");
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static void usage(const char * program) {
+    fprintf(stderr, "Usage: %s [options] [screenshot_prefix]\n", program);
+    fprintf(stderr, "  -headless         render off-screen instead of in a window\n");
+    fprintf(stderr, "  -size WxH         off-screen resolution, can be repeated (default: 1024x768)\n");
+    fprintf(stderr, "  -scenes file      read the scenes from file instead of using the built-in scenes\n");
+    fprintf(stderr, "  -frames N         number of measured frames per scene (default: 5)\n");
+    fprintf(stderr, "  -warmup N         number of frames rendered before measuring (default: 1)\n");
+    fprintf(stderr, "  -threads N        render in tiles using N threads, 0 for all hardware threads (default: 1)\n");
+    fprintf(stderr, "  -json file        write the results as JSON\n");
+    fprintf(stderr, "  -compare file     compare against the JSON of an earlier run\n");
+    fprintf(stderr, "  -tolerance pct    p50 increase that counts as a regression (default: 10)\n");
+    fprintf(stderr, "  -ssaa N           render at N times the resolution, apply SSAO and downscale (default: 1, off)\n");
+    fprintf(stderr, "  -ssaoscale N      compute the SSAO of -ssaa at 1/N of the supersampled resolution (default: 1)\n");
+    fprintf(stderr, "  -iterative        traverse the octree using an explicit stack instead of recursion\n");
+    fprintf(stderr, "  -beam             render per 16x16 pixel tile, using a beam pre-pass for the upper octree levels\n");
+    fprintf(stderr, "  -cache            start the tiles of -beam from the octree nodes that rendered them in the previous frame,\n");
+    fprintf(stderr, "                    and with -threads, start the tiles that took the most work in the previous frame first\n");
+    fprintf(stderr, "  -verify           also render each frame using the reference traversal and check that the images are identical,\n");
+    fprintf(stderr, "                    and with -ssaoscale, that it does not change the SSAO of unoccluded images\n");
+    fprintf(stderr, "  -hugepages        copy the octrees into huge pages before rendering them\n");
+    fprintf(stderr, "  -numa             pin the threads and give each NUMA node a copy of the upper octree levels\n");
+    exit(2);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char ** argv) {
-    init_screen("Voxel renderer - benchmark");
-    if (argc>=2) {
-        mkdir("bshots",0755);
+#ifdef FOUND_SDL2
+    bool headless = false;
+#else
+    bool headless = true;
+#endif
+    vector<pair<uint32_t, uint32_t>> sizes;
+    vector<Scene> scenes;
+    int frames = 5, warmup = 1, threads = 1;
+    int supersample = 1, ssao_scale = 1;
+    bool iterative = false, beam = false, cache = false, verify = false, huge_pages = false, numa = false;
+    const char * json = nullptr;
+    const char * baseline = nullptr;
+    const char * prefix = nullptr;
+    double tolerance = 10;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "-size") == 0 && i+1 < argc) {
+            uint32_t w, h;
+            if (sscanf(argv[++i], "%ux%u", &w, &h) != 2 || w == 0 || h == 0) usage(argv[0]);
+            sizes.push_back(make_pair(w, h));
+        } else if (strcmp(argv[i], "-scenes") == 0 && i+1 < argc) {
+            scenes = load_scenes(argv[++i]);
+        } else if (strcmp(argv[i], "-frames") == 0 && i+1 < argc) {
+            frames = atoi(argv[++i]);
+            if (frames < 1) usage(argv[0]);
+        } else if (strcmp(argv[i], "-warmup") == 0 && i+1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-json") == 0 && i+1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "-compare") == 0 && i+1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-tolerance") == 0 && i+1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-ssaa") == 0 && i+1 < argc) {
+            supersample = atoi(argv[++i]);
+            if (supersample < 1) usage(argv[0]);
+        } else if (strcmp(argv[i], "-ssaoscale") == 0 && i+1 < argc) {
+            ssao_scale = atoi(argv[++i]);
+            if (ssao_scale < 1) usage(argv[0]);
+        } else if (strcmp(argv[i], "-iterative") == 0) {
+            iterative = true;
+        } else if (strcmp(argv[i], "-beam") == 0) {
+            beam = true;
+        } else if (strcmp(argv[i], "-cache") == 0) {
+            cache = true;
+        } else if (strcmp(argv[i], "-verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[i], "-hugepages") == 0) {
+            huge_pages = true;
+        } else if (strcmp(argv[i], "-numa") == 0) {
+            numa = true;
+        } else if (argv[i][0] == '-' || prefix) {
+            usage(argv[0]);
+        } else {
+            prefix = argv[i];
+        }
     }
+    if (scenes.empty()) scenes = default_scenes();
 
-    surface surf(get_screen());
-#ifdef SSAA_TEST
-    surface ssaa(surf.scale(4, true));
-    ssao filter(100, 0.1, ssaa.width);
-#endif
-    
-    // mainloop
-    for (int i=0; i<scenes; i++) {
-        // Load file
-        char infile[64];
-        sprintf(infile, "../vxl/%s.oc2", scene[i].filename);
-        octree_file in(infile);
-        
-        // Set camera
-        uint32_t background = scene[i].background;
-        glm::dvec3 position = scene[i].position * SCALE;
-        glm::dmat3 orientation = scene[i].orientation;
-
-        // Run tests
-        double times[N];
-        for (int j=-1; j<N; j++) {
-            Timer t;
-#ifdef SSAA_TEST
-            ssaa.clear(background);
-            octree_draw(&in, ssaa, get_view_pane(), position, orientation);
-            Timer tt;
-            filter.apply(ssaa);
-            printf("SSAO: %lf\n", tt.elapsed());
-            surf.copy(ssaa);
-#else
-            surf.clear(background);
-            octree_draw(&in, surf, get_view_pane(), position, orientation);
+    // The surfaces that are rendered to.
+    vector<surface> surfaces;
+#ifdef FOUND_SDL2
+    if (!headless) {
+        if (!sizes.empty()) {
+            fprintf(stderr, "-size requires -headless, windowed mode uses the screen size.\n");
+            exit(2);
+        }
+        // The frames are read by -verify and for the screenshot.
+        init_screen("Voxel renderer - benchmark", verify || prefix != nullptr);
+        surfaces.push_back(get_screen());
+    }
 #endif
-            flip_screen();
-            if (j>=0) {
-                times[j] = t.elapsed();
-            }
+    if (headless) {
+        if (sizes.empty()) sizes.push_back(make_pair(1024u, 768u));
+        for (auto &s : sizes) {
+            surfaces.push_back(surface(s.first, s.second, true));
+        }
+    }
+    if (prefix) {
+        mkdir("bshots",0755);
+    }
+
+    // Render using a single renderer, unless multiple threads are requested.
+    // With -verify, a second renderer renders the reference: the recursive traversal without pre-pass,
+    // or the iterative traversal if that is what is being measured.
+    unique_ptr<renderer> single, single_reference;
+    unique_ptr<parallel_renderer> parallel, parallel_reference;
+    bool reference_iterative = !iterative && !beam && !cache;
+    if (threads == 1 && !numa) {
+        single.reset(new renderer());
+        single->set_iterative(iterative);
+        single->set_beam(beam);
+        single->set_entry_cache(cache);
+        if (verify) {
+            single_reference.reset(new renderer());
+            single_reference->set_iterative(reference_iterative);
+        }
+    } else {
+        parallel.reset(new parallel_renderer(threads, numa));
+        threads = parallel->threads();
+        parallel->set_iterative(iterative);
+        parallel->set_beam(beam);
+        parallel->set_entry_cache(cache);
+        if (verify) {
+            parallel_reference.reset(new parallel_renderer(threads));
+            parallel_reference->set_iterative(reference_iterative);
         }
-        
-        if (N>0) {
-            // Print results
-            printf("Test %2d:", i);
-            for (int j=0; j<N; j++) {
-                printf(" %7.2f", times[j]);
+    }
+    int mismatches = 0, ssao_mismatches = 0;
+    if (verify && supersample > 1 && ssao_scale > 1) {
+        ssao_mismatches = verify_ssao_scale(surfaces[0].width * supersample, surfaces[0].height * supersample, ssao_scale, threads);
+    }
+
+    vector<Result> results;
+    printf("%-24s %-10s | %8s %8s %8s %8s | %8s %8s | %10s %8s\n", "Scene", "Size", "p50", "p95", "p99", "mean", "prepare", "query", "count", "pixels");
+    for (size_t i=0; i<scenes.size(); i++) {
+        octree_file in(scenes[i].filename.c_str());
+        if (huge_pages) in.load_huge_pages();
+        unique_ptr<octree_replicas> replicas;
+        if (numa) replicas.reset(new octree_replicas(&in));
+        uint32_t background = scenes[i].background;
+        glm::dvec3 position = scenes[i].position * SCALE;
+        glm::dmat3 orientation = scenes[i].orientation;
+
+        for (surface &surf : surfaces) {
+            // The view pane of art_sdl.cpp, which has a vertical field of view of 53 degrees.
+            view_pane view = {-(double)surf.width/2/surf.height, (double)surf.width/2/surf.height, 0.5, -0.5};
+            // With supersampling, the scene is rendered at a higher resolution, to which SSAO is applied before downscaling.
+            surface ssaa;
+            unique_ptr<ssao> filter;
+            if (supersample > 1) {
+                ssaa = surf.scale(supersample, true);
+                filter.reset(new ssao(25 * supersample, 0.1, ssaa.width, ssao_scale, threads));
             }
-            if (N<=2) {
-                printf("\n");
+            Result r;
+            r.scene = scenes[i].name;
+            r.width = surf.width;
+            r.height = surf.height;
+            r.prepare = r.query = 0;
+            vector<double> times;
+            surface shot; // Copy of the last frame, as the screen's buffer is not preserved by flip_screen().
+            surface check; // Rendered using the reference traversal, with -verify.
+            for (int j=-warmup; j<frames; j++) {
+                Timer t;
+                surface target = filter ? ssaa : surf;
+                target.clear(background);
+                if (single) {
+                    single->render(&in, target, view, position, orientation);
+                    r.last = single->stats();
+                } else if (replicas) {
+                    parallel->render(*replicas, target, view, position, orientation);
+                    r.last = parallel->stats();
+                } else {
+                    parallel->render(&in, target, view, position, orientation);
+                    r.last = parallel->stats();
+                }
+                double unmeasured = 0; // Time spent on verification, which is excluded from the frame time.
+                if (verify && j >= 0) {
+                    Timer v;
+                    if (!check.data) check = surface(target.width, target.height, true);
+                    check.clear(background);
+                    if (single) {
+                        single_reference->render(&in, check, view, position, orientation);
+                    } else {
+                        parallel_reference->render(&in, check, view, position, orientation);
+                    }
+                    size_t bytes = target.width * (size_t)target.height * sizeof(uint32_t);
+                    if (memcmp(check.data, target.data, bytes) || memcmp(check.depth, target.depth, bytes)) {
+                        fprintf(stderr, "Scene %s: frame %d differs from the reference traversal.\n", scenes[i].name.c_str(), j);
+                        mismatches++;
+                    }
+                    unmeasured = v.elapsed();
+                }
+                if (filter) {
+                    filter->apply(ssaa, surf);
+                }
+#ifdef FOUND_SDL2
+                if (!headless) {
+                    if (prefix && j == frames - 1) {
+                        shot = surface(surf.width, surf.height);
+                        shot.copy(surf);
+                    }
+                    flip_screen();
+                    surf = get_screen();
+                }
+#endif
+                if (j>=0) {
+                    times.push_back(t.elapsed() - unmeasured);
+                    r.prepare += r.last.prepare / frames;
+                    r.query += r.last.query / frames;
+                }
             }
-        }
-        
-        if (N>2) {
-            // Compute average
-            std::sort(times,times+N);
-            results[i]=0;
-            for (int j=1; j<N-1; j++) {
-                results[i] += times[j];
+
+            std::sort(times.begin(), times.end());
+            r.p50 = percentile(times, 50);
+            r.p95 = percentile(times, 95);
+            r.p99 = percentile(times, 99);
+            r.min = times.front();
+            r.max = times.back();
+            r.mean = 0;
+            for (double t : times) r.mean += t / frames;
+            results.push_back(r);
+
+            char size[32];
+            sprintf(size, "%ux%u", r.width, r.height);
+            printf("%-24.24s %-10s | %8.2f %8.2f %8.2f %8.2f | %8.2f %8.2f | %10lu %8lu\n", r.scene.c_str(), size,
+                r.p50, r.p95, r.p99, r.mean, r.prepare, r.query, r.last.count, r.last.pixels);
+            fflush(stdout);
+
+            // Output png
+            if (prefix) {
+                char outfile[512];
+                sprintf(outfile, "bshots/%.10s-%s-%s.png", prefix, r.scene.c_str(), size);
+                (shot.data ? shot : surf).export_png(outfile);
             }
-            results[i] /= N-2;
-            printf(" | %7.2f\n", results[i]);
-        }
-        fflush(stdout);
-        
-        // Output png
-        if (argc>=2) {
-            char outfile[64];
-            sprintf(outfile, "bshots/%.10s-%02d-%s.png", argv[1], i, scene[i].filename);
-            get_screen().export_png(outfile);
         }
     }
 
-    printf("\nBenchmark results:");
     double sum = 0;
-    for (int i=0; i<scenes; i++) {
-        printf(" %7.2f", results[i]);
-        sum += results[i];
+    for (const Result &r : results) {
+        sum += r.p50;
+    }
+    printf("\nAverage p50: %7.2f\n", sum/results.size());
+
+    if (json) {
+        write_json(json, results, frames, warmup, threads);
+    }
+    if (verify) {
+        if (mismatches) {
+            printf("%d frame(s) differ from the reference traversal.\n", mismatches);
+            return 1;
+        }
+        if (ssao_mismatches) {
+            printf("%d image(s) differ from the SSAO at full resolution.\n", ssao_mismatches);
+            return 1;
+        }
+        printf("All frames are identical to those of the reference traversal.\n");
+    }
+    if (baseline) {
+        int regressions = compare(results, read_baseline(baseline), tolerance);
+        if (regressions) {
+            printf("%d scene(s) regressed by more than %.1f%%.\n", regressions, tolerance);
+            return 1;
+        }
     }
-    printf(" | %7.2f\n", sum/scenes);
     return 0;
 }
-
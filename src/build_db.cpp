@@ -20,20 +20,47 @@
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cmath>
 #include <ctime>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 #include "pointset.h"
+#include "spatial_key.h"
 #include "timing.h"
+#include "thread_pool.h"
 #include "octree.h"
+#include "octree_edit.h"
+#include "point_parser.h"
 
 // For outputing the elapsed time.
 static Timer t;
 
+// For the parallelized parts of the conversion.
+static thread_pool * pool;
+
+/** Calls f(begin, end) in parallel for consecutive ranges that together cover [0, n). */
+static void parallel_for(uint64_t n, const std::function<void(uint64_t begin, uint64_t end)> &f) {
+  // Use a few ranges per thread for load balancing, but keep them large enough to amortize the overhead.
+  uint64_t ranges = std::max<uint64_t>(std::min<uint64_t>(pool->size() * 4, n >> 16), 1);
+  uint64_t length = (n + ranges - 1) / ranges;
+  pool->run(ranges, [&](int i, int) {
+    uint64_t begin = i * length;
+    uint64_t end = std::min(begin + length, n);
+    if (begin < end) f(begin, end);
+  });
+}
+
 struct human_filesize {
   uint64_t number;
   const char * suffix;
@@ -57,115 +84,8 @@ struct human_filesize {
  */
 static const int D = 21;
 
-static const uint64_t B[] = {
-  0xFFFF00000000FFFF, 
-  0x00FF0000FF0000FF, 
-  0xF00F00F00F00F00F, 
-  0x30C30C30C30C30C3, 
-  0x9249249249249249,
-};
-static const uint64_t S[] = {32, 16, 8, 4, 2};
-    
-uint64_t morton3d( uint64_t x, uint64_t y, uint64_t z ) {   
-  // pack 3 32-bit indices into a 96-bit Morton code
-  // except that the result is truncated to 64-bit.
-  for (uint64_t i=0; i<5; i++) {
-    x = (x | (x << S[i])) & B[i];
-    y = (y | (y << S[i])) & B[i];
-    z = (z | (z << S[i])) & B[i];
-  }
-  return x | (y<<1) | (z<<2);
-}
-
-uint64_t hilbert3d( const point & p ) {
-  uint64_t val = morton3d( p.x,p.y,p.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  uint64_t ret = 0;
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t rg = ((val>>(3*j))&7) ^ start;
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
-    i = (0x54672310 >> i*4) & 7;
-    ret = (ret<<3) | i;
-    uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
-  }
-  return ret;
-}
-    
-bool hilbert3d_compare( const point & p1,const point & p2 ) {
-  uint64_t val1 = morton3d( p1.x,p1.y,p1.z );
-  uint64_t val2 = morton3d( p2.x,p2.y,p2.z );
-  uint64_t start = 0;
-  uint64_t end = 1; // can be 1,2,4
-  for (int64_t j=19; j>=0; j--) {
-    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
-    uint64_t rg1 = ((val1>>(3*j))&7) ^ start;
-    uint64_t rg2 = ((val2>>(3*j))&7) ^ start;
-    uint64_t i1 = (((rg1 << 3) | rg1) >> travel_shift ) & 7;
-    uint64_t i2 = (((rg2 << 3) | rg2) >> travel_shift ) & 7;
-    i1 = (0x54672310 >> i1*4) & 7;
-    i2 = (0x54672310 >> i2*4) & 7;
-    if (i1<i2) return true;
-    if (i1>i2) return false;
-    uint64_t si = (0x64422000 >> i1*4 ) & 7; // next lower even number, or 0
-    uint64_t ei = (0x77755331 >> i1*4 ) & 7; // next higher odd number, or 7
-    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
-    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
-    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
-    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
-  }
-  return false;
-}
-
-#define CLAMP(x,l,u) (x<l?l:x>u?u:x)
-uint32_t rgb(int32_t r, int32_t g, int32_t b) {
-  return (CLAMP(r,0,255)<<16)|(CLAMP(g,0,255)<<8)|(CLAMP(b,0,255));
-}
-uint32_t rgb(double r, double g, double b) {
-  return rgb((int32_t)(r+0.5),(int32_t)(g+0.5),(int32_t)(b+0.5));
-}
-
-struct weighted_color {
-  double r,g,b;
-  uint64_t n;
-  weighted_color() : r(0), g(0), b(0), n(0) {}
-  weighted_color(uint32_t v) : r((v&0xff0000)>>16), g((v&0xff00)>>8), b((v&0xff)), n(1) {
-    assert(0<=r && r<=255);
-    assert(0<=g && g<=255);
-    assert(0<=b && b<=255);
-  }
-  void operator+=(const weighted_color &w) {
-    r+=w.r;
-    g+=w.g;
-    b+=w.b;
-    n+=w.n;
-  }
-  uint32_t color() {
-    assert(n>0);
-    assert(0<=r && r<=255.*n);
-    assert(0<=g && g<=255.*n);
-    assert(0<=b && b<=255.*n);
-    return rgb(r/n,g/n,b/n);
-  }
-};
-// Note: recursive function, assumes that the octree is indeed a tree.
-weighted_color average(octree* root, uint32_t index) {
-  octree &node = root[index];
-  int n = node.size();
-  assert(n>0);
-  weighted_color c;
-  for (int i=0; i<n; i++) {
-    c += node.is_pointer(i) ? average(root, node.child[i]) : weighted_color(node.color(i));
-  }
-  node.avgcolor = c.color();
-  return c;
-}
+/** Number of hilbert keys that are computed at once by the batch encoder. */
+static const uint64_t KEY_BATCH = 1024;
 
 static uint32_t mask2bitmask[]={0x01,0x03,0x05,0x0f,0x11,0x33,0x55,0xff};
 void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
@@ -180,44 +100,141 @@ void replicate(octree* root, int index, uint32_t mask, uint32_t depth) {
   }
 }
 
+/** Order in which the nodes are stored in the octree file. */
+enum layout_type {
+  LAYOUT_LAYERS, //< Layer by layer, starting with the top layer.
+  LAYOUT_BRICKS, //< Bricks of BRICK_DEPTH layers, each stored in breadth first order, followed by the bricks below it.
+  LAYOUT_VEB,    //< Van Emde Boas order: the top half of the layers, followed by each of the subtrees below it, recursively.
+};
+
 struct arguments {
   const char * infile;
   const char * outfile;
   int repeat_mask;
   int repeat_depth;
+  uint64_t sort_memory; //< Memory budget for sorting in bytes.
+  int threads; //< Number of threads, or 0 to use all hardware threads.
+  layout_type layout;
+  double scale;         //< Scale of the coordinates of a text input file, or 0 if the input is a pointset.
+  bool has_offset;      //< Whether the offset is given, rather than the minimum of the scaled coordinates.
+  int64_t offset[3];    //< Subtracted from the scaled X, Y and Z coordinates of a text input file.
+  const char * append;  //< The octree to which the points are added, or NULL to build a new octree.
+  int append_depth;     //< Depth of the leaves of the octree to which the points are added.
+  int append_shift;     //< Number of bits by which the coordinates are shifted to obtain those leaves.
 };
 
 arguments parse_arguments(int argc, char ** argv) {
-  static const int ARG_INFILE = 1;
-  static const int ARG_OUTFILE = 2;
-  static const int ARG_REPEAT_MASK = 3;
-  static const int ARG_REPEAT_DEPTH = 4;
+  static const int ARG_INFILE = 0;
+  static const int ARG_OUTFILE = 1;
+  static const int ARG_REPEAT_MASK = 2;
+  static const int ARG_REPEAT_DEPTH = 3;
   arguments r;
   r.repeat_mask = 7;
   r.repeat_depth = 0;
+  r.sort_memory = 1024ul << 20;
+  r.threads = 0;
+  r.layout = LAYOUT_LAYERS;
+  r.scale = 0;
+  r.has_offset = false;
+  r.append = NULL;
+  r.append_depth = 0;
+  r.append_shift = 0;
+
+  // Separate the options from the positional arguments.
+  const char * args[4];
+  int argn = 0;
+  for (int i=1; i<argc; i++) {
+    if (argv[i][0]=='-') {
+      if (strcmp(argv[i], "-sort-memory") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        errno = 0;
+        r.sort_memory = strtoul(argv[++i], &endptr, 10) << 20;
+        if (errno || endptr[0] || r.sort_memory == 0) {fprintf(stderr, "Invalid sort memory: %s\n", argv[i]); exit(2);}
+      } else if (strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        errno = 0;
+        r.threads = strtol(argv[++i], &endptr, 10);
+        if (errno || endptr[0] || r.threads < 0) {fprintf(stderr, "Invalid number of threads: %s\n", argv[i]); exit(2);}
+      } else if (strcmp(argv[i], "-layout") == 0 && i+1 < argc) {
+        i++;
+        if (strcmp(argv[i], "layers") == 0) {
+          r.layout = LAYOUT_LAYERS;
+        } else if (strcmp(argv[i], "bricks") == 0) {
+          r.layout = LAYOUT_BRICKS;
+        } else if (strcmp(argv[i], "veb") == 0) {
+          r.layout = LAYOUT_VEB;
+        } else {
+          fprintf(stderr, "Invalid layout: %s\n", argv[i]); exit(2);
+        }
+      } else if (strcmp(argv[i], "-xyz") == 0 && i+1 < argc) {
+        char * endptr = NULL;
+        errno = 0;
+        r.scale = strtod(argv[++i], &endptr);
+        if (errno || endptr[0] || !(r.scale > 0)) {fprintf(stderr, "Invalid scale: %s\n", argv[i]); exit(2);}
+      } else if (strcmp(argv[i], "-offset") == 0 && i+3 < argc) {
+        for (int j=0; j<3; j++) {
+          char * endptr = NULL;
+          errno = 0;
+          r.offset[j] = strtoll(argv[++i], &endptr, 10);
+          if (errno || endptr[0]) {fprintf(stderr, "Invalid offset: %s\n", argv[i]); exit(2);}
+        }
+        r.has_offset = true;
+      } else if (strcmp(argv[i], "-append") == 0 && i+3 < argc) {
+        r.append = argv[++i];
+        char * endptr = NULL;
+        errno = 0;
+        r.append_depth = strtol(argv[++i], &endptr, 10);
+        if (errno || endptr[0] || r.append_depth <= 0 || r.append_depth > D) {fprintf(stderr, "Invalid depth: %s\n", argv[i]); exit(2);}
+        errno = 0;
+        r.append_shift = strtol(argv[++i], &endptr, 10);
+        if (errno || endptr[0] || r.append_shift < 0 || r.append_shift >= D) {fprintf(stderr, "Invalid shift: %s\n", argv[i]); exit(2);}
+      } else {
+        fprintf(stderr,"unrecognized option: %s\n", argv[i]);
+        exit(2);
+      }
+    } else {
+      if (argn == 4) {argn = 5; break;}
+      args[argn++] = argv[i];
+    }
+  }
 
-  if (argc != 3 && argc != 5) {
-    fprintf(stderr,"Usage: %s input_file output_file [repeat_mask repeat_depth]\n", argv[0]);
+  if ((argn != 2 && argn != 4) || (r.has_offset && !r.scale) || (r.append && argn != 2)) {
+    fprintf(stderr,"Usage: %s [-sort-memory MiB] [-threads N] [-layout layers|bricks|veb] [-xyz scale [-offset x y z]] [-append octree depth shift] input_file output_file [repeat_mask repeat_depth]\n", argv[0]);
     fprintf(stderr,"Converts a poinlist (*.vxl) into an octree (*.oc2).\n");
+    fprintf(stderr,"Unsorted pointlists are sorted in place, using at most the given amount of memory (default: 1024MiB).\n");
+    fprintf(stderr,"The nodes are stored layer by layer, unless a different layout is given.\n");
+    fprintf(stderr,"With -xyz the input is a text file with 'x y z r g b' lines, whose coordinates are multiplied by scale\n");
+    fprintf(stderr,"and reduced by the offset (default: their minimum). With -append the points are added to an existing octree\n");
+    fprintf(stderr,"as the leaves at the given depth, after shifting their coordinates by the given number of bits, which requires -offset with -xyz.\n");
+    exit(2);
+  }
+  if (r.append && r.scale && !r.has_offset) {
+    fprintf(stderr, "Appending a text file requires -offset, which should be the offset reported when building the original octree.\n");
+    exit(2);
+  }
+  struct stat appended, output;
+  if (r.append && stat(r.append, &appended) == 0 && stat(args[ARG_OUTFILE], &output) == 0 &&
+      appended.st_dev == output.st_dev && appended.st_ino == output.st_ino) {
+    fprintf(stderr, "The output file must differ from the octree to which the points are appended.\n");
     exit(2);
   }
 
   // Determine the file names.
-  r.infile  = argv[ARG_INFILE];
-  r.outfile = argv[ARG_OUTFILE];
+  r.infile  = args[ARG_INFILE];
+  r.outfile = args[ARG_OUTFILE];
   time_t rawtime = std::time(NULL);
   std::tm * timeinfo = std::localtime(&rawtime);
   printf("[%10.0f] Conversion of pointfile %s into octree %s started at %d:%02d:%02d.\n", t.elapsed(), r.infile, r.outfile, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
 
   // Determine repeat arguments
-  if (argc == 5) {
+  if (argn == 4) {
     char * endptr = NULL;
-    r.repeat_mask  = strtol(argv[ARG_REPEAT_MASK], &endptr, 10);
+    r.repeat_mask  = strtol(args[ARG_REPEAT_MASK], &endptr, 10);
     if (errno) {perror("Could not parse mask"); exit(1);}
     assert(endptr);
     assert(endptr[0]==0);
     assert(r.repeat_mask>=0 && r.repeat_mask<8);
-    r.repeat_depth = strtol(argv[ARG_REPEAT_DEPTH], &endptr, 10);
+    r.repeat_depth = strtol(args[ARG_REPEAT_DEPTH], &endptr, 10);
     if (errno) {perror("Could not parse depth"); exit(1);}
     assert(endptr);
     assert(endptr[0]==0);
@@ -229,32 +246,450 @@ arguments parse_arguments(int argc, char ** argv) {
   return r;
 }
 
+/** A point together with its precomputed position on the hilbert curve. */
+struct keyed_point {
+  uint64_t key;
+  point p;
+  bool operator<(const keyed_point &o) const { return key < o.key; }
+  bool operator>(const keyed_point &o) const { return key > o.key; }
+};
+
+/** A hilbert curve position together with the index of the point in the pointset. */
+struct key_index {
+  uint64_t key;
+  uint64_t index;
+};
+
+/** Sorts data by key using a parallel LSD radix sort on 8-bit digits. The sort is stable.
+ * tmp is used as scratch space. Passes in which all keys have the same digit are skipped.
+ */
+static void radix_sort(std::vector<key_index> &data, std::vector<key_index> &tmp) {
+  const uint64_t n = data.size();
+  const int parts = pool->size();
+  const uint64_t length = (n + parts - 1) / parts;
+  tmp.resize(n);
+  std::vector<uint64_t> count(parts * 256);
+  for (int shift = 0; shift < 64; shift += 8) {
+    // Compute a histogram of the digits per part.
+    std::fill(count.begin(), count.end(), 0);
+    pool->run(parts, [&](int part, int) {
+      uint64_t * c = &count[part * 256];
+      for (uint64_t i = part * length; i < std::min(n, (part+1) * length); i++) {
+        c[(data[i].key >> shift) & 0xff]++;
+      }
+    });
+    // Convert the histograms into write offsets, ordered by digit and then by part.
+    bool trivial = false;
+    uint64_t sum = 0;
+    for (int d=0; d<256; d++) {
+      uint64_t total = 0;
+      for (int part = 0; part < parts; part++) {
+        uint64_t v = count[part * 256 + d];
+        count[part * 256 + d] = sum;
+        sum += v;
+        total += v;
+      }
+      if (total == n) trivial = true;
+    }
+    if (trivial) continue;
+    // Scatter the elements.
+    pool->run(parts, [&](int part, int) {
+      uint64_t * c = &count[part * 256];
+      for (uint64_t i = part * length; i < std::min(n, (part+1) * length); i++) {
+        tmp[c[(data[i].key >> shift) & 0xff]++] = data[i];
+      }
+    });
+    data.swap(tmp);
+  }
+}
+
+/** Computes the hilbert curve positions of the points [begin, end) of list, in parallel, and sorts them. */
+static void sort_run(const point * list, uint64_t begin, uint64_t end, std::vector<key_index> &keys, std::vector<key_index> &tmp) {
+  keys.resize(end - begin);
+  parallel_for(end - begin, [&](uint64_t b, uint64_t e) {
+    uint64_t buffer[KEY_BATCH];
+    for (uint64_t i=b; i<e; i+=KEY_BATCH) {
+      uint64_t n = std::min(e - i, KEY_BATCH);
+      hilbert3d(list + begin + i, buffer, n);
+      for (uint64_t k=0; k<n; k++) {
+        keys[i+k].key = buffer[k];
+        keys[i+k].index = begin + i + k;
+      }
+    }
+  });
+  radix_sort(keys, tmp);
+}
+
+static void pwrite_all(int fd, const void * buf, uint64_t bytes, uint64_t offset, const char * error) {
+  const char * p = (const char *)buf;
+  while (bytes > 0) {
+    ssize_t r = pwrite(fd, p, bytes, offset);
+    if (r <= 0) {perror(error); exit(1);}
+    p += r; bytes -= r; offset += r;
+  }
+}
+
+static void pread_all(int fd, void * buf, uint64_t bytes, uint64_t offset, const char * error) {
+  char * p = (char *)buf;
+  while (bytes > 0) {
+    ssize_t r = pread(fd, p, bytes, offset);
+    if (r <= 0) {perror(error); exit(1);}
+    p += r; bytes -= r; offset += r;
+  }
+}
+
+/** A sorted run of points stored in the temporary file, which is read in blocks during the merge. */
+struct sorted_run {
+  uint64_t next; //< Index in the temporary file of the next record that must be loaded.
+  uint64_t end; //< Index in the temporary file of the end of this run.
+  std::vector<keyed_point> buffer;
+  size_t pos;
+  
+  /** Loads the next block of the run. Returns false if the run is exhausted. */
+  bool refill(int fd, size_t block) {
+    size_t n = std::min<uint64_t>(block, end - next);
+    if (n == 0) return false;
+    buffer.resize(n);
+    pread_all(fd, buffer.data(), n * sizeof(keyed_point), next * sizeof(keyed_point), "Could not read from temporary sort file");
+    next += n;
+    pos = 0;
+    return true;
+  }
+};
+
+/** Merges the sorted runs [bounds[r], bounds[r+1]) of the temporary file with a k-way merge, reading blocks of
+ * the given number of points from each run, and passes the points to out in blocks of the same size.
+ */
+static void merge_runs(int tmp, const std::vector<uint64_t> &bounds, size_t block, const point_sink &out) {
+  uint64_t runs = bounds.size() - 1;
+  std::vector<sorted_run> sources(runs);
+  typedef std::pair<uint64_t, uint64_t> head; // (key, run)
+  std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+  for (uint64_t r=0; r<runs; r++) {
+    sources[r].next = bounds[r];
+    sources[r].end = bounds[r+1];
+    if (sources[r].refill(tmp, block)) {
+      heads.push(head(sources[r].buffer[0].key, r));
+    }
+  }
+  std::vector<point> buffer;
+  buffer.reserve(block);
+  uint64_t merged = 0;
+  while (!heads.empty()) {
+    sorted_run &src = sources[heads.top().second];
+    heads.pop();
+    buffer.push_back(src.buffer[src.pos].p);
+    if (++src.pos < src.buffer.size() || src.refill(tmp, block)) {
+      heads.push(head(src.buffer[src.pos].key, &src - sources.data()));
+    }
+    if (buffer.size() == block || heads.empty()) {
+      out(buffer.data(), buffer.size());
+      merged += buffer.size();
+      buffer.clear();
+      if ((merged / block) % 64 == 0) {
+        printf("[%10.0f] Merging ... %6.2f%%.\n", t.elapsed(), merged*100.0/bounds.back());
+      }
+    }
+  }
+  assert(merged == bounds.back());
+}
+
+/** Sorts the points of in along the hilbert curve using an external merge sort.
+ * The hilbert curve position of each point is computed once. The points are then sorted 
+ * in runs that fit in the memory budget, which are merged with a k-way merge and written back.
+ * If all points fit in a single run, no temporary file is used.
+ */
+void external_sort_points(const arguments &arg, pointset &in) {
+  // Sorting a run requires two key_index arrays and a keyed_point array for the result.
+  uint64_t run_length = std::max<uint64_t>(arg.sort_memory / (2*sizeof(key_index) + sizeof(keyed_point)), 1);
+  uint64_t runs = (in.length + run_length - 1) / run_length;
+  printf("[%10.0f] Sorting points in %lu run(s) of at most %lu points using %d threads.\n", t.elapsed(), runs, run_length, pool->size());
+  madvise(in.list, in.size, MADV_SEQUENTIAL);
+  
+  int tmp = -1;
+  std::string tmpname = std::string(arg.infile) + ".sort.tmp";
+  if (runs > 1) {
+    tmp = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (tmp == -1) {perror("Could not create temporary sort file"); exit(1);}
+    unlink(tmpname.c_str()); // The file is removed once it is closed.
+  }
+  
+  // Create sorted runs.
+  std::vector<key_index> keys, scratch;
+  std::vector<keyed_point> run;
+  for (uint64_t r=0; r<runs; r++) {
+    uint64_t begin = r * run_length;
+    uint64_t end = std::min(begin + run_length, in.length);
+    sort_run(in.list, begin, end, keys, scratch);
+    if (runs == 1) {
+      // Everything fits in memory, write the points back directly.
+      std::vector<point> out(keys.size());
+      parallel_for(keys.size(), [&](uint64_t b, uint64_t e) {
+        for (uint64_t i=b; i<e; i++) out[i] = in.list[keys[i].index];
+      });
+      pwrite_all(in.fd, out.data(), out.size() * sizeof(point), 0, "Could not write sorted points");
+      return;
+    }
+    run.resize(keys.size());
+    parallel_for(keys.size(), [&](uint64_t b, uint64_t e) {
+      for (uint64_t i=b; i<e; i++) {
+        run[i].key = keys[i].key;
+        run[i].p = in.list[keys[i].index];
+      }
+    });
+    pwrite_all(tmp, run.data(), run.size() * sizeof(keyed_point), begin * sizeof(keyed_point), "Could not write to temporary sort file");
+    printf("[%10.0f] Sorted run %lu of %lu.\n", t.elapsed(), r+1, runs);
+  }
+  std::vector<key_index>().swap(keys);
+  std::vector<key_index>().swap(scratch);
+  std::vector<keyed_point>().swap(run);
+  
+  // Merge the runs, using a part of the memory budget for each run plus one for the output.
+  size_t block = std::max<uint64_t>(arg.sort_memory / sizeof(keyed_point) / (runs + 1), 1024);
+  std::vector<uint64_t> bounds;
+  for (uint64_t r=0; r<runs; r++) bounds.push_back(r * run_length);
+  bounds.push_back(in.length);
+  uint64_t written = 0;
+  merge_runs(tmp, bounds, block, [&](const point * points, uint64_t count) {
+    pwrite_all(in.fd, points, count * sizeof(point), written * sizeof(point), "Could not write sorted points");
+    written += count;
+  });
+  assert(written == in.length);
+  close(tmp);
+}
+
 void hilbert_sort_points(const arguments &arg, pointset &in) {
   // Check and possibly sort the data points.
-  printf("[%10.0f] Checking if %d points are sorted.\n", t.elapsed(), in.length);
-  int64_t old = 0;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Checking ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
+  printf("[%10.0f] Checking if %lu points are sorted.\n", t.elapsed(), in.length);
+  std::atomic<uint64_t> unsorted(in.length);
+  parallel_for(in.length, [&](uint64_t begin, uint64_t end) {
+    uint64_t old = begin > 0 ? hilbert3d(in.list[begin-1]) : 0;
+    uint64_t buffer[KEY_BATCH];
+    for (uint64_t b=begin; b<end && b<unsorted; b+=KEY_BATCH) {
+      uint64_t n = std::min(end - b, KEY_BATCH);
+      hilbert3d(in.list + b, buffer, n);
+      uint64_t k=0;
+      while (k<n && old<=buffer[k]) old = buffer[k++];
+      if (k<n) {
+        // Record the first unsorted point.
+        uint64_t i = b + k;
+        uint64_t first = unsorted;
+        while (i < first && !unsorted.compare_exchange_weak(first, i)) {}
+        break;
+      }
     }
-    int64_t cur = hilbert3d(in.list[i]);
-    if (old>cur) {
-      printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), i);
-      if (in.write) {
-        printf("[%10.0f] Sorting points.\n", t.elapsed());
-        in.enable_write(true);
-        // TODO: replace with IO-efficient k-way quicksort, with inline hilbert curve computation.
-        // TODO: branch into multiple threads at some point if cpu usage is high.
-        std::sort(in.list, in.list+in.length, hilbert3d_compare);
-        in.enable_write(false);
-      } else {
-        printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), arg.infile);
-        exit(1);
+  });
+  if (unsorted < in.length) {
+    printf("[%10.0f] Point %lu should precede previous point.\n", t.elapsed(), (uint64_t)unsorted);
+    if (in.write) {
+      external_sort_points(arg, in);
+    } else {
+      printf("[%10.0f] Cannot proceed as '%s' is read only.\n", t.elapsed(), arg.infile);
+      exit(1);
+    }
+  }
+}
+
+/** Bias of the scaled coordinates of a text input file, such that these can be stored before their minimum is known. */
+static const int64_t XYZ_BIAS = 1ll<<31;
+
+/** Parses an 'x y z r g b' line of a text input file into the biased scaled coordinates, in the order of the input, and a color.
+ * Returns false if the line does not contain a point or its coordinates do not fit in 32 bits.
+ */
+static bool parse_xyz(const arguments &arg, const char * s, const char * e, int64_t q[3], uint32_t &color) {
+  double v[3];
+  int32_t r,g,b;
+  if (!(parse_double(s,e,v[0]) && parse_double(s,e,v[1]) && parse_double(s,e,v[2]) && parse_int(s,e,r) && parse_int(s,e,g) && parse_int(s,e,b))) return false;
+  for (int j=0; j<3; j++) {
+    double d = std::floor(v[j] * arg.scale) + XYZ_BIAS;
+    if (!(d >= 0 && d < 2*XYZ_BIAS)) return false;
+    q[j] = d;
+  }
+  color = std::min(std::max(r,0),255)<<16 | std::min(std::max(g,0),255)<<8 | std::min(std::max(b,0),255);
+  return true;
+}
+
+static void no_text_points(const arguments &arg) {
+  fprintf(stderr, "'%s' does not contain any points whose scaled coordinates fit in 32 bits.\n", arg.infile);
+  exit(2);
+}
+
+static void outside_points() {
+  fprintf(stderr, "The coordinates of the points do not range from 0 to 2^%d after subtracting the offset.\n", D);
+  exit(2);
+}
+
+/** Parses the text input file into a temporary pointset next to the output file and returns its name.
+ * The Z axis of the input becomes the vertical Y axis, like in convert2. Stores the minimum of the 
+ * biased coordinates in the order of the input.
+ */
+static std::string import_text_points(const arguments &arg, int64_t minimum[3]) {
+  printf("[%10.0f] Parsing '%s' using %d threads.\n", t.elapsed(), arg.infile, pool->size());
+  std::string name = std::string(arg.outfile) + ".vxl.tmp";
+  std::vector<int64_t> worker_minimum(pool->size() * 3, 2*XYZ_BIAS);
+  pointfile out(name.c_str());
+  uint64_t points = parse_points(arg.infile, 0, out, *pool, [&](const char * s, const char * e, int worker, point &p) {
+    int64_t q[3];
+    uint32_t c;
+    if (!parse_xyz(arg, s, e, q, c)) return false;
+    for (int j=0; j<3; j++) {
+      worker_minimum[worker*3+j] = std::min(worker_minimum[worker*3+j], q[j]);
+    }
+    p = point(q[0], q[2], q[1], c);
+    return true;
+  });
+  printf("[%10.0f] Parsed %lu points.\n", t.elapsed(), points);
+  if (points == 0) {
+    unlink(name.c_str());
+    no_text_points(arg);
+  }
+  for (int j=0; j<3; j++) {
+    minimum[j] = 2*XYZ_BIAS;
+    for (int w=0; w<pool->size(); w++) minimum[j] = std::min(minimum[j], worker_minimum[w*3+j]);
+  }
+  return name;
+}
+
+/** Subtracts the offset from the coordinates of the imported points, which is their minimum unless it is given. */
+static void offset_points(const arguments &arg, pointset &in, const int64_t minimum[3]) {
+  int64_t offset[3];
+  for (int j=0; j<3; j++) {
+    offset[j] = arg.has_offset ? arg.offset[j] + XYZ_BIAS : minimum[j];
+  }
+  printf("[%10.0f] Subtracting offset %ld %ld %ld from the scaled coordinates.\n", t.elapsed(), offset[0] - XYZ_BIAS, offset[1] - XYZ_BIAS, offset[2] - XYZ_BIAS);
+  std::atomic<bool> outside(false);
+  in.enable_write(true);
+  parallel_for(in.length, [&](uint64_t begin, uint64_t end) {
+    bool out = false;
+    for (uint64_t i=begin; i<end; i++) {
+      point &p = in.list[i];
+      int64_t x = p.x - offset[0];
+      int64_t y = p.z - offset[1];
+      int64_t z = p.y - offset[2];
+      out |= x < 0 || y < 0 || z < 0 || x >= 1<<D || y >= 1<<D || z >= 1<<D;
+      p.x = x;
+      p.y = z;
+      p.z = y;
+    }
+    if (out) outside = true;
+  });
+  in.enable_write(false);
+  if (outside) outside_points();
+}
+
+/** Adds length points, which points passes to add in hilbert curve order, to the octree arg.append, as its leaves 
+ * at depth arg.append_depth, and stores the result. 
+ */
+static void append_points(const arguments &arg, uint64_t length, const std::function<void(const point_sink &add)> &points) {
+  printf("[%10.0f] Adding %lu points to '%s'.\n", t.elapsed(), length, arg.append);
+  octree_file base(arg.append);
+  // The points are sorted, hence consecutive points share most of the nodes that they modify.
+  uint32_t capacity = std::min<uint64_t>(length * 64 + (16<<20), 0xffffe000u - base.size);
+  octree_edit edit(&base, capacity);
+  uint64_t outside = 0;
+  points([&](const point * list, uint64_t count) {
+    for (uint64_t i=0; i<count; i++) {
+      const point &p = list[i];
+      uint32_t x = p.x >> arg.append_shift, y = p.y >> arg.append_shift, z = p.z >> arg.append_shift;
+      if ((x | y | z) >> arg.append_depth) {
+        outside++;
+        continue;
       }
-      break;
+      edit.set(x, y, z, arg.append_depth, p.c);
     }
-    old = cur;
+  });
+  if (outside) printf("[%10.0f] Skipped %lu points outside of the octree.\n", t.elapsed(), outside);
+  printf("[%10.0f] Storing octree (%lu bytes of new nodes).\n", t.elapsed(), edit.used());
+  edit.save(arg.outfile);
+}
+
+/** Adds the points of the text input file to the octree arg.append, without storing them as a pointset.
+ * The parsed points are sorted in runs that fit in the memory budget, which are stored in a temporary file
+ * and merged while they are added. If all points fit in a single run, no temporary file is used.
+ */
+static void append_text_points(const arguments &arg) {
+  // Sorting a run requires its points, two key_index arrays and a keyed_point array for the result.
+  uint64_t run_length = std::max<uint64_t>(arg.sort_memory / (sizeof(point) + 2*sizeof(key_index) + sizeof(keyed_point)), 1);
+  printf("[%10.0f] Parsing '%s' using %d threads, sorting its points in runs of at most %lu points.\n", t.elapsed(), arg.infile, pool->size(), run_length);
+  int64_t offset[3];
+  for (int j=0; j<3; j++) {
+    offset[j] = arg.offset[j] + XYZ_BIAS;
+  }
+  std::vector<uint64_t> worker_outside(pool->size(), 0);
+  std::vector<point> points;
+  std::vector<key_index> keys, scratch;
+  std::vector<keyed_point> run;
+  std::vector<uint64_t> bounds(1, 0); // The runs stored in the temporary file.
+  int tmp = -1;
+  auto store_run = [&]() {
+    if (tmp == -1) {
+      std::string tmpname = std::string(arg.outfile) + ".sort.tmp";
+      tmp = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (tmp == -1) {perror("Could not create temporary sort file"); exit(1);}
+      unlink(tmpname.c_str()); // The file is removed once it is closed.
+    }
+    sort_run(points.data(), 0, points.size(), keys, scratch);
+    run.resize(keys.size());
+    parallel_for(keys.size(), [&](uint64_t b, uint64_t e) {
+      for (uint64_t i=b; i<e; i++) {
+        run[i].key = keys[i].key;
+        run[i].p = points[keys[i].index];
+      }
+    });
+    pwrite_all(tmp, run.data(), run.size() * sizeof(keyed_point), bounds.back() * sizeof(keyed_point), "Could not write to temporary sort file");
+    bounds.push_back(bounds.back() + run.size());
+    points.clear();
+    printf("[%10.0f] Sorted run %lu.\n", t.elapsed(), bounds.size() - 1);
+  };
+  uint64_t length = parse_points(arg.infile, 0, *pool, [&](const char * s, const char * e, int worker, point &p) {
+    int64_t q[3];
+    uint32_t c;
+    if (!parse_xyz(arg, s, e, q, c)) return false;
+    int64_t x = q[0] - offset[0], y = q[1] - offset[1], z = q[2] - offset[2];
+    if (x < 0 || y < 0 || z < 0 || x >= 1<<D || y >= 1<<D || z >= 1<<D) {
+      // Skipped like the points that append_points cannot add.
+      worker_outside[worker]++;
+      return false;
+    }
+    p = point(x, z, y, c);
+    return true;
+  }, [&](const point * list, uint64_t count) {
+    while (count > 0) {
+      uint64_t n = std::min(count, run_length - points.size());
+      points.insert(points.end(), list, list + n);
+      list += n;
+      count -= n;
+      if (points.size() == run_length) store_run();
+    }
+  });
+  printf("[%10.0f] Parsed %lu points.\n", t.elapsed(), length);
+  uint64_t outside = 0;
+  for (uint64_t n : worker_outside) outside += n;
+  if (outside) printf("[%10.0f] %lu of the skipped lines contain a point outside of the range from 0 to 2^%d after subtracting the offset.\n", t.elapsed(), outside, D);
+  if (length == 0) no_text_points(arg);
+  
+  if (tmp == -1) {
+    // Everything fits in memory, add the points directly.
+    sort_run(points.data(), 0, points.size(), keys, scratch);
+    std::vector<key_index>().swap(scratch);
+    std::vector<point> sorted(keys.size());
+    parallel_for(keys.size(), [&](uint64_t b, uint64_t e) {
+      for (uint64_t i=b; i<e; i++) sorted[i] = points[keys[i].index];
+    });
+    std::vector<point>().swap(points);
+    std::vector<key_index>().swap(keys);
+    append_points(arg, length, [&](const point_sink &add) { add(sorted.data(), sorted.size()); });
+    return;
   }
+  if (!points.empty()) store_run();
+  std::vector<point>().swap(points);
+  std::vector<key_index>().swap(keys);
+  std::vector<key_index>().swap(scratch);
+  std::vector<keyed_point>().swap(run);
+  uint64_t runs = bounds.size() - 1;
+  size_t block = std::max<uint64_t>(arg.sort_memory / sizeof(keyed_point) / (runs + 1), 1024);
+  append_points(arg, length, [&](const point_sink &add) { merge_runs(tmp, bounds, block, add); });
+  close(tmp);
 }
 
 /** Stores the number of nodes per layer and some additional information.
@@ -274,25 +709,37 @@ layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
   // Used to determine file structure and size.
   // Layers are counted as well.
   printf("[%10.0f] Counting nodes per layer.\n", t.elapsed());
+  // Count in parallel over ranges of the sorted points. Each range compares its first point
+  // with the last point of the preceding range, such that the sum over the ranges is exact.
+  std::mutex lock;
   int64_t maxnode=0;
   for (int j=0; j<D; j++) r.nodecount[j]=0;
-  int64_t old = -1;
-  for (uint64_t i=0; i<in.length; i++) {
-    if (i && (i&0x3fffff)==0) {
-      printf("[%10.0f] Counting ... %6.2f%%.\n", t.elapsed(), i*100.0/in.length);
+  parallel_for(in.length, [&](uint64_t begin, uint64_t end) {
+    uint64_t nodecount[D] = {0};
+    int64_t max = 0;
+    int64_t old = -1;
+    if (begin > 0) {
+      point q = in.list[begin-1];
+      old = morton3d(q.x, q.y, q.z);
     }
-    point q = in.list[i];
-    assert(q.c<0x1000000);    
-    int64_t cur = morton3d(q.x, q.y, q.z);
-    for (int j=0; j<D; j++) {
-      if ((cur>>j*3)!=(old>>j*3)) {
-        r.nodecount[j]++;
+    for (uint64_t i=begin; i<end; i++) {
+      point q = in.list[i];
+      assert(q.c<0x1000000);    
+      int64_t cur = morton3d(q.x, q.y, q.z);
+      for (int j=0; j<D; j++) {
+        if ((cur>>j*3)!=(old>>j*3)) {
+          nodecount[j]++;
+        }
       }
+      old = cur;
+      if (max<cur)
+        max=cur;
     }
-    old = cur;
-    if (maxnode<cur)
-      maxnode=cur;
-  }
+    std::lock_guard<std::mutex> l(lock);
+    for (int j=0; j<D; j++) r.nodecount[j] += nodecount[j];
+    if (maxnode<max)
+      maxnode=max;
+  });
   
   // Determine top layer
   printf("[%10.0f] Counting layers (maxnode=0x%lx).\n", t.elapsed(), maxnode);
@@ -330,8 +777,8 @@ layer_info count_nodes_per_layer(const arguments &arg, const pointset &in) {
  * and describe the position in the octree node array.
  */
 struct file_info {
-  uint32_t layer_start[D];
-  uint32_t layer_end[D];
+  uint32_t layer_start[D+2]; //< Indexed up to top_repeat_layer+1, which can exceed D-1.
+  uint32_t layer_end[D+2];
   uint64_t filesize;
 };
 
@@ -340,7 +787,7 @@ struct file_info {
 file_info compute_file_structure(const layer_info &layers) {
   file_info r;
 
-  for (int j=0; j<D; j++) {r.layer_start[j]=0; r.layer_end[j]=0;}
+  for (int j=0; j<D+2; j++) {r.layer_start[j]=0; r.layer_end[j]=0;}
   r.filesize = 0;
   // Repeated & top layers get room for the bitmask/color and 8 children.
   // Note: layers.nodecount[layers.top_data_layer]==1.
@@ -359,12 +806,100 @@ file_info compute_file_structure(const layer_info &layers) {
   return r;
 }
 
-void write_points(octree* root, const pointset &in, const layer_info &layers, const file_info &file) {
+/** Number of consecutive nodes of a layer whose average colors are computed by a single task. */
+static const uint64_t CHUNK_NODES = 1<<14;
+
+/** The first node of each chunk of CHUNK_NODES consecutive nodes of each layer, as stored by write_points.
+ * These allow processing the nodes of a layer in parallel, which cannot be split at arbitrary indices 
+ * as the nodes have a variable size.
+ */
+struct layer_chunks {
+  uint64_t nodes[D+1];              //< Number of nodes in each layer.
+  std::vector<uint32_t> start[D+1]; //< Index of the first node of each chunk.
+  std::vector<uint64_t> below[D+1]; //< Number of nodes in the layer below that precede the children of that node.
+};
+
+/** Sums of the colors of the leaves below a node. */
+struct color_sum {
+  uint64_t r,g,b,n;
+  color_sum() : r(0), g(0), b(0), n(0) {}
+  void add(uint32_t v) {
+    r+=(v&0xff0000)>>16;
+    g+=(v&0xff00)>>8;
+    b+=(v&0xff);
+    n++;
+  }
+  void operator+=(const color_sum &s) {
+    r+=s.r;
+    g+=s.g;
+    b+=s.b;
+    n+=s.n;
+  }
+  /** The average color, rounded to nearest. */
+  uint32_t color() const {
+    assert(n>0);
+    return (2*r+n)/(2*n)<<16 | (2*g+n)/(2*n)<<8 | (2*b+n)/(2*n);
+  }
+};
+
+/** Computes the average color of a node whose children are leaves. */
+static color_sum average_leaves(octree &node) {
+  color_sum s;
+  for (uint32_t i=0; i<node.size(); i++) {
+    s.add(node.color(i));
+  }
+  node.avgcolor = s.color();
+  return s;
+}
+
+/** Computes the average colors of the nodes, where each child is weighted by its number of leaves.
+ * The layers are processed bottom up and the chunks of a layer in parallel. Each pass reads its layer and 
+ * the sums of the layer below sequentially, as the children are stored in the order of their parents.
+ * The nodes above the leaves are computed by the pass of their parents, such that the sums of the 
+ * largest layer are not stored. Assumes that the octree is indeed a tree, hence it precedes replicate.
+ */
+void average(octree* root, const layer_info &layers, const layer_chunks &chunks) {
+  std::vector<color_sum> below, current;
+  for (int l = std::min(layers.bottom_layer+2, layers.top_repeat_layer); l <= layers.top_repeat_layer; l++) {
+    bool leaves = l == layers.bottom_layer+1;
+    bool fused = l == layers.bottom_layer+2;
+    current.assign(chunks.nodes[l], color_sum());
+    pool->run(chunks.start[l].size(), [&](int c, int) {
+      uint32_t index = chunks.start[l][c];
+      uint64_t k = chunks.below[l][c];
+      uint64_t end = std::min((c+1)*CHUNK_NODES, chunks.nodes[l]);
+      for (uint64_t i=c*CHUNK_NODES; i<end; i++) {
+        octree &node = root[index];
+        uint32_t n = node.size();
+        assert(n>0);
+        color_sum &s = current[i];
+        for (uint32_t j=0; j<n; j++) {
+          if (leaves) {
+            s.add(node.color(j));
+          } else if (fused) {
+            s += average_leaves(root[node.child[j]]);
+          } else {
+            // The children are stored by their index, rather than in the order in which they were created.
+            uint32_t rank = 0;
+            for (uint32_t m=0; m<n; m++) rank += node.child[m] < node.child[j];
+            s += below[k + rank];
+          }
+        }
+        node.avgcolor = s.color();
+        k += n;
+        index += 1 + n;
+      }
+    });
+    below.swap(current);
+  }
+}
+
+void write_points(octree* root, const pointset &in, const layer_info &layers, const file_info &file, layer_chunks &chunks) {
   // Read voxels and store them.
   printf("[%10.0f] Storing points.\n", t.elapsed());
   uint64_t bytes_written = 0;
-  uint32_t location[D]; //< Writing location for data of each layer.
-  for (uint32_t i=0; i<D; i++) {
+  uint32_t location[D+1]; //< Writing location for data of each layer.
+  for (uint32_t i=0; i<=D; i++) {
     location[i] = file.layer_start[i];
   }
   // Create rootnode
@@ -372,8 +907,12 @@ void write_points(octree* root, const pointset &in, const layer_info &layers, co
   root[0].avgcolor = 0xeeeeee;
   location[layers.top_repeat_layer]++;
   bytes_written += 4;
+  for (int i=0; i<=D; i++) chunks.nodes[i] = 0;
+  chunks.nodes[layers.top_repeat_layer] = 1;
+  chunks.start[layers.top_repeat_layer].push_back(0);
+  chunks.below[layers.top_repeat_layer].push_back(0);
   // Process file.
-  for (uint32_t i=0; i<in.length; i++) {
+  for (uint64_t i=0; i<in.length; i++) {
     // Periodically print some progress info every 4MiPoints.
     if (i && (i&0x3fffff)==0) {
       human_filesize bytes(bytes_written);
@@ -417,6 +956,12 @@ void write_points(octree* root, const pointset &in, const layer_info &layers, co
           root[next].bitmask = 0;
           root[next].avgcolor = 0xeeeeee;
           cur->child[pos] = next;
+          // Nodes are created in the order in which they are stored.
+          if (chunks.nodes[depth] % CHUNK_NODES == 0) {
+            chunks.start[depth].push_back(next);
+            chunks.below[depth].push_back(chunks.nodes[depth-1]);
+          }
+          chunks.nodes[depth]++;
         }
         assert(cur->child[pos]<file.layer_end[depth]);
         cur = &root[cur->child[pos]];
@@ -425,32 +970,174 @@ void write_points(octree* root, const pointset &in, const layer_info &layers, co
   }
 }
 
+/** Number of layers in a brick of LAYOUT_BRICKS. 
+ * A brick contains at most 1+8+64 nodes, which usually fit in a single page.
+ */
+static const int BRICK_DEPTH = 3;
+
+/** Copies the nodes of an octree into a different layout.
+ * Shared subtrees, as created by replicate, are copied once. These are assumed to occur 
+ * at the same depth, as their children are laid out when they are first encountered.
+ * Note that the source octree is destroyed, as the headers of nodes that are copied 
+ * are replaced by their new index.
+ */
+struct node_layout {
+  octree * src;
+  octree * dst;
+  std::vector<bool> moved;
+  uint32_t next;
+
+  node_layout(octree * src, octree * dst, uint64_t words) : src(src), dst(dst), moved(words), next(0) {}
+
+  /** New index of a node that has been copied. */
+  uint32_t target(uint32_t index) const {
+    return *(const uint32_t*)&src[index];
+  }
+  const octree & node(uint32_t index) const {
+    return moved[index] ? dst[target(index)] : src[index];
+  }
+  /** Number of layers of the subtree rooted at index, where leaf colors are not counted. */
+  int height(uint32_t index) const {
+    const octree & n = node(index);
+    for (uint32_t i=0; i<n.size(); i++) {
+      if (n.is_pointer(i)) return 1 + height(n.child[i]);
+    }
+    return 1;
+  }
+  void copy(uint32_t index) {
+    if (moved[index]) return;
+    const octree & n = src[index];
+    memcpy(&dst[next], &n, (1 + n.size()) * sizeof(octree));
+    *(uint32_t*)&src[index] = next;
+    moved[index] = true;
+    next += 1 + dst[next].size();
+  }
+  /** Calls f for each node that is depth layers below index. Consecutive duplicate children are only visited once. */
+  template<class F> void for_each_at_depth(uint32_t index, int depth, const F &f) {
+    if (depth == 0) {
+      f(index);
+      return;
+    }
+    const octree & n = node(index);
+    for (uint32_t i=0; i<n.size(); i++) {
+      if (n.is_pointer(i) && (i == 0 || n.child[i] != n.child[i-1])) {
+        for_each_at_depth(n.child[i], depth-1, f);
+      }
+    }
+  }
+  void bricks(uint32_t index, int height) {
+    if (moved[index]) return;
+    int depth = std::min(height, BRICK_DEPTH);
+    for (int i=0; i<depth; i++) {
+      for_each_at_depth(index, i, [this](uint32_t c){ copy(c); });
+    }
+    if (height > depth) {
+      for_each_at_depth(index, depth, [this, height, depth](uint32_t c){ bricks(c, height - depth); });
+    }
+  }
+  void veb(uint32_t index, int height) {
+    if (moved[index]) return;
+    if (height == 1) {
+      copy(index);
+      return;
+    }
+    int top = height / 2;
+    veb(index, top);
+    for_each_at_depth(index, top, [this, height, top](uint32_t c){ veb(c, height - top); });
+  }
+  /** Replaces the child pointers in dst by the new indices of the children. */
+  void relink() {
+    for (uint32_t i=0; i<next; i += 1 + dst[i].size()) {
+      octree & n = dst[i];
+      for (uint32_t j=0; j<n.size(); j++) {
+        if (n.is_pointer(j)) {
+          assert(moved[n.child[j]]);
+          n.child[j] = target(n.child[j]);
+        }
+      }
+    }
+  }
+};
+
+/** Copies the octree in src into dst in the given layout and returns its size in bytes, which may be less than the source. */
+uint64_t reorder_nodes(octree * src, octree * dst, uint64_t size, layout_type layout) {
+  node_layout l(src, dst, size / sizeof(octree));
+  int height = l.height(0);
+  if (layout == LAYOUT_BRICKS) {
+    l.bricks(0, height);
+  } else {
+    l.veb(0, height);
+  }
+  l.relink();
+  return l.next * sizeof(octree);
+}
+
+/** Stores the points in the octree, in layer order, and computes its average colors. */
+void build_octree(octree * root, const pointset &in, const arguments &arg, const layer_info &layers, const file_info &file) {
+  layer_chunks chunks;
+  write_points(root, in, layers, file, chunks);
+  
+  printf("[%10.0f] Computing average colors.\n", t.elapsed());
+  average(root, layers, chunks);
+  
+  printf("[%10.0f] Replicating model.\n", t.elapsed());
+  replicate(root, 0, arg.repeat_mask, arg.repeat_depth);
+}
+
 int main(int argc, char ** argv){ 
   arguments arg = parse_arguments(argc, argv);
+  thread_pool threads(arg.threads);
+  pool = &threads;
   
   // Map input file to memory
-  printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), arg.infile);
-  pointset in(arg.infile, true);
+  if (arg.scale && arg.append) {
+    append_text_points(arg);
+    printf("[%10.0f] Done.\n", t.elapsed());
+    return 0;
+  }
+  std::string infile = arg.infile;
+  int64_t minimum[3];
+  if (arg.scale) {
+    infile = import_text_points(arg, minimum);
+  }
+  printf("[%10.0f] Opening '%s' read/write.\n", t.elapsed(), infile.c_str());
+  pointset in(infile.c_str(), true);
+  if (arg.scale) {
+    if (unlink(infile.c_str())) {perror("Could not unlink temporary pointset"); exit(1);}
+    offset_points(arg, in, minimum);
+  }
   
   hilbert_sort_points(arg, in);
   
+  if (arg.append) {
+    append_points(arg, in.length, [&](const point_sink &add) { add(in.list, in.length); });
+    printf("[%10.0f] Done.\n", t.elapsed());
+    return 0;
+  }
+  
   layer_info layers = count_nodes_per_layer(arg, in);
   file_info file = compute_file_structure(layers);
   
   // Prepare output file and map it to memory
   human_filesize size(file.filesize);
   printf("[%10.0f] Creating octree file (%lu%sB).\n", t.elapsed(), size.number, size.suffix);
-  octree_file out(arg.outfile, file.filesize);
-  
-  write_points(out.root, in, layers, file);
-  
-  printf("[%10.0f] Computing average colors.\n", t.elapsed());
-  average(out.root, 0);
-  
-  printf("[%10.0f] Replicating model.\n", t.elapsed());
-  replicate(out.root, 0, arg.repeat_mask, arg.repeat_depth);
+  if (arg.layout == LAYOUT_LAYERS) {
+    octree_file out(arg.outfile, file.filesize);
+    build_octree(out.root, in, arg, layers, file);
+  } else {
+    // Build the octree in layer order in a temporary file and copy it into the output file in the requested order.
+    std::string tmpname = std::string(arg.outfile) + ".tmp";
+    octree_file tmp(tmpname.c_str(), file.filesize);
+    if (unlink(tmpname.c_str())) {perror("Could not unlink temporary octree file"); exit(1);}
+    build_octree(tmp.root, in, arg, layers, file);
+    printf("[%10.0f] Reordering nodes.\n", t.elapsed());
+    octree_file out(arg.outfile, file.filesize);
+    uint64_t size = reorder_nodes(tmp.root, out.root, file.filesize, arg.layout);
+    if (ftruncate(out.fd, size)) {perror("Could not truncate octree file"); exit(1);}
+  }
 
   // Done with conversion, clean up.
+  printf("[%10.0f] Leaves are at depth %d and contain the points shifted by %d bits (see -append).\n", t.elapsed(), layers.top_repeat_layer - layers.bottom_layer, layers.bottom_layer);
   printf("[%10.0f] Done.\n", t.elapsed());
 }
 
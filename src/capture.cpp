@@ -20,9 +20,19 @@
 # define FOUND_LIBAV
 #endif
 
+#include <cassert>
 #include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "capture.h"
+#include "trace.h"
 
 #ifdef FOUND_LIBAV
 
@@ -52,10 +62,29 @@ struct CaptureData {
     SwsContext *img_convert_ctx;
     int frame_count;
     AVCodecContext * c;
-    uint8_t * buffer;
     AVPacket pkt;
 
-    CaptureData(const char* filename, surface surf) { 
+    // The frames queued for the encoder, which form a single producer, single consumer ring buffer.
+    // Only shoot() advances head and only the encoder thread advances tail.
+    std::vector<std::unique_ptr<uint32_t[]>> slots;
+    std::vector<int64_t> stamps; // The frame index of each slot, which is its presentation time in units of 1/framerate.
+    std::atomic<uint64_t> head, tail;
+    std::atomic<uint64_t> dropped;
+    
+    // Used by shoot() to compute the frame index from the time since the first frame.
+    int framerate;
+    std::chrono::steady_clock::time_point start;
+    int64_t last; // The index of the last queued or dropped frame, or -1.
+    
+    // Used to wake the encoder thread when it is idle.
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stop;
+    std::thread worker;
+
+    CaptureData(const char* filename, surface surf, const capture_settings &settings)
+      : head(0), tail(0), dropped(0), framerate(settings.framerate), last(-1), stop(false)
+    { 
         av_register_all();
         AVOutputFormat * fmt = av_guess_format("mp4", NULL, NULL);
         if (fmt == nullptr) {
@@ -76,29 +105,32 @@ struct CaptureData {
             fprintf(stderr, "Failed to create video stream.\n");
             exit(1);
         }
+        AVCodec *codec;
+        if (settings.codec) {
+            codec = avcodec_find_encoder_by_name(settings.codec);
+        } else {
+            codec = avcodec_find_encoder(fmt->video_codec);
+        }
+        if (codec == nullptr) {
+            fprintf(stderr, "Failed to find video codec.\n");
+            exit(1);
+        }
         c = video_st->codec;
-        c->codec_id = fmt->video_codec;
+        c->codec_id = codec->id;
         c->codec_type = AVMEDIA_TYPE_VIDEO;
-        c->bit_rate = 4000000;
+        c->bit_rate = settings.bitrate;
         c->width = surf.width;
         c->height = surf.height;
         c->gop_size = 25;
         c->pix_fmt = PIX_FMT_YUV420P;
         c->flags |= CODEC_FLAG_GLOBAL_HEADER;
-        c->time_base.den = video_st->time_base.den = 10;
+        c->time_base.den = video_st->time_base.den = settings.framerate;
         c->time_base.num = video_st->time_base.num = 1;
         
         av_dump_format(oc, 0, oc->filename, 1);
 
         /* now that all the parameters are set, we can open the 
         video codec and allocate the necessary encode buffers */
-        /* find the video encoder */
-        AVCodec *codec = avcodec_find_encoder(c->codec_id);
-        if (codec == nullptr) {
-            fprintf(stderr, "Failed to find video codec.\n");
-            exit(1);
-        }
-        
         /* open the codec */
         int ret = avcodec_open2(c, codec, nullptr);
         check_return(ret, "Could not open audio codec");
@@ -128,7 +160,10 @@ struct CaptureData {
             fprintf(stderr, "capture.cpp:Cannot initialize the conversion context\n");
             exit(1);
         }
-        buffer = (uint8_t*)surf.data;
+        for (int i=0; i<std::max(settings.buffers, 1); i++) {
+            slots.emplace_back(new uint32_t[surf.width * surf.height]);
+        }
+        stamps.resize(slots.size());
         
         /* open the output file, if needed */
 #ifndef AVIO_FLAG_WRITE
@@ -146,9 +181,50 @@ struct CaptureData {
 
         pkt.data= video_outbuf;
         pkt.size= video_outbuf_size;
+        
+        worker = std::thread(&CaptureData::main, this);
     }
 
-    void shoot() {
+    /** Called by the render thread. 
+     * The frame is stamped with the time since the first frame, such that the video plays at the speed at which it was
+     * rendered. Frames that arrive within the same 1/framerate interval as the previous frame are skipped. */
+    void shoot(const surface &surf) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (last < 0) start = now;
+        int64_t index = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count() * framerate / 1000000;
+        if (index <= last) return;
+        last = index;
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == slots.size()) {
+            dropped++;
+            return;
+        }
+        assert((int)surf.width == c->width && (int)surf.height == c->height);
+        std::copy_n(surf.data, surf.width * surf.height, slots[h % slots.size()].get());
+        stamps[h % slots.size()] = index;
+        head.store(h + 1, std::memory_order_release);
+        // Taking the lock ensures that the wake up cannot be lost between the check and the wait of the encoder thread.
+        { std::lock_guard<std::mutex> l(lock); }
+        wake.notify_one();
+    }
+
+    /** The encoder thread. */
+    void main() {
+        for (;;) {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                std::unique_lock<std::mutex> l(lock);
+                if (stop) return;
+                wake.wait(l, [&]{ return stop || t != head.load(std::memory_order_acquire); });
+                continue;
+            }
+            encode((const uint8_t*)slots[t % slots.size()].get(), stamps[t % slots.size()]);
+            tail.store(t + 1, std::memory_order_release);
+        }
+    }
+
+    void encode(const uint8_t * buffer, int64_t pts) {
+        TRACE_ZONE("Capture::encode");
         const uint8_t * const myrgb[4]={buffer,0,0,0};
         int mylinesize[4]={c->width*4,0,0,0};
 
@@ -160,12 +236,14 @@ struct CaptureData {
         //int out_size = avcodec_encode_video(c, video_outbuf, video_outbuf_size, picture);
         int got_packet=0;
         av_init_packet(&pkt);
+        picture->pts = pts;
         int ret = avcodec_encode_video2(c, &pkt, picture, &got_packet);
         check_return(ret, "Error encoding video frame");
         /* if no packet, it means the image was buffered */
         if (got_packet) {
             /* write the compressed frame in the media file */
-            pkt.pts = pkt.dts = picture->pts = AV_NOPTS_VALUE; // Somehow necessary to fix the fps.
+            // The muxer may have changed the time base of the stream, which is 1/framerate for the encoder.
+            av_packet_rescale_ts(&pkt, c->time_base, video_st->time_base);
             pkt.stream_index= video_st->index;
             ret = av_interleaved_write_frame(oc, &pkt);
             check_return(ret, "Error while writing video frame");
@@ -182,7 +260,8 @@ struct CaptureData {
             check_return(ret, "Error encoding video frame");
             if (!got_packet) break;
             /* write the compressed frame in the media file */
-            pkt.pts = pkt.dts = picture->pts = AV_NOPTS_VALUE; // Somehow necessary to fix the fps.
+            // The muxer may have changed the time base of the stream, which is 1/framerate for the encoder.
+            av_packet_rescale_ts(&pkt, c->time_base, video_st->time_base);
             pkt.stream_index= video_st->index;
             ret = av_interleaved_write_frame(oc, &pkt);
             check_return(ret, "Error while writing video frame");
@@ -191,6 +270,13 @@ struct CaptureData {
     
     void end()
     {
+        // The encoder thread stops once all queued frames are encoded.
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stop = true;
+        }
+        wake.notify_one();
+        worker.join();
         sws_freeContext(img_convert_ctx);
         
         flush();
@@ -218,19 +304,28 @@ struct CaptureData {
 
         /* free the stream */
         av_free(oc);
-        printf("capture.cpp: Movie saved! frames: %d\n",frame_count);
+        printf("capture.cpp: Movie saved! frames: %d, dropped: %lu\n",frame_count,(unsigned long)dropped);
     }
 };
 
-Capture::Capture(const char* filename, surface surf)
-    : data(new CaptureData(filename, surf)) {
+Capture::Capture(const char* filename, surface surf, const capture_settings &settings)
+    : data(new CaptureData(filename, surf, settings)) {
 }
 
-void Capture::shoot() {
+void Capture::shoot(const surface &surf) {
     if (data) {
-        data->shoot();
+        TRACE_ZONE("Capture::shoot");
+        data->shoot(surf);
     }
 }
+
+uint64_t Capture::frames() const {
+    return data ? data->head.load() : 0;
+}
+
+uint64_t Capture::dropped() const {
+    return data ? data->dropped.load() : 0;
+}
     
 void Capture::end() {
     if (data) {
@@ -246,9 +341,11 @@ Capture::~Capture() {
 
 #else
 // FFMPEG is not available, so provide dummy implementations.
-Capture::Capture(const char*, surface) : data(nullptr) {}
-void Capture::shoot() {}
+Capture::Capture(const char*, surface, const capture_settings &) : data(nullptr) {}
+void Capture::shoot(const surface &) {}
 void Capture::end() {}
+uint64_t Capture::frames() const { return 0; }
+uint64_t Capture::dropped() const { return 0; }
 Capture::~Capture() {}
 
 #endif
@@ -19,18 +19,39 @@
 
 #ifndef CAPTURE_H
 #define CAPTURE_H
+#include <stdint.h>
 #include "surface.h"
 
+/** Settings of the video capture. */
+struct capture_settings {
+    int framerate;      //< Maximum frames per second of the video.
+    int bitrate;        //< In bits per second.
+    const char * codec; //< Name of the ffmpeg encoder, or null for the default codec of mp4.
+    int buffers;        //< Number of frames that can be queued for the encoder, before frames are dropped.
+    capture_settings() : framerate(10), bitrate(4000000), codec(nullptr), buffers(3) {}
+};
+
+/** Records the contents of a surface as a mp4 video.
+ * The frames are encoded on a separate thread: shoot() only copies the surface into a free buffer
+ * and hands it to the encoder. If the encoder cannot keep up and all buffers are in use, the frame is dropped.
+ * Each frame is stamped with the time at which it was shot, rounded down to a multiple of 1/framerate, such that the video
+ * plays at the speed at which it was rendered. Frames shot within the same 1/framerate interval as the previous frame are skipped.
+ */
 class Capture {
     struct CaptureData * data;
 public:
     Capture() : data(nullptr) {}
-    Capture(const char * filename, surface surf);
+    Capture(const char * filename, surface surf, const capture_settings &settings = capture_settings());
     Capture(Capture&& other) : data(other.data) { other.data=nullptr; }
     void operator=(Capture&& other) { end(); data=other.data; other.data=nullptr; }
     ~Capture();
-    void shoot();
+    /** Queues the current contents of the given surface, which must have the size of the video, for encoding. */
+    void shoot(const surface &surf);
+    /** Encodes the queued frames and closes the video. */
     void end();
+    /** The number of frames that were queued and dropped, respectively. */
+    uint64_t frames() const;
+    uint64_t dropped() const;
 };
 
 #endif // CAPTURE_H
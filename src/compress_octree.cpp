@@ -0,0 +1,47 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+
+#include "octree.h"
+#include "octree_compress.h"
+#include "timing.h"
+
+/* Converts an octree file (*.oc2) into the compressed format (*.oc3).
+ * The compressed format is described in octree_compress.h.
+ */
+
+int main(int argc, char ** argv) {
+  if (argc != 3) {
+    fprintf(stderr,"Usage: %s input_file output_file\n", argv[0]);
+    fprintf(stderr,"Compresses an octree (*.oc2) into the compact octree format (*.oc3).\n");
+    exit(2);
+  }
+  Timer t;
+  octree_file in(argv[1]);
+  printf("[%10.0f] Loaded '%s' (%u bytes).\n", t.elapsed(), argv[1], in.size);
+  octree_compress(in.root, in.size, argv[2]);
+  struct stat s;
+  if (stat(argv[2], &s)) {perror("Could not stat output file"); exit(1);}
+  printf("[%10.0f] Stored '%s' (%lu bytes, %.1f%%).\n", t.elapsed(), argv[2], (uint64_t)s.st_size, s.st_size * 100.0 / in.size);
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
@@ -19,6 +19,13 @@
 #include <cstdio>
 #include <cstring>
 #include <algorithm>
+#include <vector>
+#include <unistd.h>
+
+#include "pointset.h"
+#include "point_parser.h"
+#include "thread_pool.h"
+
 /*
  * Mouna Loa:
  * x: 22600000 - 22999999
@@ -28,71 +35,74 @@
  * lines: 135833540
  */
 
-void open_file(char * name) {
+int main(int argc, char ** argv) {
+  if (argc != 2) {
+    fprintf(stderr,"Please specify the file to convert (without '.txt').\n");
+    exit(2);
+  }
   // Determine the file names.
-  int length=strlen(name)+5;
-  char infile[length];
-  char outfile[length];
+  char * name = argv[1];
+  int length=strlen(name);
+  char infile[length+11];
+  char outfile[length+9];
   sprintf(infile, "input/%s.txt", name);
   sprintf(outfile, "vxl/%s.vxl", name);
   
   // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
+  if (access(infile, R_OK)) {
     fprintf(stderr,"Failed to open '%s' for input.\n", infile);
     exit(2);
   }
-  res = freopen( outfile, "w", stdout );
-  if (res==NULL) {
-    fprintf(stderr,"Failed to open '%s' for output.\n", outfile);
-    exit(2);
-  }
-}
-
-int main(int argc, char ** argv) {
-  if (argc != 2) {
-    fprintf(stderr,"Please specify the file to convert (without '.txt').\n");
-    exit(2);
-  }
-  open_file(argv[1]);
+  pointfile out(outfile);
+  thread_pool pool;
 
-  char header[1000];
-  fgets(header,1000,stdin);
-  int x1,x2,y1,y2,z1,z2;
-  int clas, t1, t2, angle;
-  int intensity,rets,retno, ptsrc;
-  int eflf, dosf, ud, r,g,b;
-  int minx=1e9,miny=1e9,minz=1e9;
-  int maxx=0,  maxy=0,  maxz=0;
-  int minint=1e9, maxint=0;
-  int line=0;
-  double int_mean=0;
-  for(;;) {
-    if(line%100000==0) fprintf(stderr,"line: %fM\n", line/1.e6);
-    int ret = scanf("%d.%d,%d.%d,%d.%d,", &x1,&x2,&y1,&y2,&z1,&z2);
-    if (ret < 6) break;
+  // Do the conversion, skipping the table header. Each worker keeps track of the bounds of its points.
+  struct bounds {
+    int minx,miny,minz;
+    int maxx,maxy,maxz;
+    int minint,maxint;
+    int64_t int_sum;
+  };
+  std::vector<bounds> range(pool.size(), bounds{(int)1e9,(int)1e9,(int)1e9,0,0,0,(int)1e9,0,0});
+  uint64_t lines = parse_points(infile, 1, out, pool, [&](const char * s, const char * e, int worker, point &p) {
+    int32_t x1,x2,y1,y2,z1,z2;
+    int32_t clas, t1, t2, angle;
+    int32_t intensity;
+    if (!(parse_int(s,e,x1) && parse_char(s,e,'.') && parse_int(s,e,x2) && parse_char(s,e,',') &&
+          parse_int(s,e,y1) && parse_char(s,e,'.') && parse_int(s,e,y2) && parse_char(s,e,',') &&
+          parse_int(s,e,z1) && parse_char(s,e,'.') && parse_int(s,e,z2) && parse_char(s,e,',') &&
+          parse_int(s,e,clas) && parse_char(s,e,',') && parse_int(s,e,t1) && parse_char(s,e,'.') && parse_int(s,e,t2) && parse_char(s,e,',') &&
+          parse_int(s,e,angle) && parse_char(s,e,',') && parse_int(s,e,intensity))) return false;
     x1*=100; x1+=x2; x1 -= 22600000;  
     y1*=100; y1+=y2; y1 -= 215100000; 
     z1*=100; z1+=z2; z1 -= 373846;    
-    if(minx>x1) minx=x1; if(maxx<x1) maxx=x1;
-    if(miny>y1) miny=y1; if(maxy<y1) maxy=y1;
-    if(minz>z1) minz=z1; if(maxz<z1) maxz=z1;
-    scanf("%d,%d.%d,%d,", &clas,&t1,&t2,&angle);
-    t1*=1000000; t1+=t2;
-    scanf("%d,%d,%d,%d,", &intensity, &rets, &retno, &ptsrc);
-    if(minint>intensity) minint=intensity;
-    if(maxint<intensity) maxint=intensity;
-    int_mean += intensity;
-    scanf("%d,%d,%d,%d,%d,%d", &eflf, &dosf, &ud, &r, &g, &b);
-    printf("%d %d %d %6x\n", x1, z1, y1, 0x10101 * std::min(255, intensity*6));
-    line++;
+    bounds &w = range[worker];
+    if(w.minx>x1) w.minx=x1;
+    if(w.maxx<x1) w.maxx=x1;
+    if(w.miny>y1) w.miny=y1;
+    if(w.maxy<y1) w.maxy=y1;
+    if(w.minz>z1) w.minz=z1;
+    if(w.maxz<z1) w.maxz=z1;
+    if(w.minint>intensity) w.minint=intensity;
+    if(w.maxint<intensity) w.maxint=intensity;
+    w.int_sum += intensity;
+    p = point(x1, z1, y1, 0x10101 * std::min(255, intensity*6));
+    return true;
+  });
+  bounds total = range[0];
+  total.int_sum = 0;
+  for (const bounds &w : range) {
+    total.minx = std::min(total.minx, w.minx); total.maxx = std::max(total.maxx, w.maxx);
+    total.miny = std::min(total.miny, w.miny); total.maxy = std::max(total.maxy, w.maxy);
+    total.minz = std::min(total.minz, w.minz); total.maxz = std::max(total.maxz, w.maxz);
+    total.minint = std::min(total.minint, w.minint); total.maxint = std::max(total.maxint, w.maxint);
+    total.int_sum += w.int_sum;
   }
-  fprintf(stderr,"x: %d - %d\n", minx, maxx);
-  fprintf(stderr,"y: %d - %d\n", miny, maxy);
-  fprintf(stderr,"z: %d - %d\n", minz, maxz);  
-  fprintf(stderr,"intensity: %d - %d, avg: %f\n", minint, maxint, int_mean/line);  
-  fprintf(stderr,"lines: %d\n", line);
+  fprintf(stderr,"x: %d - %d\n", total.minx, total.maxx);
+  fprintf(stderr,"y: %d - %d\n", total.miny, total.maxy);
+  fprintf(stderr,"z: %d - %d\n", total.minz, total.maxz);  
+  fprintf(stderr,"intensity: %d - %d, avg: %f\n", total.minint, total.maxint, (double)total.int_sum/lines);  
+  fprintf(stderr,"lines: %lu\n", lines);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
@@ -19,8 +19,12 @@
 #include <cstdio>
 #include <cstring>
 #include <algorithm>
+#include <vector>
+#include <unistd.h>
 
 #include "pointset.h"
+#include "point_parser.h"
+#include "thread_pool.h"
 
 /*
  * Tower:
@@ -44,38 +48,47 @@ int main(int argc, char ** argv) {
   sprintf(outfile, "vxl/%s.vxl", name);
     
   // Open the files.
-  FILE * res;
-  res = freopen( infile,  "r", stdin );
-  if (res==NULL) {
+  if (access(infile, R_OK)) {
     fprintf(stderr,"Failed to open '%s' for input.\n", infile);
     exit(2);
   }
   pointfile out(outfile);
+  thread_pool pool;
 
-  // Do the conversion
-  double x,y,z;
-  int r,g,b;
-  int minx= 1e9,miny= 1e9,minz= 1e9;
-  int maxx=-1e9,maxy=-1e9,maxz=-1e9;
-  int line=0;
+  // Do the conversion, where each worker keeps track of the bounds of its points.
+  struct bounds {
+    int minx,miny,minz;
+    int maxx,maxy,maxz;
+  };
+  std::vector<bounds> range(pool.size(), bounds{(int)1e9,(int)1e9,(int)1e9,(int)-1e9,(int)-1e9,(int)-1e9});
   const int C = 1<<19;
-  for(;;) {
-    if(line%(1<<20)==0) fprintf(stderr,"line: %3dMi\n", line>>20);
-    int ret = scanf("%lf %lf %lf %d %d %d\n", &x,&y,&z, &r,&g,&b);
-    if (ret < 6) break;
+  uint64_t lines = parse_points(infile, 0, out, pool, [&](const char * s, const char * e, int worker, point &p) {
+    double x,y,z;
+    int32_t r,g,b;
+    if (!(parse_double(s,e,x) && parse_double(s,e,y) && parse_double(s,e,z) && parse_int(s,e,r) && parse_int(s,e,g) && parse_int(s,e,b))) return false;
     x*=1000;
     y*=1000;
     z*=1000;
-    if(minx>x) minx=x; if(maxx<x) maxx=x;
-    if(miny>y) miny=y; if(maxy<y) maxy=y;
-    if(minz>z) minz=z; if(maxz<z) maxz=z;
-    out.add(point((int)(x+C), (int)(z+C), (int)(y+C), (r<<16)+(g<<8)+b));
-    line++;
+    bounds &w = range[worker];
+    if(w.minx>x) w.minx=x;
+    if(w.maxx<x) w.maxx=x;
+    if(w.miny>y) w.miny=y;
+    if(w.maxy<y) w.maxy=y;
+    if(w.minz>z) w.minz=z;
+    if(w.maxz<z) w.maxz=z;
+    p = point((int)(x+C), (int)(z+C), (int)(y+C), (r<<16)+(g<<8)+b);
+    return true;
+  });
+  bounds total = range[0];
+  for (const bounds &w : range) {
+    total.minx = std::min(total.minx, w.minx); total.maxx = std::max(total.maxx, w.maxx);
+    total.miny = std::min(total.miny, w.miny); total.maxy = std::max(total.maxy, w.maxy);
+    total.minz = std::min(total.minz, w.minz); total.maxz = std::max(total.maxz, w.maxz);
   }
-  fprintf(stderr,"x: %d - %d\n", minx, maxx);
-  fprintf(stderr,"y: %d - %d\n", miny, maxy);
-  fprintf(stderr,"z: %d - %d\n", minz, maxz);  
-  fprintf(stderr,"lines: %d\n", line);
+  fprintf(stderr,"x: %d - %d\n", total.minx, total.maxx);
+  fprintf(stderr,"y: %d - %d\n", total.miny, total.maxy);
+  fprintf(stderr,"z: %d - %d\n", total.minz, total.maxz);  
+  fprintf(stderr,"lines: %lu\n", lines);
 }
 
 // kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle; 
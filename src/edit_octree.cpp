@@ -0,0 +1,88 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "octree.h"
+#include "octree_edit.h"
+#include "timing.h"
+
+/* Applies a list of voxel edits to an octree file (*.oc2 or *.oc3) and stores the result as a new octree file (*.oc2).
+ * The edits are read from stdin, one per line:
+ *   set x y z color
+ *   remove x y z
+ *   recolor x y z color
+ * where the color is hexadecimal, like in the .vxl.txt format.
+ */
+
+/** Depth of the octree in the scene, which is the maximum depth of the voxels that can be edited. */
+static const int32_t SCENE_DEPTH = 26;
+
+int main(int argc, char ** argv) {
+  if (argc != 4) {
+    fprintf(stderr,"Usage: %s input_file output_file depth < edits\n", argv[0]);
+    fprintf(stderr,"Applies the edits read from stdin to the voxels at the given depth below the root and stores the octree (*.oc2).\n");
+    fprintf(stderr,"Each line contains an edit: 'set x y z color', 'remove x y z' or 'recolor x y z color', with the color in hexadecimal.\n");
+    fprintf(stderr,"The depth ranges from 1 to %d and the coordinates from 0 to 2^depth-1.\n", SCENE_DEPTH);
+    exit(2);
+  }
+  char * endptr;
+  errno = 0;
+  long depth = strtol(argv[3], &endptr, 10);
+  if (errno || endptr[0] || depth < 1 || depth > SCENE_DEPTH) {fprintf(stderr, "Invalid depth: %s\n", argv[3]); exit(2);}
+  struct stat input, output;
+  if (stat(argv[1], &input) == 0 && stat(argv[2], &output) == 0 && input.st_dev == output.st_dev && input.st_ino == output.st_ino) {
+    fprintf(stderr, "The output file must differ from the input file.\n");
+    exit(2);
+  }
+  Timer t;
+  octree_file in(argv[1]);
+  octree_edit edit(&in);
+  printf("[%10.0f] Loaded '%s' (%u bytes).\n", t.elapsed(), argv[1], in.size);
+  char line[256], command[16];
+  uint32_t x, y, z, color;
+  uint64_t edits = 0, missing = 0;
+  for (int number = 1; fgets(line, sizeof(line), stdin); number++) {
+    int n = sscanf(line, "%15s %u %u %u %x", command, &x, &y, &z, &color);
+    if (n <= 0) continue; // Empty line
+    if (n >= 4 && (x | y | z) >> depth) {
+      fprintf(stderr, "Voxel outside of the octree on line %d: %s", number, line);
+      exit(2);
+    }
+    if (n == 5 && strcmp(command, "set") == 0) {
+      edit.set(x, y, z, depth, color);
+    } else if (n == 4 && strcmp(command, "remove") == 0) {
+      missing += !edit.remove(x, y, z, depth);
+    } else if (n == 5 && strcmp(command, "recolor") == 0) {
+      missing += !edit.recolor(x, y, z, depth, color);
+    } else {
+      fprintf(stderr, "Invalid edit on line %d: %s", number, line);
+      exit(2);
+    }
+    edits++;
+  }
+  printf("[%10.0f] Applied %lu edits, of which %lu to missing voxels (%lu bytes of new nodes).\n", t.elapsed(), edits, missing, edit.used());
+  edit.save(argv[2]);
+  printf("[%10.0f] Stored '%s'.\n", t.elapsed(), argv[2]);
+}
+
+// kate: space-indent on; indent-width 2; mixedindent off; indent-mode cstyle;
@@ -0,0 +1,47 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "detail_budget.h"
+
+detail_budget::detail_budget(double budget, uint32_t max_level)
+  : budget(budget)
+  , max_level(max_level)
+  , interactive(0)
+  , last(0)
+  , adapt(false)
+{}
+
+uint32_t detail_budget::next(bool moved) {
+    adapt = moved;
+    if (moved) {
+        last = interactive;
+    } else if (last > 0) {
+        last--;
+    }
+    return last;
+}
+
+void detail_budget::report(double time) {
+    // Refinement frames are not interactive and hence may exceed the budget.
+    if (!adapt) return;
+    if (time > budget) {
+        if (interactive < max_level) interactive++;
+    } else if (time * 4 < budget) {
+        if (interactive > 0) interactive--;
+    }
+}
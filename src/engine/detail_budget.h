@@ -0,0 +1,54 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DETAIL_BUDGET_H
+#define DETAIL_BUDGET_H
+#include <stdint.h>
+
+/** Chooses the level of detail (see renderer::set_detail) such that frames are rendered within a time budget.
+ *
+ * While the camera moves, the level is adapted to the measured frame times: it is increased
+ * when a frame exceeds the budget and decreased when a frame took less than a quarter of it.
+ * When the camera stops moving, the image is refined progressively by rendering it again one
+ * level more detailed each frame, until full detail is reached.
+ */
+class detail_budget {
+public:
+    /** @param budget maximum duration of a frame in milliseconds.
+     * @param max_level the coarsest level of detail that may be used. */
+    detail_budget(double budget, uint32_t max_level = 4);
+
+    /** Returns the level of detail for the next frame.
+     * @param moved whether the camera has moved since the last frame. */
+    uint32_t next(bool moved);
+
+    /** Reports the time in milliseconds that it took to render the frame returned by next. */
+    void report(double time);
+
+    /** Whether the last frame was rendered at full detail. */
+    bool refined() const { return last == 0; }
+
+private:
+    double budget;
+    uint32_t max_level;
+    uint32_t interactive; ///< Level of detail that is used while moving.
+    uint32_t last;        ///< Level of detail of the last frame.
+    bool adapt;           ///< Whether the last frame was an interactive frame.
+};
+
+#endif
@@ -0,0 +1,50 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "huge_pages.h"
+
+static size_t round_up(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+void * huge_page_alloc(size_t bytes) {
+    size_t size = round_up(bytes);
+#ifdef MAP_HUGETLB
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) return data;
+#endif
+    // Transparent huge pages must be aligned, hence map one more huge page and unmap the unaligned ends.
+    char * region = (char*)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {perror("Could not allocate memory for huge pages"); exit(1);}
+    char * start = (char*)round_up((uintptr_t)region);
+    if (start > region) munmap(region, start - region);
+    munmap(start + size, region + HUGE_PAGE_SIZE - start);
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+    return start;
+}
+
+void huge_page_free(void * data, size_t bytes) {
+    if (data) munmap(data, round_up(bytes));
+}
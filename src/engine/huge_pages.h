@@ -0,0 +1,54 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+#include <stddef.h>
+#include <new>
+
+/** Size in bytes of the huge pages used by huge_page_alloc. */
+static const size_t HUGE_PAGE_SIZE = 2<<20;
+
+/** Allocates zeroed memory in which each 2MiB is backed by a single huge page, if possible, 
+ * which reduces the TLB misses caused by accessing a large array at random.
+ * Explicit huge pages (MAP_HUGETLB) are used if the system reserved these, transparent huge pages otherwise,
+ * which are provided by the kernel unless these are disabled entirely. The size is rounded up to HUGE_PAGE_SIZE.
+ * Like other memory, the pages are placed on the NUMA node of the thread that first writes to them,
+ * unless they are bound to a node (see numa.h).
+ * Exits if the memory cannot be allocated. It must be released with huge_page_free. */
+void * huge_page_alloc(size_t bytes);
+void huge_page_free(void * data, size_t bytes);
+
+/** Allocator for std::vector, which uses huge pages for arrays of at least half a huge page. */
+template<class T> struct huge_page_allocator {
+    typedef T value_type;
+    huge_page_allocator() {}
+    template<class U> huge_page_allocator(const huge_page_allocator<U>&) {}
+    T * allocate(size_t n) {
+        if (n * sizeof(T) >= HUGE_PAGE_SIZE / 2) return (T*)huge_page_alloc(n * sizeof(T));
+        return (T*)::operator new(n * sizeof(T));
+    }
+    void deallocate(T * p, size_t n) {
+        if (n * sizeof(T) >= HUGE_PAGE_SIZE / 2) huge_page_free(p, n * sizeof(T));
+        else ::operator delete(p);
+    }
+    template<class U> bool operator==(const huge_page_allocator<U>&) const { return true; }
+    template<class U> bool operator!=(const huge_page_allocator<U>&) const { return false; }
+};
+
+#endif
@@ -0,0 +1,107 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+/** Parses a CPU list of sysfs, such as "0-3,8-11". */
+static std::vector<int> read_cpu_list(const char * filename) {
+    std::vector<int> cpus;
+    FILE * f = fopen(filename, "r");
+    if (!f) return cpus;
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(f, "-%d", &last) != 1) last = first;
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        if (fgetc(f) != ',') break;
+    }
+    fclose(f);
+    return cpus;
+}
+
+/** The NUMA node of each CPU, which is read once. */
+static const std::vector<int> &cpu_nodes() {
+    static const std::vector<int> nodes = [] {
+        std::vector<int> r;
+        char filename[64];
+        for (int node = 0; ; node++) {
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d", node);
+            if (access(filename, F_OK)) break;
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node);
+            for (int cpu : read_cpu_list(filename)) {
+                if (cpu >= (int)r.size()) r.resize(cpu + 1, 0);
+                r[cpu] = node;
+            }
+        }
+        return r;
+    }();
+    return nodes;
+}
+
+int numa_nodes() {
+    const std::vector<int> &nodes = cpu_nodes();
+    return nodes.empty() ? 1 : *std::max_element(nodes.begin(), nodes.end()) + 1;
+}
+
+int numa_node_of_cpu(int cpu) {
+    const std::vector<int> &nodes = cpu_nodes();
+    return cpu >= 0 && cpu < (int)nodes.size() ? nodes[cpu] : 0;
+}
+
+int numa_current_node() {
+    return numa_node_of_cpu(sched_getcpu());
+}
+
+std::vector<int> numa_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set)) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    std::stable_sort(cpus.begin(), cpus.end(), [](int a, int b) { return numa_node_of_cpu(a) < numa_node_of_cpu(b); });
+    return cpus;
+}
+
+bool numa_pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool numa_bind(void * data, size_t bytes, int node) {
+    if (numa_nodes() == 1) return true;
+    if (node >= 64) return false;
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, data, bytes, MPOL_BIND, &mask, sizeof(mask) * 8, MPOL_MF_MOVE) == 0;
+}
+
+int numa_node_of(const void * address) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR)) return -1;
+    return node;
+}
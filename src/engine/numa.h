@@ -0,0 +1,45 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NUMA_H
+#define NUMA_H
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* NUMA placement of threads and memory, using the topology in /sys/devices/system/node and the
+ * mbind and get_mempolicy system calls, rather than libnuma. On systems without NUMA, everything is on node 0.
+ */
+
+/** The number of NUMA nodes, which is 1 if the system does not use NUMA. */
+int numa_nodes();
+/** The NUMA node of the CPU. */
+int numa_node_of_cpu(int cpu);
+/** The NUMA node of the CPU on which the calling thread runs. */
+int numa_current_node();
+/** The CPUs on which the calling thread may run, ordered by their NUMA node. */
+std::vector<int> numa_cpus();
+/** Restricts the calling thread to the CPU. Returns false if this fails. */
+bool numa_pin_thread(int cpu);
+/** Places the pages of the memory range on the NUMA node, moving the pages that are already present.
+ * The range must start at a page boundary. Returns false if this fails, e.g. if the node has no memory. */
+bool numa_bind(void * data, size_t bytes, int node);
+/** The NUMA node of the page that contains the address, which is placed if it is not yet, or -1 if unknown. */
+int numa_node_of(const void * address);
+
+#endif
@@ -66,16 +66,31 @@ struct octree {
     void set_color(int pos, uint32_t color) { child[pos] = (color | 0xff000000u); }
 };
 
+class octree_stream;
+class octree_decoder;
+
 struct octree_file {
     const bool write;
     uint32_t size;
     int32_t fd;
     octree * root;
+    uint32_t top; ///< Index of the root node, which is 0 unless the octree was edited (see octree_edit.h).
+    /** Controls the residency of the file while it is rendered, if not null (see octree_stream.h). */
+    octree_stream * stream;
+    bool huge; ///< Whether the octree was copied into huge pages by load_huge_pages.
+    /** Decodes the octree on demand, if it was loaded from an .oc3 file (see octree_compress.h). */
+    octree_decoder * decoder;
     /** Maps the given octree file to memory for reading and rendering. */
     octree_file(const char * filename);
     /** Creates an octree file with the given name and size for writing. */
     octree_file(const char * filename, uint32_t size);
+    /** Takes ownership of a memory mapping of the given size in bytes, which is not backed by a file. */
+    octree_file(octree * root, uint32_t size);
     ~octree_file();
+    /** Copies the octree into memory backed by huge pages (see huge_pages.h), which reduces the TLB misses 
+     * during the traversal of large octrees, at the cost of loading the entire octree into memory.
+     * Afterwards the file is no longer used, hence it cannot be streamed. */
+    void load_huge_pages();
 private:
     octree_file(octree_file &);
     octree_file& operator=(octree_file&);
@@ -85,6 +100,40 @@ struct view_pane {
     double left, right, top, bottom;
 };
 
-void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+/** Statistics of rendering a frame. Times are in milliseconds.
+ * For frames rendered in tiles, the phase timings and counts are summed over the tiles. */
+struct render_stats {
+    double total;            //< Time spent in the call to render.
+    double prepare;          //< Time spent preparing the occlusion quadtree.
+    double prepare_saved;    //< Time saved by restoring a cached quadtree instead of building it.
+    double query;            //< Time spent traversing the octree.
+    uint64_t count;          //< Number of visited (octree node, quadtree node) pairs.
+    uint64_t count_oct;      //< Number of octree children that were visited.
+    uint64_t count_quad;     //< Number of quadtree children that were visited.
+    uint64_t culled_frustum; //< Number of octree and quadtree children skipped, because they do not overlap.
+    uint64_t culled_occlusion; //< Number of octree children skipped, because their quadtree node was already rendered.
+    uint64_t pixels;         //< Number of pixels drawn.
+    uint32_t max_depth;      //< Maximum nesting depth of the traversal.
+    uint32_t tiles;          //< Number of rendered rectangles.
+    uint64_t beam_tiles;     //< Number of 16x16 pixel tiles rendered by the beam pre-pass.
+    uint64_t beam_oct;       //< Number of (octree node, quadtree node) pairs visited by the beam pre-pass above the tiles.
+    uint64_t cached_tiles;   //< Number of beam pre-pass tiles that were rendered entirely from the cached entry nodes.
+
+    render_stats();
+    /** Adds the statistics of another tile. */
+    render_stats& operator+=(const render_stats &other);
+};
+
+/** Whether octree_draw and octree_draw_parallel print the statistics of each frame to stdout. Defaults to true. */
+extern bool octree_draw_verbose;
+
+/** Renders the octree using a shared renderer and prints its statistics.
+ * Not reentrant, use a renderer object (see renderer.h) to render multiple views concurrently. */
+render_stats octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+/** Renders the octree using a shared parallel_renderer and prints its statistics. Not reentrant.
+ * @param detail the level of detail, see renderer::set_detail.
+ * @param reuse whether pixels that are already drawn are kept, see renderer::set_reuse. */
+render_stats octree_draw_parallel(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, uint32_t detail = 0, bool reuse = false);
 
 #endif
@@ -0,0 +1,641 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "octree_compress.h"
+
+static const char MAGIC[8] = {'\x89','O','C','3','\r','\n','\x1a','\n'};
+static const uint32_t VERSION = 1;
+/** Number of consecutive colors that share a palette. */
+static const uint32_t BRICK = 1024;
+/** Maximum number of colors in a palette. */
+static const uint32_t MAX_PALETTE = 256;
+
+enum section {
+    BITMASKS, LEAFMASKS, AVGCOLORS, CHILDREN, LEAVES, SECTIONS
+};
+
+struct oc3_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodes;   ///< Number of nodes.
+    uint32_t words;   ///< Size of the decoded octree in 32-bit words.
+    uint32_t leaves;  ///< Number of leaf colors.
+    uint64_t section_size[SECTIONS]; ///< Size of each section in bytes.
+};
+
+static void corrupt(const char * reason) {
+    fprintf(stderr, "Corrupt octree file: %s\n", reason);
+    exit(1);
+}
+
+/** Number of bits required to store the indices in a palette of the given size. */
+static uint32_t index_bits(uint32_t palette) {
+    uint32_t bits = 0;
+    while ((1u<<bits) < palette) bits++;
+    return bits;
+}
+
+bool octree_is_compressed(const void * data, uint64_t size) {
+    return size >= sizeof(oc3_header) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/** Sequential reader for one of the sections. */
+struct section_reader {
+    const uint8_t * p;
+    const uint8_t * end;
+    uint8_t byte() {
+        if (p == end) corrupt("truncated section");
+        return *p++;
+    }
+    uint32_t color() {
+        uint32_t c = byte();
+        c |= byte() << 8;
+        c |= byte() << 16;
+        return c;
+    }
+    uint32_t varint() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            uint8_t b = byte();
+            v |= (b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        corrupt("invalid varint");
+        return 0;
+    }
+};
+
+/** Reads palettized colors brick by brick. */
+struct color_reader {
+    section_reader in;
+    uint32_t remaining; ///< Number of colors left in the current brick.
+    uint32_t palette_size;
+    uint32_t palette[MAX_PALETTE];
+    uint32_t bits;
+    uint32_t buffer, buffered;
+    color_reader(section_reader in) : in(in), remaining(0) {}
+    void start_brick() {
+        remaining = BRICK;
+        palette_size = in.byte();
+        palette_size |= in.byte() << 8;
+        if (palette_size > MAX_PALETTE) corrupt("palette too large");
+        for (uint32_t i=0; i<palette_size; i++) {
+            palette[i] = in.color();
+        }
+        bits = index_bits(palette_size);
+        buffer = buffered = 0;
+    }
+    /** Continues at the color with the given index, where bricks contains the position of each brick in the section. */
+    void seek(const std::vector<uint64_t> &bricks, const uint8_t * section, uint32_t index) {
+        in.p = section + bricks[index / BRICK];
+        start_brick();
+        uint32_t skip = index % BRICK;
+        remaining -= skip;
+        if (palette_size == 0) {
+            in.p += 3 * skip;
+            return;
+        }
+        uint64_t bit = (uint64_t)skip * bits;
+        in.p += bit / 8;
+        if (bit % 8) {
+            buffer = in.byte() >> (bit % 8);
+            buffered = 8 - bit % 8;
+        }
+    }
+    uint32_t next() {
+        if (remaining == 0) start_brick();
+        remaining--;
+        if (palette_size == 0) return in.color();
+        while (buffered < bits) {
+            buffer |= in.byte() << buffered;
+            buffered += 8;
+        }
+        uint32_t index = buffer & ((1u<<bits) - 1);
+        buffer >>= bits;
+        buffered -= bits;
+        assert(index < palette_size); // Validated by index_bricks.
+        return palette[index];
+    }
+};
+
+/** Reads the child references, which are stored as pairs of a run length of new nodes and a back reference. */
+struct child_reader {
+    section_reader in;
+    uint32_t run;
+    bool has_reference;
+    child_reader(section_reader in) : in(in), run(0) {
+        next_pair();
+    }
+    /** Continues from a state of another reader of the same section. */
+    child_reader(section_reader in, uint32_t run, bool has_reference) : in(in), run(run), has_reference(has_reference) {}
+    void next_pair() {
+        has_reference = in.p != in.end;
+        if (has_reference) run = in.varint();
+    }
+    /** Returns 0 for a new node, or how many nodes before the next new node the child was numbered. */
+    uint32_t next() {
+        if (!has_reference) return 0;
+        if (run > 0) {
+            run--;
+            return 0;
+        }
+        uint32_t back = in.varint();
+        if (back == 0) corrupt("invalid reference");
+        next_pair();
+        return back;
+    }
+};
+
+/** Reads and validates the header. */
+static oc3_header read_header(const void * data) {
+    oc3_header h;
+    memcpy(&h, data, sizeof(h));
+    if (h.version != VERSION) corrupt("unsupported version");
+    if (h.nodes == 0 || h.words < h.nodes || h.words >= (1u<<30)) corrupt("invalid size");
+    return h;
+}
+
+/** Records the position of each brick of count colors, and checks that these fit in the section
+ * and that their palette indices are valid, such that decoding them cannot fail. */
+static std::vector<uint64_t> index_bricks(section_reader in, uint32_t count) {
+    std::vector<uint64_t> bricks;
+    const uint8_t * section = in.p;
+    for (uint32_t i=0; i<count; i+=BRICK) {
+        bricks.push_back(in.p - section);
+        uint32_t n = std::min(BRICK, count - i);
+        uint32_t palette_size = in.byte();
+        palette_size |= in.byte() << 8;
+        if (palette_size > MAX_PALETTE) corrupt("palette too large");
+        uint32_t bits = index_bits(palette_size);
+        uint64_t bytes = palette_size ? 3*palette_size + ((uint64_t)n * bits + 7) / 8 : 3*n;
+        if (bytes > (uint64_t)(in.end - in.p)) corrupt("truncated section");
+        if (palette_size && (palette_size & (palette_size - 1))) {
+            // Not every index of this width refers to a color of the palette.
+            const uint8_t * indices = in.p + 3*palette_size;
+            for (uint32_t j=0; j<n; j++) {
+                uint32_t index = 0;
+                for (uint32_t b=0; b<bits; b++) {
+                    uint64_t bit = (uint64_t)j * bits + b;
+                    index |= (indices[bit / 8] >> (bit % 8) & 1) << b;
+                }
+                if (index >= palette_size) corrupt("invalid palette index");
+            }
+        }
+        in.p += bytes;
+    }
+    return bricks;
+}
+
+static const uint32_t CHUNK_WORDS = octree_decoder::CHUNK / sizeof(octree);
+/** Number of nodes between the nodes of which the index stores the position in the decoded octree. */
+static const uint32_t OFFSET_STEP = 1024;
+
+/** The state of the readers at the first node that overlaps a chunk of the decoded octree. */
+struct oc3_checkpoint {
+    uint32_t node;
+    uint32_t offset;   ///< Index of the first word of the node.
+    uint32_t numbered; ///< Number of nodes that are numbered before the node is decoded.
+    uint32_t next;     ///< Index of the first word of the next unnumbered node.
+    uint32_t leaf;     ///< Number of leaf colors in the preceding nodes.
+    uint32_t run;      ///< State of the child_reader.
+    bool has_reference;
+    uint64_t children; ///< Position of the child_reader in its section.
+};
+
+/** The sections of an .oc3 file, with the positions from which the nodes of each chunk can be decoded. */
+struct oc3_index {
+    const void * data;
+    uint64_t file_size;
+    oc3_header h;
+    section_reader in[SECTIONS];
+    std::vector<uint32_t> offsets;          ///< Index of the first word of every OFFSET_STEP-th node.
+    std::vector<uint64_t> avgcolor_bricks;  ///< Position of each brick of average colors in its section.
+    std::vector<uint64_t> leaf_bricks;      ///< Position of each brick of leaf colors in its section.
+    std::vector<oc3_checkpoint> chunks;
+
+    oc3_index(const void * data, uint64_t file_size);
+    ~oc3_index() { munmap((void*)data, file_size); }
+    uint32_t offset(uint32_t node) const;
+    void decode(uint32_t chunk, uint32_t * out) const;
+};
+
+/** Validates the structure of the octree, while numbering its nodes like decode. */
+oc3_index::oc3_index(const void * data, uint64_t file_size) : data(data), file_size(file_size), h(read_header(data)) {
+    const uint8_t * p = (const uint8_t*)data + sizeof(h);
+    const uint8_t * end = (const uint8_t*)data + file_size;
+    for (int i=0; i<SECTIONS; i++) {
+        if (h.section_size[i] > (uint64_t)(end - p)) corrupt("truncated file");
+        in[i].p = p;
+        in[i].end = p + h.section_size[i];
+        p = in[i].end;
+    }
+    if (h.section_size[BITMASKS] != h.nodes || h.section_size[LEAFMASKS] != h.nodes) corrupt("invalid size");
+    avgcolor_bricks = index_bricks(in[AVGCOLORS], h.nodes);
+    leaf_bricks = index_bricks(in[LEAVES], h.leaves);
+    const uint8_t * bitmask = in[BITMASKS].p;
+    const uint8_t * leafmask = in[LEAFMASKS].p;
+
+    // Nodes are placed in the order in which they are numbered, hence a new child is always placed at the end.
+    uint32_t offset = 0;
+    uint32_t numbered = 1;
+    uint32_t next = 1 + popcount(bitmask[0]);
+    uint32_t leaf_count = 0;
+    child_reader children(in[CHILDREN]);
+    for (uint32_t k=0; k<h.nodes; k++) {
+        if (k >= numbered) corrupt("unreachable node");
+        if (leafmask[k] & ~bitmask[k]) corrupt("invalid leafmask");
+        if (k % OFFSET_STEP == 0) offsets.push_back(offset);
+        uint32_t words = 1 + popcount(bitmask[k]);
+        while ((uint64_t)chunks.size() * CHUNK_WORDS < offset + words) {
+            oc3_checkpoint c = {k, offset, numbered, next, leaf_count, children.run, children.has_reference, (uint64_t)(children.in.p - in[CHILDREN].p)};
+            chunks.push_back(c);
+        }
+        for (int i=0; i<8; i++) {
+            if (!(bitmask[k] & (1<<i))) continue;
+            if (leafmask[k] & (1<<i)) {
+                leaf_count++;
+                continue;
+            }
+            uint32_t back = children.next();
+            if (back == 0) {
+                if (numbered >= h.nodes) corrupt("too many nodes");
+                next += 1 + popcount(bitmask[numbered++]);
+                if (next > h.words) corrupt("too many words");
+            } else if (back > numbered) {
+                corrupt("invalid reference");
+            }
+        }
+        offset += words;
+    }
+    if (next != h.words || leaf_count != h.leaves) corrupt("size mismatch");
+}
+
+/** Returns the index of the first word of the given node. */
+uint32_t oc3_index::offset(uint32_t node) const {
+    const uint8_t * bitmask = in[BITMASKS].p;
+    uint32_t offset = offsets[node / OFFSET_STEP];
+    for (uint32_t k = node - node % OFFSET_STEP; k < node; k++) {
+        offset += 1 + popcount(bitmask[k]);
+    }
+    return offset;
+}
+
+/** Decodes the words of the given chunk into out. */
+void oc3_index::decode(uint32_t chunk, uint32_t * out) const {
+    const oc3_checkpoint &c = chunks[chunk];
+    uint32_t begin = chunk * CHUNK_WORDS;
+    uint32_t end = std::min(begin + CHUNK_WORDS, h.words);
+    const uint8_t * bitmask = in[BITMASKS].p;
+    const uint8_t * leafmask = in[LEAFMASKS].p;
+    color_reader avgcolors(in[AVGCOLORS]);
+    avgcolors.seek(avgcolor_bricks, in[AVGCOLORS].p, c.node);
+    color_reader leaves(in[LEAVES]);
+    if (c.leaf < h.leaves) leaves.seek(leaf_bricks, in[LEAVES].p, c.leaf);
+    section_reader child_section = in[CHILDREN];
+    child_section.p += c.children;
+    child_reader children(child_section, c.run, c.has_reference);
+    uint32_t numbered = c.numbered;
+    uint32_t next = c.next;
+    uint32_t words[9];
+    octree &node = *(octree*)words;
+    for (uint32_t k = c.node, offset = c.offset; offset < end; k++) {
+        node.bitmask = bitmask[k];
+        node.avgcolor = avgcolors.next();
+        uint32_t pos = 0;
+        for (int i=0; i<8; i++) {
+            if (!node.has_index(i)) continue;
+            if (leafmask[k] & (1<<i)) {
+                node.set_color(pos++, leaves.next());
+            } else {
+                uint32_t back = children.next();
+                if (back == 0) {
+                    node.child[pos++] = next;
+                    next += 1 + popcount(bitmask[numbered++]);
+                } else {
+                    node.child[pos++] = this->offset(numbered - back);
+                }
+            }
+        }
+        // Only the part of the node that lies within the chunk is stored.
+        for (uint32_t j=0; j<=pos; j++) {
+            if (offset + j >= begin && offset + j < end) out[offset + j - begin] = words[j];
+        }
+        offset += 1 + pos;
+    }
+}
+
+enum chunk_state : uint8_t {
+    ABSENT, DECODING, DECODED, EVICTING
+};
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+/** Opens a userfaultfd that reports the faults in the given memory, or returns -1 if this is not supported. */
+static int open_userfaultfd(void * at, uint64_t length) {
+    // Faults in user mode suffice, which does not require privileges.
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (fd == -1 && errno == EINVAL) fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) return -1;
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uint64_t)at;
+    reg.range.len = length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(fd, UFFDIO_API, &api) || ioctl(fd, UFFDIO_REGISTER, &reg) || !(reg.ioctls & (1ull << _UFFDIO_COPY))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+octree_decoder::octree_decoder(const void * data, uint64_t file_size)
+  : index(new oc3_index(data, file_size))
+  , start(nullptr)
+  , length((size() + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE))
+  , state(new std::atomic<uint8_t>[index->chunks.size()])
+  , uffd(-1)
+  , stop(-1)
+  , buffer(nullptr)
+{
+    assert(CHUNK % sysconf(_SC_PAGESIZE) == 0);
+    for (uint32_t i=0; i<index->chunks.size(); i++) {
+        state[i] = ABSENT;
+    }
+}
+
+octree_decoder::octree_decoder(const octree_decoder &source)
+  : index(source.index)
+  , start(nullptr)
+  , length(source.length)
+  , state(new std::atomic<uint8_t>[index->chunks.size()])
+  , uffd(-1)
+  , stop(-1)
+  , buffer(nullptr)
+{
+    for (uint32_t i=0; i<index->chunks.size(); i++) {
+        state[i] = ABSENT;
+    }
+}
+
+octree_decoder::~octree_decoder() {
+    if (handler.joinable()) {
+        uint64_t one = 1;
+        if (write(stop, &one, sizeof(one)) != sizeof(one)) {perror("Could not stop octree decoder"); exit(1);}
+        handler.join();
+    }
+    if (uffd != -1) close(uffd);
+    if (stop != -1) close(stop);
+    if (buffer && buffer != MAP_FAILED) munmap(buffer, CHUNK);
+}
+
+uint32_t octree_decoder::size() const {
+    return index->h.words * sizeof(octree);
+}
+
+void octree_decoder::map(void * at) {
+    assert(!start);
+    start = (char*)at;
+    if (mmap(at, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("Could not reserve memory for decoding octree"); exit(1);
+    }
+    uffd = open_userfaultfd(at, length);
+    if (uffd == -1) {
+        fprintf(stderr, "Userfaultfd is not available, decoding the whole octree.\n");
+        if (mprotect(at, length, PROT_READ | PROT_WRITE)) {perror("Could not decode octree"); exit(1);}
+        for (uint32_t c=0; c<index->chunks.size(); c++) {
+            index->decode(c, (uint32_t*)(start + (uint64_t)c * CHUNK));
+            state[c] = DECODED;
+        }
+        if (mprotect(at, length, PROT_READ)) {perror("Could not protect octree memory"); exit(1);}
+        return;
+    }
+    buffer = (uint32_t*)mmap(NULL, CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {perror("Could not allocate memory for decoding octree"); exit(1);}
+    stop = eventfd(0, EFD_CLOEXEC);
+    if (stop == -1) {perror("Could not start octree decoder"); exit(1);}
+    handler = std::thread(&octree_decoder::handle, this);
+}
+
+/** Decodes the chunks of the faults reported by the userfaultfd, until stopped. */
+void octree_decoder::handle() {
+    struct pollfd fds[2] = {{uffd, POLLIN, 0}, {stop, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("Could not wait for octree faults"); exit(1);
+        }
+        if (fds[1].revents) return;
+        struct uffd_msg msg;
+        ssize_t n = read(uffd, &msg, sizeof(msg));
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n != sizeof(msg)) {perror("Could not read octree fault"); exit(1);}
+        if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+        load(((const char*)msg.arg.pagefault.address - start) / CHUNK);
+    }
+}
+
+/** Decodes the given chunk and wakes the threads waiting for it. */
+void octree_decoder::load(uint32_t chunk) {
+    uint64_t bytes = std::min<uint64_t>(CHUNK, length - (uint64_t)chunk * CHUNK);
+    for (;;) {
+        uint8_t expected = ABSENT;
+        if (state[chunk].compare_exchange_strong(expected, DECODING)) break;
+        if (expected == DECODED) {
+            // The fault was reported before the chunk was copied into place.
+            struct uffdio_range range = {(uint64_t)start + (uint64_t)chunk * CHUNK, bytes};
+            if (ioctl(uffd, UFFDIO_WAKE, &range)) {perror("Could not wake octree reader"); exit(1);}
+            return;
+        }
+        sched_yield();
+    }
+    index->decode(chunk, buffer);
+    uint32_t decoded = std::min<uint64_t>(CHUNK, size() - (uint64_t)chunk * CHUNK);
+    memset((char*)buffer + decoded, 0, bytes - decoded);
+    // The chunk is copied at once, hence other threads never read a partially decoded chunk.
+    struct uffdio_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.dst = (uint64_t)start + (uint64_t)chunk * CHUNK;
+    copy.src = (uint64_t)buffer;
+    copy.len = bytes;
+    if (ioctl(uffd, UFFDIO_COPY, &copy)) {perror("Could not map decoded octree chunk"); exit(1);}
+    state[chunk] = DECODED;
+}
+
+void octree_decoder::evict(uint64_t offset, uint64_t bytes) {
+    if (uffd == -1) return;
+    uint64_t end = std::min(offset + bytes, length);
+    for (uint64_t c = offset / CHUNK; c * CHUNK < end; c++) {
+        uint8_t expected = DECODED;
+        if (!state[c].compare_exchange_strong(expected, EVICTING)) continue;
+        // Accessing the discarded pages causes a fault again.
+        if (madvise(start + c * CHUNK, std::min<uint64_t>(CHUNK, length - c * CHUNK), MADV_DONTNEED)) {
+            perror("Could not evict decoded octree chunk"); exit(1);
+        }
+        state[c] = ABSENT;
+    }
+}
+
+/** Growing buffer for one of the sections. */
+struct section_writer {
+    std::vector<uint8_t> data;
+    void byte(uint8_t b) {
+        data.push_back(b);
+    }
+    void color(uint32_t c) {
+        byte(c);
+        byte(c >> 8);
+        byte(c >> 16);
+    }
+    void varint(uint32_t v) {
+        while (v >= 0x80) {
+            byte(v | 0x80);
+            v >>= 7;
+        }
+        byte(v);
+    }
+};
+
+/** Stores a brick of colors, using a palette if that is smaller. */
+static void write_brick(section_writer &out, const uint32_t * colors, uint32_t n) {
+    std::vector<uint32_t> palette(colors, colors + n);
+    std::sort(palette.begin(), palette.end());
+    palette.erase(std::unique(palette.begin(), palette.end()), palette.end());
+    uint32_t bits = index_bits(palette.size());
+    if (palette.size() > MAX_PALETTE || 3*palette.size() + (n*bits + 7)/8 >= 3*n) {
+        out.byte(0);
+        out.byte(0);
+        for (uint32_t i=0; i<n; i++) out.color(colors[i]);
+        return;
+    }
+    out.byte(palette.size());
+    out.byte(palette.size() >> 8);
+    for (uint32_t c : palette) out.color(c);
+    uint32_t buffer = 0, buffered = 0;
+    for (uint32_t i=0; i<n; i++) {
+        buffer |= (std::lower_bound(palette.begin(), palette.end(), colors[i]) - palette.begin()) << buffered;
+        buffered += bits;
+        while (buffered >= 8) {
+            out.byte(buffer);
+            buffer >>= 8;
+            buffered -= 8;
+        }
+    }
+    if (buffered > 0) out.byte(buffer);
+}
+
+static void write_all(int fd, const void * buf, uint64_t bytes) {
+    const char * p = (const char *)buf;
+    while (bytes > 0) {
+        ssize_t n = ::write(fd, p, bytes);
+        if (n <= 0) {perror("Could not write octree file"); exit(1);}
+        p += n;
+        bytes -= n;
+    }
+}
+
+void octree_compress(const octree * root, uint64_t size, const char * filename) {
+    uint64_t words = size / sizeof(octree);
+    if (words == 0 || words >= (1u<<30)) corrupt("invalid size");
+    const uint32_t NONE = ~0u;
+    std::vector<uint32_t> number(words, NONE);
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> avgcolors;
+    std::vector<uint32_t> leaves;
+    section_writer out[SECTIONS];
+    uint32_t decoded_words = 0;
+    uint32_t run = 0;
+
+    // Number the nodes in breadth-first order.
+    number[0] = 0;
+    order.push_back(0);
+    for (uint32_t k=0; k<order.size(); k++) {
+        const octree &node = root[order[k]];
+        if (order[k] + 1 + node.size() > words) corrupt("node extends beyond end of file");
+        decoded_words += 1 + node.size();
+        out[BITMASKS].byte(node.bitmask);
+        avgcolors.push_back(node.avgcolor);
+        uint8_t leafmask = 0;
+        uint32_t pos = 0;
+        for (int i=0; i<8; i++) {
+            if (!node.has_index(i)) continue;
+            uint32_t c = node.child[pos++];
+            if (!node.is_pointer(pos-1)) {
+                leafmask |= 1<<i;
+                leaves.push_back(c & 0x00ffffffu);
+            } else if (c >= words) {
+                corrupt("child pointer beyond end of file");
+            } else if (number[c] == NONE) {
+                number[c] = order.size();
+                order.push_back(c);
+                run++;
+            } else {
+                out[CHILDREN].varint(run);
+                out[CHILDREN].varint(order.size() - number[c]);
+                run = 0;
+            }
+        }
+        out[LEAFMASKS].byte(leafmask);
+    }
+    for (uint32_t i=0; i<avgcolors.size(); i+=BRICK) {
+        write_brick(out[AVGCOLORS], &avgcolors[i], std::min<uint32_t>(BRICK, avgcolors.size() - i));
+    }
+    for (uint32_t i=0; i<leaves.size(); i+=BRICK) {
+        write_brick(out[LEAVES], &leaves[i], std::min<uint32_t>(BRICK, leaves.size() - i));
+    }
+
+    oc3_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.nodes = order.size();
+    h.words = decoded_words;
+    h.leaves = leaves.size();
+    for (int i=0; i<SECTIONS; i++) {
+        h.section_size[i] = out[i].data.size();
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {perror("Could not open/creat file"); exit(1);}
+    write_all(fd, &h, sizeof(h));
+    for (int i=0; i<SECTIONS; i++) {
+        write_all(fd, out[i].data.data(), out[i].data.size());
+    }
+    close(fd);
+}
@@ -0,0 +1,103 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_COMPRESS_H
+#define OCTREE_COMPRESS_H
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "octree.h"
+
+/* The compressed .oc3 octree file format.
+ *
+ * The file starts with a header (see octree_compress.cpp), followed by a number of sections.
+ * The nodes reachable from the root are numbered in breadth-first order and stored as:
+ *  - bitmasks: the bitmask of each node (1 byte per node).
+ *  - leafmasks: which of the children of each node are colors rather than nodes (1 byte per node).
+ *    Nodes in the bottom layer hence store no child data other than their leaf colors.
+ *  - avgcolors: the average color of each node, palettized (see leaves).
+ *  - children: references to child nodes. A child node is normally the next unnumbered node, hence only
+ *    the exceptions (e.g. repeated subtrees) are stored, as pairs of varints: the number of child nodes
+ *    until the exception and how many nodes before the next unnumbered node it was numbered.
+ *  - leaves: the leaf colors in bricks of 1024 colors. Each brick stores a 16-bit palette size,
+ *    followed by either the raw 24-bit colors (palette size 0) or the palette and bit-packed indices.
+ *
+ * When loaded, the octree is decoded into the layout described in octree.h, hence rendering
+ * does not depend on the file format. It is decoded on demand, in chunks, by octree_decoder.
+ */
+
+/** Checks whether the given file contents are in the .oc3 format. */
+bool octree_is_compressed(const void * data, uint64_t size);
+
+struct oc3_index;
+
+/** Decodes the octree of an .oc3 file into memory on demand, one chunk at a time.
+ *
+ * The memory of the decoded octree is reserved and registered with userfaultfd. The first access to a chunk blocks
+ * the accessing thread, while a thread of the decoder decodes the nodes of the chunk, starting from the state of the
+ * sections at its first node, and copies them into place. These states are recorded when the file is opened, which
+ * reads and validates the octree, but does not keep its colors. Hence only the compressed file is cached by the kernel,
+ * while the decoded octree only uses memory for the chunks that were accessed. The chunks can be evicted,
+ * e.g. by octree_stream, after which they are decoded again when needed.
+ *
+ * If the kernel does not support userfaultfd, the whole octree is decoded by map() instead.
+ */
+class octree_decoder {
+public:
+    /** The size in bytes of the decoded chunks. */
+    static const uint32_t CHUNK = 64<<10;
+
+    /** Indexes the .oc3 file contents, taking ownership of their memory mapping. Exits if the file is corrupt. */
+    octree_decoder(const void * data, uint64_t file_size);
+    /** Creates a decoder for the same octree, which shares the file contents with source.
+     * Source does not need to outlive the copy. */
+    octree_decoder(const octree_decoder &source);
+    ~octree_decoder();
+
+    /** Decodes the octree on demand into the memory at the given address, which must be page aligned and reserved
+     * for size() bytes, rounded up to the page size. The memory is replaced by a read-only mapping.
+     * It remains owned by the caller, who must not unmap it before the decoder is destroyed.
+     * The decoded memory must not be passed to system calls, as faults in the kernel are not handled. */
+    void map(void * at);
+
+    /** Returns the size in bytes of the decoded octree. */
+    uint32_t size() const;
+    /** Discards the decoded chunks that overlap the given range of bytes, which are decoded again when accessed. */
+    void evict(uint64_t offset, uint64_t length);
+
+private:
+    std::shared_ptr<const oc3_index> index;
+    char * start;    ///< The memory into which the octree is decoded, null until it is mapped.
+    uint64_t length; ///< Size of that memory, which is a multiple of the page size.
+    std::unique_ptr<std::atomic<uint8_t>[]> state; ///< Whether each chunk is absent, being decoded, decoded or being evicted.
+    int uffd;        ///< The userfaultfd through which faults in the decoded memory are received, or -1.
+    int stop;        ///< Eventfd that stops the handler thread.
+    uint32_t * buffer; ///< Memory in which the handler thread decodes a chunk.
+    std::thread handler;
+
+    void handle();
+    void load(uint32_t chunk);
+
+    octree_decoder& operator=(const octree_decoder&);
+};
+
+/** Writes the octree, consisting of size bytes starting at root, to filename in .oc3 format. */
+void octree_compress(const octree * root, uint64_t size, const char * filename);
+
+#endif
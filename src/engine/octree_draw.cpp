@@ -18,23 +18,159 @@
 
 #include <cstdio>
 #include <cassert>
+#include <climits>
 #include <algorithm>
-#include <xmmintrin.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "quadtree.h"
 #include "timing.h"
+#include "trace.h"
+#include "thread_pool.h"
 #include "octree.h"
+#include "octree_stream.h"
+#include "octree_edit.h"
+#include "renderer.h"
 
 #define static_assert(test, message) typedef char static_assert__##message[(test)?1:-1]
 
 using std::max;
 using std::min;
 
-static quadtree face;
-static octree * root;
-static int C; //< The corner that is furthest away from the camera.
-static int count, count_oct, count_quad;
-static glm::dvec3 look_dir;
+static const int32_t SCENE_DEPTH = 26;
+
+/** A call of traversal::traverse that is pending on the explicit stack of traversal::traverse_stack.
+ * Its dx, dy, dz and frustum are those of its quadtree node, which are stored in traversal::projection. */
+struct traversal_frame {
+    __m128i bound, pos;
+    int32_t quadnode;
+    uint32_t octnode;
+    int32_t depth;
+    int32_t kind; //< Whether the frame descends the octree or the quadtree, for the statistics.
+};
+
+/** The dx, dy, dz and frustum arguments of traversal::traverse, which only change when descending the quadtree. */
+struct traversal_projection {
+    __m128i dx, dy, dz, frustum;
+};
+
+/** The capacity of the explicit stack.
+ * Each of the at most SCENE_DEPTH+1 octree levels and MAX_DIM+1 quadtree levels pushes at most 8 frames. */
+static const int TRAVERSAL_STACK_SIZE = 8 * 48;
+
+struct beam_tile;
+
+/** The number of entry nodes that are cached per tile, see renderer::set_entry_cache. */
+static const int ENTRY_CACHE_SIZE = 4;
+
+/** An octree node at which the traversal of a tile started, stored as the octants on the path from the root. */
+struct traversal_entry {
+    uint8_t length;
+    uint8_t path[SCENE_DEPTH+1];
+};
+
+/** The entry nodes of a tile that rendered pixels, in traversal order. */
+struct cached_tile {
+    int count;
+    traversal_entry entry[ENTRY_CACHE_SIZE];
+};
+
+/** The entry nodes of the tiles of a rectangle and the octree and camera for which they were found. */
+struct entry_cache {
+    octree * root;
+    uint32_t top;
+    view_pane view;
+    glm::dvec3 position;
+    glm::dmat3 orientation;
+    uint32_t dim;
+    std::vector<cached_tile> tiles;
+    uint64_t work; //< The number of nodes visited while rendering the rectangle, which is kept while the camera moves.
+};
+
+/** The entry caches of the rendered rectangles, by their position and size.
+ * A parallel_renderer keeps those of its current tiles, a renderer only that of the last rendered rectangle. */
+struct entry_caches {
+    std::map<uint64_t, entry_cache> rectangles;
+};
+
+static uint64_t rectangle_key(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    return (uint64_t)x | (uint64_t)y << 16 | (uint64_t)width << 32 | (uint64_t)height << 48;
+}
+
+/** The state of a renderer.
+ * A traversal modifies its quadtree, hence each thread requires its own instance.
+ */
+struct traversal {
+    quadtree face;
+    octree * root;
+    uint32_t top; //< Index of the root node of the octree.
+    octree_stream * stream; //< If not null, the chunks containing the visited nodes are marked as used.
+    int C; //< The corner that is furthest away from the camera.
+    uint32_t detail; //< Level of detail, see renderer::set_detail.
+    int lod_M; //< Quadtree nodes with an index of at least lod_M are rendered as a block of pixels.
+    bool reuse; //< Whether pixels that are already drawn are kept, see renderer::set_reuse.
+    bool iterative; //< Whether traverse_stack is used instead of traverse, see renderer::set_iterative.
+    bool beam; //< Whether the tiles are traversed starting from the nodes found by beam_prepass, see renderer::set_beam.
+    bool caching; //< Whether the entry nodes of the tiles are cached, see renderer::set_entry_cache.
+    entry_caches own_caches;
+    entry_caches * caches; //< Either own_caches or those shared by the renderers of a parallel_renderer.
+    entry_cache * cache; //< The cache of the rectangle that is being rendered, or null.
+    cached_tile * record; //< Where beam_walk stores the entry nodes that rendered pixels, or null.
+    cached_tile seeded; //< The entry nodes from which beam_seed traversed the current tile.
+    uint8_t path[SCENE_DEPTH+1]; //< The octants on the path of beam_walk from the root to the current octree node.
+    render_stats stats;
+    glm::dvec3 look_dir;
+    glm::dvec3 camera; //< The position of the camera.
+    std::vector<traversal_frame> stack;
+    /** The projection of the quadtree nodes of the frames on the stack, indexed by their level and (quadnode&3).
+     * Frames with a quadtree node at level l are only pushed after the projections of that level have been written
+     * and are popped before they are overwritten, as only the quadtree nodes at level l-1 write them. */
+    traversal_projection projection[quadtree::MAX_DIM+1][4];
+#ifdef __AVX2__
+    /** For each pair of octree children (2p, 2p+1), masks selecting whether dx, dy and dz are added to their bound.
+     * Stored as pairs of 128-bit values, as the traversal is allocated without 32-byte alignment. Depends on C. */
+    __m128i child_select[4][3][2];
+#endif
+
+    bool traverse(
+        const int32_t quadnode, const uint32_t octnode,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+        const __m128i pos, const int depth
+    );
+    void traverse_stack(
+        const int32_t quadnode, const uint32_t octnode,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+        const __m128i pos, const int depth
+    );
+    void traverse_any(
+        const int32_t quadnode, const uint32_t octnode,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+        const __m128i pos, const int depth
+    );
+    bool beam_walk(
+        const beam_tile &tile, const int32_t quadnode, const int level, const uint32_t octnode,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+        const __m128i pos, const int depth
+    );
+    bool beam_seed(
+        const beam_tile &tile, const traversal_entry &entry,
+        const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, const __m128i pos
+    );
+    void remember(const int depth);
+    void select_cache(uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+    void beam_prepass(const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, const __m128i pos);
+    int visible_children(const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, __m128i * new_bound);
+    void rendered(int32_t quadnode);
+    void render(const scene_layer * layers, uint32_t count, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+};
 
 constexpr static int make_mask(int a, int b, int c, int d) {
     return (a<<0)+(b<<1)+(c<<2)+(d<<3);
@@ -48,8 +184,6 @@ constexpr int quad_mask[8] = {
     make_mask(0,1,1,0),
 };
 
-static const int32_t SCENE_DEPTH = 26;
-
 static const int DX=4, DY=2, DZ=1;
 static const __m128i DELTA[8]={
     _mm_set_epi32(0,-1,-1,-1),
@@ -123,14 +257,56 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
   {constexpr int k = 6; code} \
   {constexpr int k = 7; code} 
 
-#define FOR_k_IS_0_TO_6(code) \
-  {constexpr int k = 0; code} \
-  {constexpr int k = 1; code} \
-  {constexpr int k = 2; code} \
-  {constexpr int k = 3; code} \
-  {constexpr int k = 4; code} \
-  {constexpr int k = 5; code} \
-  {constexpr int k = 6; code}
+/** Counts the bits that are set, for use in constant expressions. */
+constexpr static int popcount_constexpr(int v) {
+    return v ? (v&1) + popcount_constexpr(v>>1) : 0;
+}
+
+/** Packs the children of a node with the given bitmask in the order in which they are visited, being i = furthest^k for k = 0..7.
+ * Each child takes 6 bits: its index i (bits 0-2) and its position in the child array (bits 3-5).
+ * The top 4 bits store the number of children. */
+constexpr static uint64_t make_child_order(int furthest, int bitmask, int k = 0, int n = 0, uint64_t order = 0) {
+    return k == 8 ? order | (uint64_t)n << 60 :
+        ((bitmask >> (furthest^k)) & 1)
+            ? make_child_order(furthest, bitmask, k+1, n+1,
+                order | (uint64_t)((furthest^k) | popcount_constexpr(bitmask & ((1<<(furthest^k)) - 1)) << 3) << 6*n)
+            : make_child_order(furthest, bitmask, k+1, n, order);
+}
+
+#define CHILD_ORDER_4(f, m) \
+    make_child_order(f, m), make_child_order(f, m+1), make_child_order(f, m+2), make_child_order(f, m+3)
+#define CHILD_ORDER_16(f, m) CHILD_ORDER_4(f, m), CHILD_ORDER_4(f, m+4), CHILD_ORDER_4(f, m+8), CHILD_ORDER_4(f, m+12)
+#define CHILD_ORDER_64(f, m) CHILD_ORDER_16(f, m), CHILD_ORDER_16(f, m+16), CHILD_ORDER_16(f, m+32), CHILD_ORDER_16(f, m+48)
+#define CHILD_ORDER_256(f) {CHILD_ORDER_64(f, 0), CHILD_ORDER_64(f, 64), CHILD_ORDER_64(f, 128), CHILD_ORDER_64(f, 192)}
+
+/** The order in which the children of an octree node are visited, indexed by the furthest octant and the node's bitmask.
+ * Hence the traversal only iterates over the existing children and does not need to compute their positions. */
+constexpr uint64_t child_order[8][256] = {
+    CHILD_ORDER_256(0), CHILD_ORDER_256(1), CHILD_ORDER_256(2), CHILD_ORDER_256(3),
+    CHILD_ORDER_256(4), CHILD_ORDER_256(5), CHILD_ORDER_256(6), CHILD_ORDER_256(7),
+};
+
+#undef CHILD_ORDER_4
+#undef CHILD_ORDER_16
+#undef CHILD_ORDER_64
+#undef CHILD_ORDER_256
+
+/** Returns the bitmask of the children of an octree node.
+ * Duplicate leaf nodes have 7 children, as the nearest child is always occluded by the others. */
+static inline int children_mask(const octree * root, uint32_t octnode, int furthest) {
+    return (octnode < 0xff000000u) ? root[octnode].bitmask : 0xff & ~(1 << (furthest^7));
+}
+
+/** Computes the projection (bound, dx, dy or dz) of the quadtree child i (4-7), like the fixed size loops in traverse. */
+static inline __m128i quad_child(__m128i v, int i) {
+    __m128i mid = _mm_srai_epi32(_mm_sub_epi32(v, _mm_shuffle_epi32(v,0xb1)), 1);
+    switch (i) {
+        case 4: return blend_epi32<quad_mask[4]>(mid, v);
+        case 5: return blend_epi32<quad_mask[5]>(mid, v);
+        case 6: return blend_epi32<quad_mask[6]>(mid, v);
+        default: return blend_epi32<quad_mask[7]>(mid, v);
+    }
+}
 
 /** Core of the voxel rendering algorithm.
  * @param quadnode the index of the quadnode that will be rendered to. It is assumed that it is not yet fully rendered.
@@ -143,47 +319,43 @@ static inline __m128i compute_frustum(__m128i dx, __m128i dy, __m128i dz) {
  * @param depth limits the number of nested traverse calls, to prevent stack overflows.
  * @return true if quadtree node is rendered 
  */
-static bool traverse(
+bool traversal::traverse(
     const int32_t quadnode, const uint32_t octnode,
     const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
     const __m128i pos, const int depth
 ){    
-    count++;
+    stats.count++;
+    // Each nested call descends either one octree or one quadtree level.
+    // Quadtree nodes at level l (root at 0) have indices in [(4^l-4)/3, (4^(l+1)-4)/3).
+    uint32_t nesting = SCENE_DEPTH - depth + (31 - __builtin_clz(3*quadnode+4)) / 2;
+    if (nesting > stats.max_depth) stats.max_depth = nesting;
+    if (stream && octnode < 0xff000000u) stream->touch(octnode);
     // Recursion
     int delta = extract_epi32<0>(_mm_add_epi32(bound,_mm_srli_si128(bound,4)));
     if (depth>=0 && delta < 2<<SCENE_DEPTH) {
         __m128i octant = _mm_cmplt_epi32(pos, _mm_setzero_si128());
         int furthest = movemask_epi32(_mm_shuffle_epi32(octant, 0xc6));
-        if (octnode < 0xff000000) {
-            // Traverse octree
-            FOR_k_IS_0_TO_7({
-                int i = furthest^k;
-                if (root[octnode].has_index(i)) {
-                    int j = root[octnode].position(i);
-                    __m128i new_bound = _mm_slli_epi32(bound, 1);
-                    if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
-                    if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
-                    if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
-                    if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
-                        count_oct++;
-                        if (traverse(quadnode, root[octnode].child[j], new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
-                    }
+        // Traverse octree
+        uint64_t order = child_order[furthest][children_mask(root, octnode, furthest)];
+        int n = order >> 60;
+        FOR_k_IS_0_TO_7(
+            if (k >= n) return false;
+            int i = (order >> 6*k) & 7;
+            uint32_t child = (octnode < 0xff000000u) ? root[octnode].child[(order >> (6*k+3)) & 7] : octnode;
+            __m128i new_bound = _mm_slli_epi32(bound, 1);
+            if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
+            if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
+            if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
+            if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
+                stats.count_oct++;
+                if (traverse(quadnode, child, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) {
+                    stats.culled_occlusion += n-1-k;
+                    return true;
                 }
-            });
-        } else {
-            // Duplicate leaf node
-            FOR_k_IS_0_TO_6({
-                int i = furthest^k;
-                __m128i new_bound = _mm_slli_epi32(bound, 1);
-                if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
-                if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
-                if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
-                if (!movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) { // frustum occlusion
-                    count_oct++;
-                    if (traverse(quadnode, octnode, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) return true;
-                }
-            });
-        }
+            } else {
+                stats.culled_frustum++;
+            }
+        )
         return false;
     } else {
         // Traverse quadtree 
@@ -201,19 +373,26 @@ static bool traverse(
                 __m128i new_dz = blend_epi32<new_mask>(mid_dz, dz);
                 __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
                 if (!movemask_epi32(_mm_cmplt_epi32(new_bound, new_frustum))) { // frustum occlusion
-                    if (quadnode<quadtree::M) {
+                    if (quadnode<lod_M) {
                         if (traverse(quadnode*4+i, octnode, new_bound, new_dx, new_dy, new_dz, new_frustum, pos, depth)) {
                             mask &= ~(1<<i); 
                         }
-                        count_quad++;
+                        stats.count_quad++;
                     } else {
                         glm::dvec3 dpos(extract_epi32<0>(pos), extract_epi32<1>(pos), extract_epi32<2>(pos));
                         double depth = glm::dot(dpos, look_dir);
                         uint32_t udepth(depth);
                         uint32_t color = (octnode < 0xff000000u) ? root[octnode].avgcolor : octnode;
-                        face.draw(quadnode*4+i, color, udepth); // Rendering
+                        if (quadnode<face.M) {
+                            stats.pixels += face.fill(quadnode*4+i, color, udepth); // Rendering at reduced level of detail
+                        } else {
+                            face.draw(quadnode*4+i, color, udepth); // Rendering
+                            stats.pixels++;
+                        }
                         mask &= ~(1<<i);
                     }
+                } else {
+                    stats.culled_frustum++;
                 }
             }
         });
@@ -222,31 +401,425 @@ static bool traverse(
     }
 }
 
-/** Render the octree to the provided surface for the given viewpane, position and orientation.
- * @param file the octree that is being rendered.
- * @param surf the surface that is being rendered to.
- * @param position the position of the camera.
- * @param orientation the orientation of the camera (which is assumed to be orthogonal).
+enum {FRAME_ROOT, FRAME_OCTREE, FRAME_QUADTREE};
+
+/** Computes the bounds of the 8 octree children of a node and tests them against the frustum.
+ * @param new_bound is set to the bound of each child, indexed by its octant.
+ * @return a bitmask of the children that are not culled by frustum occlusion. */
+inline int traversal::visible_children(
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, __m128i * new_bound
+){
+    int visible = 0;
+#ifdef __AVX2__
+    // Two children per register, such that all 8 are tested using 4 comparisons.
+    __m256i b = _mm256_broadcastsi128_si256(_mm_slli_epi32(bound, 1));
+    __m256i x = _mm256_broadcastsi128_si256(dx);
+    __m256i y = _mm256_broadcastsi128_si256(dy);
+    __m256i z = _mm256_broadcastsi128_si256(dz);
+    __m256i f = _mm256_broadcastsi128_si256(frustum);
+    for (int p=0; p<4; p++) {
+        __m256i nb = _mm256_add_epi32(b, _mm256_add_epi32(
+            _mm256_and_si256(_mm256_loadu_si256((const __m256i*)child_select[p][0]), x),
+            _mm256_add_epi32(
+                _mm256_and_si256(_mm256_loadu_si256((const __m256i*)child_select[p][1]), y),
+                _mm256_and_si256(_mm256_loadu_si256((const __m256i*)child_select[p][2]), z)
+            )
+        ));
+        _mm256_storeu_si256((__m256i*)&new_bound[2*p], nb);
+        int culled = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(f, nb)));
+        visible |= ((culled & 15) == 0) << (2*p);
+        visible |= ((culled >> 4) == 0) << (2*p+1);
+    }
+#else
+    for (int i=0; i<8; i++) {
+        new_bound[i] = _mm_slli_epi32(bound, 1);
+        if ((C^i)&DX) new_bound[i] = _mm_add_epi32(new_bound[i],dx);
+        if ((C^i)&DY) new_bound[i] = _mm_add_epi32(new_bound[i],dy);
+        if ((C^i)&DZ) new_bound[i] = _mm_add_epi32(new_bound[i],dz);
+        visible |= !movemask_epi32(_mm_cmplt_epi32(new_bound[i], frustum)) << i;
+    }
+#endif
+    return visible;
+}
+
+/** Marks the quadtree node, which has no unrendered children left, as rendered in its ancestors. */
+inline void traversal::rendered(int32_t quadnode) {
+    while (quadnode >= 0) {
+        int32_t parent = (quadnode >> 2) - 1;
+        face.children[parent] &= ~(16 << (quadnode & 3));
+        if (face.children[parent]) return;
+        quadnode = parent;
+    }
+}
+
+/** Performs the same traversal as traverse, producing the same image, using an explicit stack instead of recursion.
+ * The frustum occlusion tests of all children of an octree node are evaluated at once,
+ * after which the visible children are pushed in back to front order.
+ * Instead of returning whether a quadtree node is rendered, a rendered quadtree node is immediately
+ * removed from its ancestors, and pending frames whose quadtree node is rendered are skipped.
  */
-void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
-    Timer t_global;
-    
-    double timer_prepare;
-    double timer_query;
-    
-    // Make sure that the quadtree is big enough that it can contain the rendered surface.
-    // If these checks fail, increase quadtree::dim in quadtree.h.
-    assert(quadtree::SIZE >= surf.width);
-    assert(quadtree::SIZE >= surf.height);
+void traversal::traverse_stack(
+    const int32_t quadnode, const uint32_t octnode,
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+    const __m128i pos, const int depth
+){
+    traversal_frame * base = stack.data();
+    traversal_frame * top = base;
+    projection[(31 - __builtin_clz(3*quadnode+4)) / 2][quadnode&3] = traversal_projection{dx, dy, dz, frustum};
+    *top++ = traversal_frame{bound, pos, quadnode, octnode, depth, FRAME_ROOT};
+    while (top != base) {
+        const traversal_frame f = *--top;
+        if (face.children[f.quadnode] == 0) {
+            // Occluded by a frame that was processed after this one was pushed.
+            if (f.kind == FRAME_OCTREE) stats.culled_occlusion++;
+            continue;
+        }
+        stats.count++;
+        if (f.kind == FRAME_OCTREE) stats.count_oct++;
+        if (f.kind == FRAME_QUADTREE) stats.count_quad++;
+        int level = (31 - __builtin_clz(3*f.quadnode+4)) / 2;
+        uint32_t nesting = SCENE_DEPTH - f.depth + level;
+        if (nesting > stats.max_depth) stats.max_depth = nesting;
+        if (stream && f.octnode < 0xff000000u) stream->touch(f.octnode);
+        const traversal_projection &p = projection[level][f.quadnode&3];
+        int delta = extract_epi32<0>(_mm_add_epi32(f.bound,_mm_srli_si128(f.bound,4)));
+        if (f.depth>=0 && delta < 2<<SCENE_DEPTH) {
+            // Traverse octree
+            __m128i octant = _mm_cmplt_epi32(f.pos, _mm_setzero_si128());
+            int furthest = movemask_epi32(_mm_shuffle_epi32(octant, 0xc6));
+            __m128i new_bound[8];
+            int visible = visible_children(f.bound, p.dx, p.dy, p.dz, p.frustum, new_bound);
+            int present = children_mask(root, f.octnode, furthest);
+            stats.culled_frustum += popcount(present & ~visible);
+            uint64_t order = child_order[furthest][present];
+            assert(top + 8 <= base + stack.size());
+            for (int k=(order >> 60)-1; k>=0; k--) {
+                int i = (order >> 6*k) & 7;
+                if (visible & (1<<i)) {
+                    uint32_t child = (f.octnode < 0xff000000u) ? root[f.octnode].child[(order >> (6*k+3)) & 7] : f.octnode;
+                    *top++ = traversal_frame{new_bound[i], _mm_add_epi32(f.pos, _mm_slli_epi32(DELTA[i], f.depth)), f.quadnode, child, f.depth-1, FRAME_OCTREE};
+                }
+            }
+        } else {
+            // Traverse quadtree, pushing the children in reverse order.
+            int mask = face.children[f.quadnode];
+            __m128i mid_bound = _mm_srai_epi32(_mm_sub_epi32(f.bound, _mm_shuffle_epi32(f.bound,0xb1)), 1);
+            __m128i mid_dx = _mm_srai_epi32(_mm_sub_epi32(p.dx, _mm_shuffle_epi32(p.dx,0xb1)), 1);
+            __m128i mid_dy = _mm_srai_epi32(_mm_sub_epi32(p.dy, _mm_shuffle_epi32(p.dy,0xb1)), 1);
+            __m128i mid_dz = _mm_srai_epi32(_mm_sub_epi32(p.dz, _mm_shuffle_epi32(p.dz,0xb1)), 1);
+            traversal_frame * frames = top;
+            traversal_projection * child_projection = projection[level+1];
+            FOR_i_IS_4_TO_7({
+                if (mask&(1<<i)) {
+                    constexpr int new_mask = quad_mask[i];
+                    __m128i new_bound = blend_epi32<new_mask>(mid_bound, f.bound);
+                    __m128i new_dx = blend_epi32<new_mask>(mid_dx, p.dx);
+                    __m128i new_dy = blend_epi32<new_mask>(mid_dy, p.dy);
+                    __m128i new_dz = blend_epi32<new_mask>(mid_dz, p.dz);
+                    __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
+                    if (!movemask_epi32(_mm_cmplt_epi32(new_bound, new_frustum))) { // frustum occlusion
+                        if (f.quadnode<lod_M) {
+                            child_projection[i-4] = (traversal_projection{new_dx, new_dy, new_dz, new_frustum});
+                            *top++ = (traversal_frame{new_bound, f.pos, f.quadnode*4+i, f.octnode, f.depth, FRAME_QUADTREE});
+                        } else {
+                            glm::dvec3 dpos(extract_epi32<0>(f.pos), extract_epi32<1>(f.pos), extract_epi32<2>(f.pos));
+                            double depth = glm::dot(dpos, look_dir);
+                            uint32_t udepth(depth);
+                            uint32_t color = (f.octnode < 0xff000000u) ? root[f.octnode].avgcolor : f.octnode;
+                            if (f.quadnode<face.M) {
+                                stats.pixels += face.fill(f.quadnode*4+i, color, udepth); // Rendering at reduced level of detail
+                            } else {
+                                face.draw(f.quadnode*4+i, color, udepth); // Rendering
+                                stats.pixels++;
+                            }
+                            mask &= ~(1<<i);
+                        }
+                    } else {
+                        stats.culled_frustum++;
+                    }
+                }
+            });
+            std::reverse(frames, top);
+            face.children[f.quadnode] = mask;
+            if (mask == 0) rendered(f.quadnode);
+        }
+    }
+}
+
+/** Traverses using either traverse or traverse_stack, depending on iterative. */
+void traversal::traverse_any(
+    const int32_t quadnode, const uint32_t octnode,
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+    const __m128i pos, const int depth
+){
+    if (iterative) {
+        traverse_stack(quadnode, octnode, bound, dx, dy, dz, frustum, pos, depth);
+    } else {
+        traverse(quadnode, octnode, bound, dx, dy, dz, frustum, pos, depth);
+    }
+}
+
+/** The beam pre-pass works on tiles of 2^BEAM_TILE_DIM x 2^BEAM_TILE_DIM pixels. */
+static const int BEAM_TILE_DIM = 4;
+/** Margin, in units of the bounds and per quadtree level between the tested state and the tile,
+ * by which an octree node must be outside a tile to be excluded from it.
+ *
+ * The pre-pass descends the L quadtree levels to the tile before any further octree levels, while traverse
+ * interleaves them. Both would give the same bounds if quad_child halved exactly, and then no descendant of
+ * an excluded node could pass the frustum test at the tile. Relative to exact halving, starting from the same
+ * bound, dx, dy and dz, and measured in units of the tested node:
+ *  - the pre-pass rounds L times, which is off by at most L/2;
+ *  - dx, dy and dz below the tested state are off by at most L/2, hence the frustum at the tile by at most 3L/2;
+ *  - traverse rounds L times, off by at most L/2, and each octree level adds the rounding of dx, dy and dz,
+ *    which is at most 3L/2 and halves in these units with each level, such that all levels add less than 3L/2.
+ * Passing the frustum test with a deficit c implies that the parent passes with a deficit c/2, which bounds
+ * the deficit of the tested node by the sum of these, being 5.5L. */
+static const int BEAM_MARGIN_PER_LEVEL = 6;
+
+/** A tile of the beam pre-pass. */
+struct beam_tile {
+    int32_t quadnode;
+    int level;
+    int digit[quadtree::MAX_DIM]; //< The child index in its parent (4-7) of the tile's ancestor at each level.
+    __m128i frustum;
+};
+
+/** Follows the (octnode, quadnode) states of traverse that lead to the tile, in the same order as traverse,
+ * skipping the octree nodes that are outside the tile. These might be visible in other parts of the quadtree nodes
+ * above the tile, which traverse tests them against, but cannot contribute to the tile.
+ * Each state that reaches the tile's quadtree node is traversed as usual.
+ * @return true if the tile is rendered.
+ */
+bool traversal::beam_walk(
+    const beam_tile &tile, const int32_t quadnode, const int level, const uint32_t octnode,
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum,
+    const __m128i pos, const int depth
+){
+    if (quadnode == tile.quadnode) {
+        // A node that was traversed by beam_seed cannot render any of the pixels that remain.
+        int length = SCENE_DEPTH-1-depth;
+        for (int i=0; i<seeded.count; i++) {
+            if (seeded.entry[i].length == length && std::equal(path, path + length, seeded.entry[i].path)) return false;
+        }
+        uint64_t pixels = stats.pixels;
+        traverse_any(quadnode, octnode, bound, dx, dy, dz, frustum, pos, depth);
+        if (stats.pixels != pixels) remember(depth);
+        return face.children[quadnode] == 0;
+    }
+    stats.beam_oct++;
+    int delta = extract_epi32<0>(_mm_add_epi32(bound,_mm_srli_si128(bound,4)));
+    if (depth>=0 && delta < 2<<SCENE_DEPTH) {
+        __m128i octant = _mm_cmplt_epi32(pos, _mm_setzero_si128());
+        int furthest = movemask_epi32(_mm_shuffle_epi32(octant, 0xc6));
+        const __m128i margin = _mm_set1_epi32(BEAM_MARGIN_PER_LEVEL * (tile.level - level));
+        uint64_t order = child_order[furthest][children_mask(root, octnode, furthest)];
+        for (int k=0, n=order>>60; k<n; k++, order>>=6) {
+            int i = order & 7;
+            __m128i new_bound = _mm_slli_epi32(bound, 1);
+            if ((C^i)&DX) new_bound = _mm_add_epi32(new_bound,dx);
+            if ((C^i)&DY) new_bound = _mm_add_epi32(new_bound,dy);
+            if ((C^i)&DZ) new_bound = _mm_add_epi32(new_bound,dz);
+            if (movemask_epi32(_mm_cmplt_epi32(new_bound, frustum))) continue; // frustum occlusion
+            __m128i tile_bound = new_bound;
+            for (int l=level; l<tile.level; l++) {
+                tile_bound = quad_child(tile_bound, tile.digit[l]);
+            }
+            if (movemask_epi32(_mm_cmplt_epi32(_mm_add_epi32(tile_bound, margin), tile.frustum))) continue; // outside the tile
+            uint32_t child = (octnode < 0xff000000u) ? root[octnode].child[(order >> 3) & 7] : octnode;
+            path[SCENE_DEPTH-1-depth] = i;
+            if (beam_walk(tile, quadnode, level, child, new_bound, dx, dy, dz, frustum, _mm_add_epi32(pos, _mm_slli_epi32(DELTA[i], depth)), depth-1)) {
+                return true;
+            }
+        }
+        return false;
+    } else {
+        int i = tile.digit[level];
+        if (!(face.children[quadnode] & (1<<i))) return false;
+        __m128i new_bound = quad_child(bound, i);
+        __m128i new_dx = quad_child(dx, i);
+        __m128i new_dy = quad_child(dy, i);
+        __m128i new_dz = quad_child(dz, i);
+        __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
+        if (movemask_epi32(_mm_cmplt_epi32(new_bound, new_frustum))) return false; // frustum occlusion
+        return beam_walk(tile, quadnode*4+i, level+1, octnode, new_bound, new_dx, new_dy, new_dz, new_frustum, pos, depth);
+    }
+}
+
+/** Adds the octree node at the end of path to the entry nodes that are being recorded. */
+void traversal::remember(const int depth) {
+    if (!record || record->count == ENTRY_CACHE_SIZE) return;
+    traversal_entry &e = record->entry[record->count++];
+    e.length = SCENE_DEPTH-1-depth;
+    std::copy(path, path + e.length, e.path);
+}
+
+/** Follows the path of a cached entry node from the root, like beam_walk, and traverses the tile from that node.
+ * The path is abandoned if one of its nodes is no longer visible, or if the path ends before reaching the tile.
+ * If it reaches the tile before its end, the tile is traversed from the node at which it did.
+ * @return true if this rendered pixels.
+ */
+bool traversal::beam_seed(
+    const beam_tile &tile, const traversal_entry &entry,
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, const __m128i pos
+){
+    int32_t quadnode = -1;
+    int level = 0;
+    uint32_t octnode = top;
+    __m128i b = bound, qdx = dx, qdy = dy, qdz = dz, qfrustum = frustum, p = pos;
+    int depth = SCENE_DEPTH-1;
+    while (quadnode != tile.quadnode) {
+        stats.beam_oct++;
+        int delta = extract_epi32<0>(_mm_add_epi32(b,_mm_srli_si128(b,4)));
+        if (depth>=0 && delta < 2<<SCENE_DEPTH) {
+            int step = SCENE_DEPTH-1-depth;
+            if (step == entry.length) return false;
+            int i = entry.path[step];
+            if (octnode < 0xff000000u) {
+                if (!root[octnode].has_index(i)) return false;
+            } else {
+                // The nearest child of a duplicate leaf node is skipped, see traverse.
+                __m128i octant = _mm_cmplt_epi32(p, _mm_setzero_si128());
+                if (i == (movemask_epi32(_mm_shuffle_epi32(octant, 0xc6))^7)) return false;
+            }
+            b = _mm_slli_epi32(b, 1);
+            if ((C^i)&DX) b = _mm_add_epi32(b,qdx);
+            if ((C^i)&DY) b = _mm_add_epi32(b,qdy);
+            if ((C^i)&DZ) b = _mm_add_epi32(b,qdz);
+            if (movemask_epi32(_mm_cmplt_epi32(b, qfrustum))) return false; // frustum occlusion
+            if (octnode < 0xff000000u) octnode = root[octnode].child[root[octnode].position(i)];
+            path[step] = i;
+            p = _mm_add_epi32(p, _mm_slli_epi32(DELTA[i], depth));
+            depth--;
+        } else {
+            int i = tile.digit[level];
+            if (!(face.children[quadnode] & (1<<i))) return false;
+            b = quad_child(b, i);
+            qdx = quad_child(qdx, i);
+            qdy = quad_child(qdy, i);
+            qdz = quad_child(qdz, i);
+            qfrustum = compute_frustum(qdx, qdy, qdz);
+            if (movemask_epi32(_mm_cmplt_epi32(b, qfrustum))) return false; // frustum occlusion
+            quadnode = quadnode*4+i;
+            level++;
+        }
+    }
+    traversal_entry &e = seeded.entry[seeded.count++];
+    e.length = SCENE_DEPTH-1-depth;
+    std::copy(path, path + e.length, e.path);
+    uint64_t pixels = stats.pixels;
+    traverse_any(quadnode, octnode, b, qdx, qdy, qdz, qfrustum, p, depth);
+    if (stats.pixels == pixels) return false;
+    remember(depth);
+    return true;
+}
+
+/** Selects the entry cache of the rendered rectangle, whose entry nodes are cleared unless the octree and camera are unchanged.
+ * Rectangles of a parallel_renderer are added before its tiles are rendered, hence this only reads the map. */
+void traversal::select_cache(uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    cache = nullptr;
+    if (!caching) return;
+    uint64_t key = rectangle_key(x, y, width, height);
+    auto c = caches->rectangles.find(key);
+    if (c == caches->rectangles.end()) {
+        assert(caches == &own_caches);
+        own_caches.rectangles.clear();
+        c = caches->rectangles.emplace(key, entry_cache()).first;
+    }
+    cache = &c->second;
+    size_t tiles = face.dim > BEAM_TILE_DIM ? 1u << 2*(face.dim - BEAM_TILE_DIM) : 0;
+    if (cache->root != root || cache->top != top || cache->dim != face.dim || cache->tiles.size() != tiles ||
+        cache->position != position || cache->orientation != orientation ||
+        view.left != cache->view.left || view.right != cache->view.right || view.top != cache->view.top || view.bottom != cache->view.bottom) {
+        cache->root = root;
+        cache->top = top;
+        cache->view = view;
+        cache->position = position;
+        cache->orientation = orientation;
+        cache->dim = face.dim;
+        cache->tiles.assign(tiles, cached_tile{0, {}});
+    }
+}
+
+/** Renders the image per tile of 2^BEAM_TILE_DIM x 2^BEAM_TILE_DIM pixels, using beam_walk.
+ * Traverse tests the octree nodes against the quadtree node that is being traversed, which for the
+ * upper levels spans most of the image, such that a large part of the traversed nodes turns out
+ * to be empty for the quadtree nodes further down. This pass instead tests the upper octree levels against
+ * the frustum of each tile, and only starts the traversal of the lower levels where they reach the tile.
+ * As the states are visited in the same order as traverse, this renders the same image.
+ * The rendered tiles are removed from the quadtree, such that the traversal from the root that follows only
+ * renders what this pass could not.
+ *
+ * If the entry cache is enabled and the octree and camera did not change, each tile is first traversed from the
+ * entry nodes that rendered it in the previous frame. These are the first nodes that render pixels in the tile,
+ * in traversal order, and the nodes before them render none, hence this renders the same image. If the entry
+ * nodes render all of the tile, its upper octree levels need not be traversed. Otherwise the tile is traversed
+ * from the root, skipping the entry nodes. If the camera moved, nodes that were not visible could appear in front
+ * of the entry nodes, hence the tiles are then traversed from the root only.
+ */
+void traversal::beam_prepass(
+    const __m128i bound, const __m128i dx, const __m128i dy, const __m128i dz, const __m128i frustum, const __m128i pos
+){
+    TRACE_ZONE("beam_prepass");
+    beam_tile tile;
+    tile.level = face.dim - BEAM_TILE_DIM;
+    record = nullptr;
+    if (tile.level < 1) return;
+    int32_t first = ((1<<2*tile.level) - 4) / 3;
+    int32_t last = ((4<<2*tile.level) - 4) / 3;
+    // The quadtree nodes above the tiles must be traversed, rather than rendered at a reduced level of detail.
+    if (lod_M < first) return;
+    for (tile.quadnode=first; tile.quadnode<last; tile.quadnode++) {
+        if (face.children[tile.quadnode] == 0) continue; // Outside the viewport or already rendered.
+        for (int32_t q=tile.quadnode, l=tile.level; l>0; l--) {
+            tile.digit[l-1] = (q&3) + 4;
+            q = (q>>2) - 1;
+        }
+        __m128i tile_dx = dx, tile_dy = dy, tile_dz = dz;
+        for (int l=0; l<tile.level; l++) {
+            tile_dx = quad_child(tile_dx, tile.digit[l]);
+            tile_dy = quad_child(tile_dy, tile.digit[l]);
+            tile_dz = quad_child(tile_dz, tile.digit[l]);
+        }
+        tile.frustum = compute_frustum(tile_dx, tile_dy, tile_dz);
+        cached_tile entries;
+        entries.count = 0;
+        record = cache ? &entries : nullptr;
+        seeded.count = 0;
+        if (cache) {
+            // Start with the nodes that rendered the tile in the previous frame, which are likely to be still in front.
+            const cached_tile &previous = cache->tiles[tile.quadnode - first];
+            for (int i=0; i<previous.count && face.children[tile.quadnode]; i++) {
+                beam_seed(tile, previous.entry[i], bound, dx, dy, dz, frustum, pos);
+            }
+            if (previous.count && !face.children[tile.quadnode]) stats.cached_tiles++;
+        }
+        if (face.children[tile.quadnode]) {
+            beam_walk(tile, -1, 0, top, bound, dx, dy, dz, frustum, pos, SCENE_DEPTH-1);
+        }
+        if (cache) cache->tiles[tile.quadnode - first] = entries;
+        face.children[tile.quadnode] = 0;
+        rendered(tile.quadnode);
+        stats.beam_tiles++;
+    }
+}
+
+void traversal::render(const scene_layer * layers, uint32_t count, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    TRACE_ZONE("renderer::render");
+    tsc_timer t_total;
+    stats = render_stats();
+    stats.tiles = 1;
+    // Resize the quadtree such that it can just contain the rendered rectangle.
+    face.set_viewport(surf, x, y, width, height);
+    assert(face.SIZE >= width);
+    assert(face.SIZE >= height);
     
     double quadtree_bounds[] = {
         view.left,
-       (view.left + (view.right -view.left)*(double)quadtree::SIZE/surf.width ),
-       (view.top  + (view.bottom-view.top )*(double)quadtree::SIZE/surf.height),
+       (view.left + (view.right -view.left)*(double)face.SIZE/width ),
+       (view.top  + (view.bottom-view.top )*(double)face.SIZE/height),
         view.top,
     };
-    // On the other hand, if quadtree::dim is too high, it can cause an overflow in the computation of bounds[].
-    // If these checks fail, decrease quadtree::dim in quadtree.h.
+    // As the quadtree is at most twice as big as the rectangle, this should not cause an overflow in the computation of bounds[].
 #ifndef NDEBUG
     int overflow_limit = 0x3fffffff >> SCENE_DEPTH;
     for (int i=0; i<4; i++) {
@@ -254,17 +827,21 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
     }
 #endif
 
-    root = file->root;
-    face.surf = surf;
+    // Stop subdividing the quadtree detail levels above its leaves.
+    lod_M = face.M;
+    for (uint32_t i=0; i<detail && lod_M>-1; i++) {
+        lod_M = lod_M/4-1;
+    }
     look_dir = glm::dvec3(0,0,1) * orientation;
     
-    Timer t_prepare;
+    tsc_timer t_prepare;
     // Prepare the occlusion quadtree
-    face.build();
-    timer_prepare = t_prepare.elapsed();
+    stats.prepare_saved = face.build();
+    if (reuse) face.reuse();
+    stats.prepare = t_prepare.elapsed();
 
-    Timer t_query;
-    count_oct = count_quad = count = 0;
+    TRACE_ZONE("traverse");
+    tsc_timer t_query;
     // Do the actual rendering of the scene (i.e. execute the query).
     __m128i bounds[8];
     int max_z = INT_MIN;
@@ -289,10 +866,288 @@ void octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 pos
     __m128i new_dy = _mm_sub_epi32(bounds[C^DY], bounds[C]);
     __m128i new_dz = _mm_sub_epi32(bounds[C^DZ], bounds[C]);
     __m128i new_frustum = compute_frustum(new_dx, new_dy, new_dz);
-    traverse(-1, 0, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
-    timer_query = t_query.elapsed();
+    if (iterative) {
+        stack.resize(TRAVERSAL_STACK_SIZE);
+#ifdef __AVX2__
+        for (int i=0; i<8; i++) {
+            for (int j=0; j<3; j++) {
+                static const int axis[3] = {DX, DY, DZ};
+                child_select[i/2][j][i%2] = _mm_set1_epi32((C^i)&axis[j] ? ~0 : 0);
+            }
+        }
+#endif
+    }
+    camera = position;
+    if (count == 1) {
+        root = layers[0].root;
+        top = layers[0].top;
+        stream = layers[0].stream;
+        select_cache(x, y, width, height, view, position, orientation);
+        if (beam || caching) {
+            beam_prepass(bounds[C], new_dx, new_dy, new_dz, new_frustum, pos);
+        }
+    } else {
+        // The pre-pass marks its tiles as rendered, which would hide the layers that follow.
+        cache = nullptr;
+    }
+    for (uint32_t i=0; i<count && face.children[-1]; i++) {
+        root = layers[i].root;
+        top = layers[i].top;
+        stream = layers[i].stream;
+        traverse_any(-1, top, bounds[C], new_dx, new_dy, new_dz, new_frustum, pos, SCENE_DEPTH-1);
+    }
+    if (cache) cache->work = stats.count + stats.beam_oct;
+    stats.query = t_query.elapsed();
+    stats.total = t_total.elapsed();
+}
+
+render_stats::render_stats()
+  : total(0), prepare(0), prepare_saved(0), query(0)
+  , count(0), count_oct(0), count_quad(0), culled_frustum(0), culled_occlusion(0), pixels(0)
+  , max_depth(0), tiles(0), beam_tiles(0), beam_oct(0), cached_tiles(0)
+{}
+
+render_stats& render_stats::operator+=(const render_stats &other) {
+    total += other.total;
+    prepare += other.prepare;
+    prepare_saved += other.prepare_saved;
+    query += other.query;
+    count += other.count;
+    count_oct += other.count_oct;
+    count_quad += other.count_quad;
+    culled_frustum += other.culled_frustum;
+    culled_occlusion += other.culled_occlusion;
+    pixels += other.pixels;
+    max_depth = max(max_depth, other.max_depth);
+    tiles += other.tiles;
+    beam_tiles += other.beam_tiles;
+    beam_oct += other.beam_oct;
+    cached_tiles += other.cached_tiles;
+    return *this;
+}
+
+renderer::renderer() : data(new traversal()) {
+    data->detail = 0;
+    data->reuse = false;
+    data->iterative = false;
+    data->beam = false;
+    data->caching = false;
+    data->caches = &data->own_caches;
+    data->cache = nullptr;
+    data->record = nullptr;
+    data->seeded.count = 0;
+}
+
+renderer::~renderer() {
+    delete data;
+}
+
+void renderer::render(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    render(file, surf, 0, 0, surf.width, surf.height, view, position, orientation);
+}
+
+void renderer::render(octree_file* file, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    scene_layer layer = {file->root, file->top, file->stream};
+    data->render(&layer, 1, surf, x, y, width, height, view, position, orientation);
+}
+
+void renderer::render(const scene &s, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    std::vector<scene_layer> layers;
+    s.layers(position, layers);
+    render(layers.data(), layers.size(), surf, 0, 0, surf.width, surf.height, view, position, orientation);
+}
+
+void renderer::render(const scene_layer * layers, uint32_t count, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    data->render(layers, count, surf, x, y, width, height, view, position, orientation);
+}
+
+void renderer::set_detail(uint32_t level) { data->detail = level; }
+uint32_t renderer::detail() const { return data->detail; }
+void renderer::set_reuse(bool reuse) { data->reuse = reuse; }
+bool renderer::reuse() const { return data->reuse; }
+void renderer::set_iterative(bool iterative) { data->iterative = iterative; }
+bool renderer::iterative() const { return data->iterative; }
+void renderer::set_beam(bool beam) { data->beam = beam; }
+bool renderer::beam() const { return data->beam; }
+void renderer::set_entry_cache(bool enabled) {
+    data->caching = enabled;
+    if (!enabled) data->caches->rectangles.clear();
+}
+bool renderer::entry_cache() const { return data->caching; }
+
+const render_stats& renderer::stats() const { return data->stats; }
 
-    std::printf("%7.2f | Prepare:%4.2f Query:%7.2f | Count:%10d Oct:%10d Quad:%10d\n", t_global.elapsed(), timer_prepare, timer_query, count, count_oct, count_quad);
+/** Size in pixels of the square tiles that are rendered in parallel. */
+static const uint32_t TILE_SIZE = 128;
+
+parallel_renderer::parallel_renderer(int threads, bool pin) 
+  : pool(new thread_pool(threads, pin))
+  , workers(pool->size())
+  , caches(new entry_caches())
+{
+    // The tiles share their entry caches, as a tile is not always rendered by the same thread.
+    for (auto &w : workers) {
+        w.reset(new renderer());
+        w->data->caches = caches.get();
+    }
+}
+
+parallel_renderer::~parallel_renderer() {}
+
+int parallel_renderer::threads() const {
+    return pool->size();
+}
+
+void parallel_renderer::set_detail(uint32_t level) {
+    for (auto &w : workers) {
+        w->set_detail(level);
+    }
+}
+
+uint32_t parallel_renderer::detail() const {
+    return workers[0]->detail();
+}
+
+void parallel_renderer::set_reuse(bool reuse) {
+    for (auto &w : workers) {
+        w->set_reuse(reuse);
+    }
+}
+
+bool parallel_renderer::reuse() const {
+    return workers[0]->reuse();
+}
+
+void parallel_renderer::set_iterative(bool iterative) {
+    for (auto &w : workers) {
+        w->set_iterative(iterative);
+    }
+}
+
+bool parallel_renderer::iterative() const {
+    return workers[0]->iterative();
+}
+
+void parallel_renderer::set_beam(bool beam) {
+    for (auto &w : workers) {
+        w->set_beam(beam);
+    }
+}
+
+bool parallel_renderer::beam() const {
+    return workers[0]->beam();
+}
+
+void parallel_renderer::set_entry_cache(bool enabled) {
+    for (auto &w : workers) {
+        w->set_entry_cache(enabled);
+    }
+}
+
+bool parallel_renderer::entry_cache() const {
+    return workers[0]->entry_cache();
+}
+
+void parallel_renderer::render(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    scene_layer layer = {file->root, file->top, file->stream};
+    render(&layer, 1, surf, view, position, orientation);
+}
+
+void parallel_renderer::render(const scene &s, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    s.layers(position, layers);
+    render(layers.data(), layers.size(), surf, view, position, orientation);
+}
+
+void parallel_renderer::render(const octree_replicas &replicas, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    scene_layer layer = {replicas.root(), replicas.top(0), nullptr};
+    render(&layer, 1, surf, view, position, orientation, &replicas);
+}
+
+void parallel_renderer::render(const scene_layer * layers, uint32_t count, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, const octree_replicas * replicas) {
+    TRACE_ZONE("parallel_renderer::render");
+    tsc_timer t_total;
+    std::vector<render_stats> stats(pool->size());
+    
+    uint32_t tiles_x = (surf.width  + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (surf.height + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<int> order(tiles_x * tiles_y);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    if (entry_cache() && count == 1) {
+        // Keep only the caches of the tiles, which are added such that the threads do not modify the map.
+        // Each tile uses its own cache.
+        std::map<uint64_t, struct entry_cache> current;
+        std::vector<uint64_t> work(order.size());
+        for (uint32_t tile = 0; tile < order.size(); tile++) {
+            uint32_t x = tile % tiles_x * TILE_SIZE;
+            uint32_t y = tile / tiles_x * TILE_SIZE;
+            uint64_t key = rectangle_key(x, y, std::min(TILE_SIZE, surf.width - x), std::min(TILE_SIZE, surf.height - y));
+            auto c = caches->rectangles.find(key);
+            struct entry_cache &e = current[key];
+            if (c != caches->rectangles.end()) e = std::move(c->second);
+            work[tile] = e.work;
+        }
+        caches->rectangles.swap(current);
+        // Start the tiles that took the most work in the previous frame first, such that the work that remains
+        // at the end consists of small tiles, which are spread evenly over the threads. This does not change the image,
+        // hence it is also done while the camera moves, during which the amount of work per tile changes only gradually.
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return work[a] > work[b]; });
+    }
+    pool->run(tiles_x * tiles_y, [&](int job, int worker){
+        int tile = order[job];
+        uint32_t x = tile % tiles_x * TILE_SIZE;
+        uint32_t y = tile / tiles_x * TILE_SIZE;
+        uint32_t width  = std::min(TILE_SIZE, surf.width  - x);
+        uint32_t height = std::min(TILE_SIZE, surf.height - y);
+        // Compute the view pane of the tile.
+        view_pane tile_view;
+        tile_view.left   = view.left + (view.right  - view.left) * x / surf.width;
+        tile_view.right  = view.left + (view.right  - view.left) * (x + width) / surf.width;
+        tile_view.top    = view.top  + (view.bottom - view.top ) * y / surf.height;
+        tile_view.bottom = view.top  + (view.bottom - view.top ) * (y + height) / surf.height;
+        renderer &r = *workers[worker];
+        if (replicas) {
+            // Traverse the upper levels of the octree from the copy on the NUMA node of the thread.
+            scene_layer local = {replicas->root(), replicas->top(pool->node(worker)), nullptr};
+            r.render(&local, 1, surf, x, y, width, height, tile_view, position, orientation);
+        } else {
+            r.render(layers, count, surf, x, y, width, height, tile_view, position, orientation);
+        }
+        stats[worker] += r.stats();
+    });
+    
+    total = render_stats();
+    for (const render_stats &s : stats) {
+        total += s;
+    }
+    total.total = t_total.elapsed();
+}
+
+bool octree_draw_verbose = true;
+
+render_stats octree_draw(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    static renderer r;
+    r.render(file, surf, view, position, orientation);
+    const render_stats &s = r.stats();
+    if (octree_draw_verbose) {
+        std::printf("%7.2f | Prepare:%4.2f (saved %4.2f) Query:%7.2f | Count:%10lu Oct:%10lu Quad:%10lu | Culled:%10lu Occluded:%10lu | Pixels:%8lu Depth:%3u\n",
+            s.total, s.prepare, s.prepare_saved, s.query, s.count, s.count_oct, s.count_quad, s.culled_frustum, s.culled_occlusion, s.pixels, s.max_depth);
+    }
+    return s;
+}
+
+render_stats octree_draw_parallel(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, uint32_t detail, bool reuse) {
+    static parallel_renderer r;
+    r.set_detail(detail);
+    r.set_reuse(reuse);
+    r.render(file, surf, view, position, orientation);
+    const render_stats &s = r.stats();
+    if (octree_draw_verbose) {
+        std::printf("%7.2f | Tiles:%4u Threads:%3d Detail:%2u Reuse:%d | Count:%10lu Oct:%10lu Quad:%10lu | Culled:%10lu Occluded:%10lu | Pixels:%8lu Depth:%3u\n",
+            s.total, s.tiles, r.threads(), detail, reuse, s.count, s.count_oct, s.count_quad, s.culled_frustum, s.culled_occlusion, s.pixels, s.max_depth);
+    }
+    return s;
 }
 
 // kate: space-indent on; indent-width 4; mixedindent off; indent-mode cstyle; 
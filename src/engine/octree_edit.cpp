@@ -0,0 +1,362 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "octree_edit.h"
+#include "octree_compress.h"
+#include "numa.h"
+
+/** Marks a child that does not exist. It is neither a valid node index, nor a color. */
+static const uint32_t EMPTY = 0xfeffffffu;
+
+/** Size in bytes of the part of the memory range that contains the octree file. */
+static uint32_t region_start(const octree_file * base) {
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    return (base->size + page - 1) / page * page;
+}
+
+/** Reserves the memory range for the octree and the pool, and maps the octree file read-only at its start. */
+static octree * map_region(const octree_file * base, uint32_t capacity) {
+    uint64_t size = (uint64_t)region_start(base) + capacity;
+    if (size > 0xfffff000u) {fprintf(stderr, "Octree edit capacity of %u bytes is too large.\n", capacity); exit(2);}
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {perror("Could not reserve memory for octree edits"); exit(1);}
+    if (base->fd != -1) {
+        // The pages of the file stay in the page cache, which is shared with other mappings of the file.
+        if (mmap(data, base->size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, base->fd, 0) == MAP_FAILED) {
+            perror("Could not map octree file to memory for editing"); exit(1);
+        }
+    } else if (!base->decoder) {
+        memcpy(data, base->root, base->size);
+        if (mprotect(data, region_start(base), PROT_READ)) {perror("Could not protect octree memory"); exit(1);}
+    }
+    return (octree*)data;
+}
+
+octree_edit::octree_edit(const octree_file * base, uint32_t capacity)
+  : view(map_region(base, capacity), region_start(base) + capacity)
+  , pool_start(region_start(base) / sizeof(octree))
+  , pool_end(pool_start)
+  , pool_limit(view.size / sizeof(octree))
+  , fixed_top(0)
+{
+    view.top = base->top;
+    if (base->decoder) {
+        // The octree is decoded on demand, like that of the base.
+        view.decoder = new octree_decoder(*base->decoder);
+        view.decoder->map(view.root);
+    }
+    for (int i=0; i<9; i++) {
+        free_list[i] = 0;
+    }
+}
+
+/** Allocates a node of the given number of words in the pool. */
+uint32_t octree_edit::allocate(uint32_t words) {
+    assert(1 <= words && words <= 9);
+    uint32_t index = free_list[words-1];
+    if (index) {
+        free_list[words-1] = *(uint32_t*)&view.root[index];
+        return index;
+    }
+    return extend(words);
+}
+
+/** Allocates a node of the given number of words at the end of the pool. */
+uint32_t octree_edit::extend(uint32_t words) {
+    if (pool_limit - pool_end < words) {
+        fprintf(stderr, "Octree edits exceed their capacity of %lu bytes.\n", (pool_limit - pool_start) * sizeof(octree));
+        exit(1);
+    }
+    uint32_t index = pool_end;
+    pool_end += words;
+    return index;
+}
+
+/** Returns a node in the pool to the free list of its size. */
+void octree_edit::release(uint32_t index) {
+    assert(index >= pool_start);
+    uint32_t words = 1 + view.root[index].size();
+    *(uint32_t*)&view.root[index] = free_list[words-1];
+    free_list[words-1] = index;
+}
+
+/** Releases the nodes in the pool that are part of the subtree of a removed child. */
+void octree_edit::release_subtree(uint32_t child) {
+    if (child >= EMPTY || child < pool_start) return; // Colors, EMPTY and nodes of the file.
+    const octree &node = view.root[child];
+    for (uint32_t j=0; j<node.size(); j++) {
+        release_subtree(node.child[j]);
+    }
+    release(child);
+}
+
+/** Returns the index of a node that can be modified, which is a copy of the node if it is part of the file. */
+uint32_t octree_edit::own(uint32_t index) {
+    if (index >= pool_start) return index;
+    uint32_t words = 1 + view.root[index].size();
+    uint32_t copy = allocate(words);
+    memcpy(&view.root[copy], &view.root[index], words * sizeof(octree));
+    return copy;
+}
+
+/** Replaces the voxel at (x,y,z), which is depth levels below the given child, by value (a color or EMPTY).
+ * @return the new value of the child, which is EMPTY if it has no children left. */
+uint32_t octree_edit::replace(uint32_t child, uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t value) {
+    if (depth == 0) {
+        release_subtree(child);
+        return value;
+    }
+    if (child == value) return child; // The voxel is part of a leaf of the same color, or of an empty region.
+    uint32_t index;
+    if (child >= 0xff000000u) {
+        // Split the leaf into 8 leaves of the same color.
+        index = allocate(9);
+        view.root[index].bitmask = 0xff;
+        view.root[index].avgcolor = child & 0xffffff;
+        for (int j=0; j<8; j++) {
+            view.root[index].child[j] = child;
+        }
+    } else if (child == EMPTY) {
+        index = allocate(1);
+        view.root[index].bitmask = 0;
+    } else {
+        index = own(child);
+    }
+    int shift = depth - 1;
+    int i = ((x >> shift) & 1) << 2 | ((y >> shift) & 1) << 1 | ((z >> shift) & 1);
+    octree * node = &view.root[index];
+    uint32_t pos = node->position(i);
+    uint32_t old_child = node->has_index(i) ? node->child[pos] : EMPTY;
+    uint32_t new_child = replace(old_child, x, y, z, depth - 1, value);
+    node = &view.root[index];
+    if (node->has_index(i) != (new_child != EMPTY) && index == fixed_top) {
+        // The fixed root has room for all children, hence it is modified in place.
+        uint32_t n = node->size();
+        if (new_child == EMPTY) {
+            memmove(node->child + pos, node->child + pos + 1, (n - pos - 1) * sizeof(uint32_t));
+        } else {
+            memmove(node->child + pos + 1, node->child + pos, (n - pos) * sizeof(uint32_t));
+            node->child[pos] = new_child;
+        }
+        node->bitmask ^= 1 << i;
+    } else if (node->has_index(i) != (new_child != EMPTY)) {
+        // Move the node, as the length of its child array changes.
+        uint32_t n = node->size();
+        uint32_t moved = allocate(new_child == EMPTY ? n : n + 2);
+        octree * target = &view.root[moved];
+        target->bitmask = node->bitmask ^ (1 << i);
+        memcpy(target->child, node->child, pos * sizeof(uint32_t));
+        if (new_child == EMPTY) {
+            memcpy(target->child + pos, node->child + pos + 1, (n - pos - 1) * sizeof(uint32_t));
+        } else {
+            target->child[pos] = new_child;
+            memcpy(target->child + pos + 1, node->child + pos, (n - pos) * sizeof(uint32_t));
+        }
+        release(index);
+        index = moved;
+        node = target;
+    } else if (new_child != EMPTY) {
+        node->child[pos] = new_child;
+    }
+    uint32_t n = node->size();
+    if (n == 0 && index == fixed_top) {
+        node->avgcolor = 0;
+        return index;
+    } else if (n == 0) {
+        release(index);
+        return EMPTY;
+    }
+    uint32_t r = 0, g = 0, b = 0;
+    for (uint32_t j=0; j<n; j++) {
+        uint32_t c = node->is_pointer(j) ? view.root[node->child[j]].avgcolor : node->color(j);
+        r += (c >> 16) & 0xff;
+        g += (c >> 8) & 0xff;
+        b += c & 0xff;
+    }
+    node->avgcolor = (r + n/2) / n << 16 | (g + n/2) / n << 8 | (b + n/2) / n;
+    return index;
+}
+
+void octree_edit::set(uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t color) {
+    assert(0 < depth && depth < 32 && ((x | y | z) >> depth) == 0);
+    view.top = replace(view.top, x, y, z, depth, color | 0xff000000u);
+    update_paths();
+}
+
+bool octree_edit::remove(uint32_t x, uint32_t y, uint32_t z, int depth) {
+    assert(0 < depth && depth < 32 && ((x | y | z) >> depth) == 0);
+    if (!contains(x, y, z, depth)) return false;
+    view.top = replace(view.top, x, y, z, depth, EMPTY);
+    if (view.top == EMPTY) {
+        // The root is kept, even if it has no children.
+        view.top = allocate(1);
+        view.root[view.top].bitmask = 0;
+        view.root[view.top].avgcolor = 0;
+    }
+    update_paths();
+    return true;
+}
+
+bool octree_edit::recolor(uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t color) {
+    assert(0 < depth && depth < 32 && ((x | y | z) >> depth) == 0);
+    if (!contains(x, y, z, depth)) return false;
+    set(x, y, z, depth, color);
+    return true;
+}
+
+bool octree_edit::contains(uint32_t x, uint32_t y, uint32_t z, int depth) const {
+    assert(0 < depth && depth < 32 && ((x | y | z) >> depth) == 0);
+    uint32_t index = view.top;
+    for (int shift = depth - 1; shift >= 0; shift--) {
+        if (index >= 0xff000000u) return true; // Part of a larger leaf.
+        const octree &node = view.root[index];
+        int i = ((x >> shift) & 1) << 2 | ((y >> shift) & 1) << 1 | ((z >> shift) & 1);
+        if (!node.has_index(i)) return false;
+        index = node.child[node.position(i)];
+    }
+    return true;
+}
+
+/** Sets the average colors of the nodes of the paths added by place to that of the root, which is their only descendant. */
+void octree_edit::update_paths() {
+    for (uint32_t p : placed) {
+        view.root[p].avgcolor = view.root[view.top].avgcolor;
+    }
+}
+
+uint32_t octree_edit::place(uint32_t x, uint32_t y, uint32_t z, int depth) {
+    if (!fixed_top) {
+        // The paths refer to the root, hence it must no longer be copied or moved by the edits.
+        const octree &top = view.root[view.top];
+        fixed_top = allocate(9);
+        memcpy(&view.root[fixed_top], &top, (1 + top.size()) * sizeof(octree));
+        if (view.top >= pool_start) release(view.top);
+        view.top = fixed_top;
+    }
+    uint32_t index = view.top;
+    for (int shift = 0; shift < depth; shift++) {
+        int i = ((x >> shift) & 1) << 2 | ((y >> shift) & 1) << 1 | ((z >> shift) & 1);
+        uint32_t parent = allocate(2);
+        view.root[parent].bitmask = 1 << i;
+        view.root[parent].avgcolor = view.root[index].avgcolor;
+        view.root[parent].child[0] = index;
+        placed.push_back(parent);
+        index = parent;
+    }
+    return index;
+}
+
+uint32_t octree_edit::replicate(int levels, int node) {
+    // The copy starts at a page boundary, such that its pages only contain its own nodes.
+    uint32_t page = sysconf(_SC_PAGESIZE) / sizeof(octree);
+    pool_end = std::min((pool_end + page - 1) / page * page, pool_limit);
+    uint32_t begin = pool_end;
+    auto copy = [this](uint32_t index) {
+        const octree &node = view.root[index];
+        uint32_t words = 1 + node.size();
+        uint32_t c = extend(words);
+        memcpy(&view.root[c], &node, words * sizeof(octree));
+        return c;
+    };
+    // The nodes are copied level by level, where the children of the last level are shared with the octree.
+    uint32_t top = copy(view.top);
+    std::vector<uint32_t> level(1, top), next;
+    for (int l = 1; l < levels; l++) {
+        next.clear();
+        for (uint32_t index : level) {
+            octree &node = view.root[index];
+            for (uint32_t j=0; j<node.size(); j++) {
+                if (!node.is_pointer(j)) continue;
+                node.child[j] = copy(node.child[j]);
+                next.push_back(node.child[j]);
+            }
+        }
+        level.swap(next);
+    }
+    numa_bind(&view.root[begin], (pool_end - begin) * sizeof(octree), node);
+    return top;
+}
+
+uint32_t octree_edit::replica_size(const octree_file * base, int levels) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t words = 0;
+    std::vector<uint32_t> level(1, base->top), next;
+    for (int l = 0; l < levels && !level.empty(); l++) {
+        next.clear();
+        for (uint32_t index : level) {
+            const octree &node = base->root[index];
+            words += 1 + node.size();
+            for (uint32_t j=0; j<node.size(); j++) {
+                if (node.is_pointer(j)) next.push_back(node.child[j]);
+            }
+        }
+        level.swap(next);
+    }
+    // Plus a page for aligning its start.
+    return (words * sizeof(octree) + page - 1) / page * page + page;
+}
+
+void octree_edit::save(const char * filename) const {
+    // The nodes are copied in the order in which they are first encountered, hence the output is its own queue.
+    // Subtrees that are shared by multiple parents are copied once, hence the output is at most the size of the
+    // file and the pool. Both the output and the index of the copy of each node are mapped from files, such that
+    // their pages can be written back and evicted, rather than kept in memory.
+    std::string indexname = std::string(filename) + ".index.tmp";
+    octree_file index(indexname.c_str(), pool_end * sizeof(uint32_t));
+    if (unlink(indexname.c_str())) {perror("Could not unlink temporary index file"); exit(1);}
+    uint32_t * target = (uint32_t*)index.root;
+    octree_file file(filename, pool_end * sizeof(octree));
+    uint32_t * out = (uint32_t*)file.root;
+    const octree &top = view.root[view.top];
+    uint32_t size = 1 + top.size();
+    std::copy((const uint32_t*)&top, (const uint32_t*)&top + size, out);
+    for (uint32_t next = 0; next < size; ) {
+        octree &node = *(octree*)&out[next];
+        uint32_t n = node.size();
+        for (uint32_t j=0; j<n; j++) {
+            uint32_t child = out[next + 1 + j];
+            if (child >= 0xff000000u) continue;
+            if (!target[child]) {
+                const octree &c = view.root[child];
+                target[child] = size;
+                std::copy((const uint32_t*)&c, (const uint32_t*)&c + 1 + c.size(), out + size);
+                size += 1 + c.size();
+            }
+            out[next + 1 + j] = target[child];
+        }
+        next += 1 + n;
+    }
+    if (ftruncate(file.fd, size * sizeof(octree))) {perror("Could not truncate octree file"); exit(1);}
+}
+
+octree_replicas::octree_replicas(const octree_file * base, int levels)
+  : edit(base, numa_nodes() * octree_edit::replica_size(base, levels))
+{
+    for (int node = 0; node < numa_nodes(); node++) {
+        tops.push_back(edit.replicate(levels, node));
+    }
+}
@@ -0,0 +1,133 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_EDIT_H
+#define OCTREE_EDIT_H
+#include <stdint.h>
+#include <vector>
+#include "octree.h"
+
+/** An octree that can be modified, layered over an octree file.
+ *
+ * The octree file is mapped read-only at the start of a reserved range of memory, which is followed by a pool
+ * from which the nodes created by the edits are allocated. Both are addressed using the same node indices,
+ * hence the edited octree can be rendered like any other octree (see file()).
+ *
+ * The nodes of the file are never modified, as a subtree can be shared by multiple parents
+ * (e.g. the copies created by build_db's repeat argument). Instead, an edit copies the nodes on the path
+ * from the root to the voxel into the pool, unless they were copied before. Nodes in the pool have a single
+ * parent and are modified in place, or moved when their number of children changes. Hence the cost of an
+ * edit is proportional to the depth of the voxel, and the pages of the file remain shared with the other
+ * processes that map it. Octrees loaded from an .oc3 file are decoded on demand, like the base octree.
+ * Other octrees that are not backed by a file (e.g. loaded into huge pages) are copied instead.
+ *
+ * Voxels are the cubes at a given depth (1 to 31) below the root, addressed by coordinates ranging from 0 to 2^depth-1.
+ * Using the depth of the leaves of an octree created by build_db results in the coordinates of its pointset.
+ * Editing a voxel replaces the nodes below it, while a voxel that is part of a larger leaf is split off.
+ * The average colors of the nodes above the voxel are updated to the mean of the colors of their children,
+ * which unlike build_db does not weight the children by their number of leaves.
+ *
+ * The octree must not be rendered while it is being edited.
+ */
+class octree_edit {
+public:
+    /** Creates an editable copy of the given octree file, which does not need to outlive it.
+     * @param capacity the maximum size in bytes of the nodes created by the edits. */
+    octree_edit(const octree_file * base, uint32_t capacity = 256u<<20);
+
+    /** The edited octree, which can be rendered using the renderers. */
+    octree_file * file() { return &view; }
+    const octree_file * file() const { return &view; }
+
+    /** Sets the color of the voxel, which is added if it does not exist. */
+    void set(uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t color);
+    /** Removes the voxel. Returns false if it did not exist. */
+    bool remove(uint32_t x, uint32_t y, uint32_t z, int depth);
+    /** Changes the color of an existing voxel. Returns false if it does not exist. */
+    bool recolor(uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t color);
+    /** Checks whether the voxel exists. */
+    bool contains(uint32_t x, uint32_t y, uint32_t z, int depth) const;
+
+    /** Adds a path of nodes from a new root to the root of the octree, such that the octree is placed at the cube (x,y,z)
+     * at the given depth below the new root. This is used to place instances of the octree in a scene (see scene.h).
+     * The nodes of the path have a single child and are not reachable from the root of file().
+     * The first call moves the root into a node with room for all 8 children, which is then modified in place rather
+     * than moved, such that the paths show the octree after later edits.
+     * @return the index of the new root. */
+    uint32_t place(uint32_t x, uint32_t y, uint32_t z, int depth);
+
+    /** Copies the given number of upper levels of the octree into pages of the pool that are placed on the NUMA node
+     * (see numa.h). The copies refer to the nodes below them and, like the paths of place, are not reachable from the
+     * root of file(). They do not show later edits.
+     * @return the index of the root of the copy. */
+    uint32_t replicate(int levels, int node);
+    /** The capacity in bytes that replicate needs for a copy of the octree. */
+    static uint32_t replica_size(const octree_file * base, int levels);
+
+    /** Size in bytes of the nodes in the pool, including those that were freed. */
+    uint64_t used() const { return (pool_end - pool_start) * (uint64_t)sizeof(octree); }
+
+    /** Writes the edited octree to filename in .oc2 format, with its nodes in breadth first order.
+     * This uses a temporary file next to it, and memory only for caching the pages of both.
+     * The file must differ from that of the base octree. */
+    void save(const char * filename) const;
+
+private:
+    octree_file view;
+    uint32_t pool_start; ///< Index of the first node of the pool.
+    uint32_t pool_end;   ///< Index of the first unallocated word of the pool.
+    uint32_t pool_limit;
+    uint32_t free_list[9]; ///< The first free node of each size in words, or 0. Free nodes store the next one in their header.
+    uint32_t fixed_top; ///< The root once place was called, which has room for 8 children and is never moved, or 0.
+    std::vector<uint32_t> placed; ///< The nodes of the paths added by place, whose average color is that of the root.
+
+    uint32_t allocate(uint32_t words);
+    uint32_t extend(uint32_t words);
+    void release(uint32_t index);
+    void release_subtree(uint32_t child);
+    uint32_t own(uint32_t index);
+    uint32_t replace(uint32_t child, uint32_t x, uint32_t y, uint32_t z, int depth, uint32_t value);
+    void update_paths();
+
+    octree_edit(const octree_edit&);
+    octree_edit& operator=(const octree_edit&);
+};
+
+/** Copies of the upper levels of an octree, one per NUMA node, such that the threads of each node traverse
+ * these levels, which are visited by every tile, from local memory (see parallel_renderer). The nodes below
+ * them are shared. The copies are created by octree_edit::replicate, hence they share the node indices of the octree.
+ */
+class octree_replicas {
+public:
+    /** Copies the given number of levels of the octree for each NUMA node. */
+    octree_replicas(const octree_file * base, int levels = 6);
+
+    /** The memory that contains the octree and its copies, to which their node indices refer. */
+    octree * root() const { return edit.file()->root; }
+    /** The index of the root of the copy for the given NUMA node. */
+    uint32_t top(int node) const { return tops[node < (int)tops.size() ? node : 0]; }
+
+private:
+    octree_edit edit;
+    std::vector<uint32_t> tops;
+
+    octree_replicas(const octree_replicas&);
+    octree_replicas& operator=(const octree_replicas&);
+};
+
+#endif
@@ -18,27 +18,44 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
 #include "octree.h"
+#include "octree_compress.h"
+#include "huge_pages.h"
 
 #define static_assert(test, message) typedef char static_assert__##message[(test)?1:-1]
 static_assert(sizeof(octree)==4,octree_wrong_size);
 
-octree_file::octree_file(const char* filename) : write(false) {
+octree_file::octree_file(const char* filename) : write(false), top(0), stream(nullptr), huge(false), decoder(nullptr) {
   fd = open(filename, O_RDONLY);
   if (fd == -1) {perror("Could not open file"); exit(1);}
-  size = lseek(fd, 0, SEEK_END);
-  assert(size % sizeof(octree) == 0);
+  off_t file_size = lseek(fd, 0, SEEK_END);
+  if (file_size <= 0) {perror("Could not determine file size"); exit(1);}
   // It is unclear whether using MAP_PRIVATE or MAP_SHARED for mmap makes any difference.
-  root = (octree*)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
-  if (root == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  void * data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  if (data == MAP_FAILED) {perror("Could not map octree file to memory for reading"); exit(1);} 
+  if (octree_is_compressed(data, file_size)) {
+    // The octree is decoded when its chunks are accessed. The file itself is only used through its mapping.
+    close(fd);
+    fd = -1;
+    decoder = new octree_decoder(data, file_size);
+    size = decoder->size();
+    root = (octree*)mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (root == MAP_FAILED) {perror("Could not reserve memory for decoding octree"); exit(1);}
+    decoder->map(root);
+  } else {
+    size = file_size;
+    assert(size % sizeof(octree) == 0);
+    root = (octree*)data;
+  }
 }
 
-octree_file::octree_file(const char* filename, uint32_t size) : write(true), size(size) {
+octree_file::octree_file(const char* filename, uint32_t size) : write(true), size(size), top(0), stream(nullptr), huge(false), decoder(nullptr) {
   fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
   if (fd == -1) {perror("Could not open/creat file"); exit(1);}
   int ret = ftruncate(fd, size);
@@ -49,8 +66,31 @@ octree_file::octree_file(const char* filename, uint32_t size) : write(true), siz
   if (root == MAP_FAILED) {perror("Could not map octree file to memory for writing"); exit(1);} 
 }
 
+octree_file::octree_file(octree* root, uint32_t size) : write(true), size(size), fd(-1), root(root), top(0), stream(nullptr), huge(false), decoder(nullptr) {
+  assert(size % sizeof(octree) == 0);
+}
+
+void octree_file::load_huge_pages() {
+  assert(!write && !stream);
+  if (huge) return;
+  octree * copy = (octree*)huge_page_alloc(size);
+  memcpy(copy, root, size);
+  delete decoder;
+  decoder = nullptr;
+  munmap(root, size);
+  root = copy;
+  huge = true;
+  if (fd!=-1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
 octree_file::~octree_file() {
-  if (root!=MAP_FAILED)
+  delete decoder;
+  if (huge)
+    huge_page_free(root, size);
+  else if (root!=MAP_FAILED)
     munmap(root, size);
   if (fd!=-1)
     close(fd);
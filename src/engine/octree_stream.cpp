@@ -0,0 +1,198 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "octree_stream.h"
+#include "octree_compress.h"
+#include "trace.h"
+
+static const int32_t SCENE_DEPTH = 26;
+
+octree_stream::octree_stream(octree_file * file, uint64_t memory_budget, double detail, uint32_t chunk_size)
+  : file(file)
+  , chunk_size(chunk_size)
+  , shift(0)
+  , chunks((file->size + chunk_size - 1) / chunk_size)
+  , budget(std::max<uint64_t>(memory_budget / chunk_size, 1))
+  , detail(detail)
+  , last_use(new std::atomic<uint32_t>[chunks])
+  , is_resident(chunks)
+  , resident_chunks(0)
+  , prefetch_count(0)
+  , evict_count(0)
+  , frame(0)
+  , stop(false)
+  , lru_next(0)
+  , current(0)
+{
+    assert((chunk_size & (chunk_size - 1)) == 0);
+    assert(chunk_size % sysconf(_SC_PAGESIZE) == 0);
+    while ((sizeof(octree) << shift) < chunk_size) shift++;
+    for (uint32_t i=0; i<chunks; i++) {
+        last_use[i] = 0;
+    }
+    // Octrees that are neither backed by a file nor decoded on demand cannot be evicted.
+    if (file->fd == -1 && !file->decoder) return;
+    file->stream = this;
+    worker = std::thread(&octree_stream::main, this);
+}
+
+octree_stream::~octree_stream() {
+    if (!worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+    file->stream = nullptr;
+}
+
+void octree_stream::update(view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    if (!worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        this->view = view;
+        this->position = position;
+        this->orientation = orientation;
+        frame++;
+    }
+    wake.notify_all();
+}
+
+void octree_stream::main() {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            wake.wait(l, [this]{ return stop || frame != current; });
+            if (stop) return;
+            current = frame;
+            current_view = view;
+            current_position = position;
+            current_orientation = orientation;
+        }
+        TRACE_ZONE("octree_stream::prefetch");
+        collect_used();
+        planes[0] = glm::normalize(glm::dvec3( 1, 0, -current_view.left));
+        planes[1] = glm::normalize(glm::dvec3(-1, 0,  current_view.right));
+        planes[2] = glm::normalize(glm::dvec3( 0,-1,  current_view.top));
+        planes[3] = glm::normalize(glm::dvec3( 0, 1, -current_view.bottom));
+        planes[4] = glm::dvec3(0, 0, 1);
+        walk(file->top, glm::dvec3(0), 1<<SCENE_DEPTH);
+        while (resident_chunks > budget && make_room()) {}
+    }
+}
+
+/** Registers the chunks that were loaded because they were used and creates the list of eviction candidates. */
+void octree_stream::collect_used() {
+    lru.clear();
+    lru_next = 0;
+    for (uint32_t i=0; i<chunks; i++) {
+        uint32_t used = last_use[i];
+        if (used && !is_resident[i]) {
+            is_resident[i] = true;
+            resident_chunks++;
+        }
+        // Chunks used by the last frame, or prefetched for the current frame, are not evicted.
+        if (is_resident[i] && used + 1 < current) {
+            lru.push_back(std::make_pair(used, i));
+        }
+    }
+    std::sort(lru.begin(), lru.end());
+}
+
+/** Evicts the least recently used chunk. Returns false if there is no chunk that can be evicted. */
+bool octree_stream::make_room() {
+    while (lru_next < lru.size()) {
+        uint32_t chunk = lru[lru_next++].second;
+        if (is_resident[chunk] && last_use[chunk] + 1 < current) {
+            evict(chunk);
+            return true;
+        }
+    }
+    return false;
+}
+
+void octree_stream::evict(uint32_t chunk) {
+    uint64_t offset = chunk * (uint64_t)chunk_size;
+    uint64_t length = std::min<uint64_t>(chunk_size, file->size - offset);
+    if (file->decoder) {
+        file->decoder->evict(offset, length);
+    } else {
+        // The mapping is read-only, hence the pages are reloaded from the file when they are used again.
+        if (madvise((char*)file->root + offset, length, MADV_DONTNEED)) {perror("Could not evict octree chunk"); exit(1);}
+        posix_fadvise(file->fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+    is_resident[chunk] = false;
+    last_use[chunk] = 0;
+    resident_chunks--;
+    evict_count++;
+}
+
+/** Starts loading the chunk in the background. Returns false if that would exceed the budget. */
+bool octree_stream::prefetch(uint32_t chunk) {
+    if (is_resident[chunk]) {
+        last_use[chunk] = current;
+        return true;
+    }
+    if (resident_chunks >= budget && !make_room()) return false;
+    uint64_t offset = chunk * (uint64_t)chunk_size;
+    uint64_t length = std::min<uint64_t>(chunk_size, file->size - offset);
+    madvise((char*)file->root + offset, length, MADV_WILLNEED);
+    is_resident[chunk] = true;
+    last_use[chunk] = current;
+    resident_chunks++;
+    prefetch_count++;
+    return true;
+}
+
+/** Prefetches the visible part of the subtree at the given index, whose cube has the given center and half size.
+ * Returns false if the walk must be aborted, because the budget is exhausted or a new frame has started. */
+bool octree_stream::walk(uint32_t index, glm::dvec3 center, double size) {
+    if (frame != current) return false;
+    glm::dvec3 p = current_orientation * (center - current_position);
+    double radius = size * std::sqrt(3.0);
+    for (int i=0; i<5; i++) {
+        if (glm::dot(planes[i], p) < -radius) return true; // outside the view frustum
+    }
+    if (!prefetch(index >> shift)) return false;
+    const octree & node = file->root[index]; // Blocks until the chunk is loaded.
+    if (((index + node.size()) >> shift) != (index >> shift) && !prefetch((index + node.size()) >> shift)) return false;
+    double distance = glm::length(p);
+    if (distance > radius && 2*size < detail * distance) return true;
+    // Visit the children in front to back order.
+    glm::dvec3 d = current_position - center;
+    int nearest = (d.x > 0 ? 4 : 0) | (d.y > 0 ? 2 : 0) | (d.z > 0 ? 1 : 0);
+    for (int k=0; k<8; k++) {
+        int i = nearest ^ k;
+        if (!node.has_index(i)) continue;
+        int j = node.position(i);
+        if (!node.is_pointer(j)) continue;
+        glm::dvec3 offset(i&4 ? 1 : -1, i&2 ? 1 : -1, i&1 ? 1 : -1);
+        if (!walk(node.child[j], center + offset * (size/2), size/2)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,119 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OCTREE_STREAM_H
+#define OCTREE_STREAM_H
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "octree.h"
+
+/** Controls which parts of a memory mapped octree file are resident in memory.
+ *
+ * The file is divided into chunks. The renderers mark the chunks containing the nodes
+ * they visit with the current frame number. For each frame a background thread:
+ *  - prefetches the chunks containing the nodes that are predicted to be visible, by walking
+ *    the octree in front to back order, skipping nodes outside the view frustum and not
+ *    descending into nodes that are smaller than the given level of detail;
+ *  - evicts the least recently used chunks, such that the resident memory stays within budget.
+ *    Chunks used by the last rendered frame are never evicted.
+ *
+ * The residency is tracked approximately: chunks are assumed to be resident from the moment
+ * they are prefetched or used until they are evicted.
+ * Octrees loaded from an .oc3 file are decoded again when an evicted chunk is used (see octree_decoder).
+ * Other octrees that are not backed by a file (e.g. loaded into huge pages) are always resident,
+ * for these the stream does nothing.
+ */
+class octree_stream {
+public:
+    /** Starts managing the residency of the given octree file, which must outlive the stream.
+     * @param memory_budget the maximum amount of resident memory in bytes.
+     * @param detail projected size (in view pane units) below which the prefetcher stops descending.
+     * @param chunk_size the size in bytes of the units that are loaded and evicted; must be a power of 2 multiple of the page size.
+     */
+    octree_stream(octree_file * file, uint64_t memory_budget, double detail = 1.0/64, uint32_t chunk_size = 1<<20);
+    ~octree_stream();
+
+    /** Announces that the next frame will be rendered from the given camera,
+     * which (asynchronously) prefetches the chunks for that frame and evicts chunks if necessary. */
+    void update(view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Marks the chunk containing the node at the given index as used. Called by the renderers.
+     * Only stores if the chunk was not yet marked this frame, such that the workers merely share the cache lines for reading. */
+    void touch(uint32_t index) {
+        std::atomic<uint32_t> &c = last_use[index >> shift];
+        uint32_t f = frame.load(std::memory_order_relaxed);
+        if (c.load(std::memory_order_relaxed) != f) c.store(f, std::memory_order_relaxed);
+    }
+
+    /** Estimated amount of resident memory in bytes. */
+    uint64_t resident() const { return resident_chunks * (uint64_t)chunk_size; }
+    /** Number of chunks prefetched and evicted since creation. */
+    uint64_t prefetched() const { return prefetch_count; }
+    uint64_t evicted() const { return evict_count; }
+
+private:
+    octree_file * file;
+    uint32_t chunk_size;
+    uint32_t shift;  ///< log2 of the number of nodes per chunk.
+    uint32_t chunks;
+    uint32_t budget; ///< Maximum number of resident chunks.
+    double detail;
+
+    std::unique_ptr<std::atomic<uint32_t>[]> last_use; ///< Last frame in which each chunk was used, 0 if not resident.
+    std::vector<bool> is_resident; ///< Only accessed by the background thread.
+    std::atomic<uint32_t> resident_chunks;
+    std::atomic<uint64_t> prefetch_count, evict_count;
+
+    // Request for the background thread, protected by lock.
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<uint32_t> frame; ///< The frame that is being rendered, also read by touch.
+    bool stop;
+    view_pane view;
+    glm::dvec3 position;
+    glm::dmat3 orientation;
+    std::thread worker;
+
+    // State of the background thread.
+    std::vector<std::pair<uint32_t, uint32_t>> lru; ///< Last use and index of the resident chunks that can be evicted, oldest first.
+    uint32_t lru_next;
+    uint32_t current; ///< The frame being prefetched for.
+    view_pane current_view;
+    glm::dvec3 current_position;
+    glm::dmat3 current_orientation;
+    glm::dvec3 planes[5]; ///< Inward facing normals of the view frustum, in camera space.
+
+    void main();
+    void collect_used();
+    bool make_room();
+    void evict(uint32_t chunk);
+    bool prefetch(uint32_t chunk);
+    bool walk(uint32_t index, glm::dvec3 center, double size);
+
+    octree_stream(const octree_stream&);
+    octree_stream& operator=(const octree_stream&);
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "point_parser.h"
+#include "thread_pool.h"
+
+/** Size in bytes of the text that is parsed by a single job. */
+static const uint64_t CHUNK_SIZE = 4<<20;
+
+/** The points parsed from a chunk of lines. */
+struct parsed_chunk {
+    std::vector<point> points;
+    uint64_t skipped; ///< Number of lines that are not blank, but do not contain a point.
+};
+
+/** Parses the lines in [begin, end), which ends with a line break unless it is the end of the file. */
+static void parse_chunk(const char * begin, const char * end, int worker, const line_parser &parse, parsed_chunk &out) {
+    out.points.clear();
+    out.skipped = 0;
+    point p;
+    while (begin < end) {
+        const char * eol = (const char*)memchr(begin, '\n', end - begin);
+        if (!eol) eol = end;
+        const char * last = eol;
+        if (last > begin && last[-1] == '\r') last--;
+        if (parse(begin, last, worker, p)) {
+            out.points.push_back(p);
+        } else {
+            skip_blanks(begin, last);
+            if (begin < last) out.skipped++;
+        }
+        begin = eol + 1;
+    }
+}
+
+/** Parses the lines and passes their points to add, either on a separate thread while the next batch is parsed, or synchronously. */
+static uint64_t parse_lines(const char * filename, int skip, thread_pool &pool, const line_parser &parse, bool synchronous, const point_sink &add) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {perror("Could not open file"); exit(1);}
+    uint64_t size = lseek(fd, 0, SEEK_END);
+    const char * data = "";
+    if (size > 0) {
+        data = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {perror("Could not map file to memory"); exit(1);}
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+    const char * pos = data;
+    const char * end = data + size;
+    for (int i=0; i<skip && pos < end; i++) {
+        const char * eol = (const char*)memchr(pos, '\n', end - pos);
+        pos = eol ? eol + 1 : end;
+    }
+
+    // Two batches of chunks, such that one is written while the other is parsed.
+    int n = pool.size() * 2;
+    std::vector<parsed_chunk> batch[2];
+    batch[0].resize(n);
+    batch[1].resize(n);
+    std::vector<const char*> bounds(n + 1);
+    std::thread writer;
+    uint64_t points = 0, skipped = 0, reported = 0;
+    for (int current = 0; pos < end; current ^= 1) {
+        // Split the next part of the file at line breaks.
+        int chunks = 0;
+        bounds[0] = pos;
+        while (chunks < n && pos < end) {
+            const char * limit = pos + std::min<uint64_t>(CHUNK_SIZE, end - pos);
+            const char * eol = (const char*)memchr(limit - 1, '\n', end - (limit - 1));
+            pos = eol ? eol + 1 : end;
+            bounds[++chunks] = pos;
+        }
+        std::vector<parsed_chunk> &b = batch[current];
+        pool.run(chunks, [&](int i, int worker) {
+            parse_chunk(bounds[i], bounds[i+1], worker, parse, b[i]);
+        });
+        for (int i=0; i<chunks; i++) {
+            points += b[i].points.size();
+            skipped += b[i].skipped;
+        }
+        if (synchronous) {
+            for (int i=0; i<chunks; i++) {
+                add(b[i].points.data(), b[i].points.size());
+            }
+        } else {
+            if (writer.joinable()) writer.join();
+            std::vector<parsed_chunk> * w = &b;
+            writer = std::thread([&add, w, chunks]() {
+                for (int i=0; i<chunks; i++) {
+                    add((*w)[i].points.data(), (*w)[i].points.size());
+                }
+            });
+        }
+        if (points >> 20 > reported) {
+            reported = points >> 20;
+            fprintf(stderr, "points: %3luMi\n", reported);
+        }
+    }
+    if (writer.joinable()) writer.join();
+    if (skipped) fprintf(stderr, "Skipped %lu lines that do not contain a point.\n", skipped);
+
+    if (size > 0) munmap((void*)data, size);
+    close(fd);
+    return points;
+}
+
+uint64_t parse_points(const char * filename, int skip, pointfile &out, thread_pool &pool, const line_parser &parse) {
+    return parse_lines(filename, skip, pool, parse, false, [&out](const point * points, uint64_t count) {
+        out.add(points, count);
+    });
+}
+
+uint64_t parse_points(const char * filename, int skip, thread_pool &pool, const line_parser &parse, const point_sink &add) {
+    return parse_lines(filename, skip, pool, parse, true, add);
+}
@@ -0,0 +1,138 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef POINT_PARSER_H
+#define POINT_PARSER_H
+#include <stdint.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include "pointset.h"
+
+class thread_pool;
+
+/* Conversion of text files that contain a point per line into pointfiles, as used by convert, convert2 and ascii2bin.
+ *
+ * The text file is mapped into memory and split into chunks of lines, which are parsed in parallel.
+ * The points of a batch of chunks are written in order by a separate thread, while the next batch is parsed,
+ * hence the pointfile contains the points in the order of their lines.
+ *
+ * The number parsers below replace scanf. Like its conversions, they skip leading spaces and tabs,
+ * and advance the position until after the number. They return false if there is no number.
+ */
+
+/** Parses the line [begin, end), without its line break, and stores the point in p.
+ * Returns false if the line does not contain a point, in which case it is skipped.
+ * It is called concurrently by the workers of the thread pool, where worker can be used to access per-worker data. */
+typedef std::function<bool(const char * begin, const char * end, int worker, point &p)> line_parser;
+
+/** Parses the lines of the text file, except for the first skip lines, and adds their points to out.
+ * Prints the progress and the number of lines that were skipped to stderr.
+ * @return the number of points. */
+uint64_t parse_points(const char * filename, int skip, pointfile &out, thread_pool &pool, const line_parser &parse);
+
+/** Receives consecutive points, in the order of their lines. */
+typedef std::function<void(const point * points, uint64_t count)> point_sink;
+
+/** Parses the lines like the above, but passes their points to add on the calling thread, after each batch of chunks
+ * is parsed and before the next one is, such that add can use the thread pool. */
+uint64_t parse_points(const char * filename, int skip, thread_pool &pool, const line_parser &parse, const point_sink &add);
+
+static inline void skip_blanks(const char *&s, const char * end) {
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+}
+
+/** Matches the character c, which, like a literal in a scanf format, is not preceded by blanks. */
+static inline bool parse_char(const char *&s, const char * end, char c) {
+    if (s == end || *s != c) return false;
+    s++;
+    return true;
+}
+
+static inline bool parse_uint(const char *&s, const char * end, uint32_t &v) {
+    skip_blanks(s, end);
+    if (s == end || (unsigned)(*s - '0') > 9) return false;
+    uint32_t r = 0;
+    while (s < end && (unsigned)(*s - '0') <= 9) r = r * 10 + (*s++ - '0');
+    v = r;
+    return true;
+}
+
+static inline bool parse_int(const char *&s, const char * end, int32_t &v) {
+    skip_blanks(s, end);
+    bool negative = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+    uint32_t r;
+    if (!parse_uint(s, end, r)) return false;
+    v = negative ? -r : r;
+    return true;
+}
+
+static inline bool parse_hex(const char *&s, const char * end, uint32_t &v) {
+    skip_blanks(s, end);
+    if (end - s > 2 && s[0] == '0' && (s[1] | 0x20) == 'x' && isxdigit(s[2])) s += 2;
+    uint32_t r = 0;
+    const char * start = s;
+    for (; s < end; s++) {
+        unsigned d = *s - '0';
+        unsigned h = (*s | 0x20) - 'a';
+        if (d <= 9) r = r << 4 | d;
+        else if (h <= 5) r = r << 4 | (h + 10);
+        else break;
+    }
+    v = r;
+    return s != start;
+}
+
+/** Parses a decimal floating point number. The result is equal to that of strtod, as numbers that
+ * cannot be converted exactly using a single division, such as those with more than 19 digits or
+ * an exponent, are passed to strtod. */
+static inline bool parse_double(const char *&s, const char * end, double &v) {
+    static const double POW10[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+    skip_blanks(s, end);
+    const char * start = s;
+    bool negative = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+    uint64_t m = 0;
+    int digits = 0, decimals = 0;
+    for (; s < end && (unsigned)(*s - '0') <= 9; s++, digits++) m = m * 10 + (*s - '0');
+    if (s < end && *s == '.') {
+        for (s++; s < end && (unsigned)(*s - '0') <= 9; s++, digits++, decimals++) m = m * 10 + (*s - '0');
+    }
+    if (digits == 0) {
+        s = start;
+        return false;
+    }
+    if (digits > 19 || m >= (1ull<<53) || decimals > 22 || (s < end && (*s | 0x20) == 'e')) {
+        char buffer[64];
+        size_t n = std::min<size_t>(end - start, sizeof(buffer) - 1);
+        memcpy(buffer, start, n);
+        buffer[n] = 0;
+        char * e;
+        v = strtod(buffer, &e);
+        s = start + (e - buffer);
+        return true;
+    }
+    double r = (double)m / POW10[decimals];
+    v = negative ? -r : r;
+    return true;
+}
+
+#endif
@@ -74,12 +74,20 @@ pointfile::pointfile(const char* filename) {
     cnt = 0;
 }
 
-pointfile::~pointfile() {
-    ssize_t r = write(fd, buffer, cnt * sizeof(point));
-    if (r!=cnt * (ssize_t)sizeof(point)) {
-        perror("Error while writing to pointfile"); exit(1);
+/** Writes all bytes, as a single write call may write less than requested. */
+static void write_all(int fd, const void * data, uint64_t bytes) {
+    const char * p = (const char*)data;
+    while (bytes > 0) {
+        ssize_t r = write(fd, p, bytes);
+        if (r <= 0) {perror("Error while writing to pointfile"); exit(1);}
+        p += r;
+        bytes -= r;
     }
-    free(buffer);
+}
+
+pointfile::~pointfile() {
+    write_all(fd, buffer, cnt * sizeof(point));
+    delete[] buffer;
     if (fd!=-1)
         close(fd);
 }
@@ -88,10 +96,13 @@ void pointfile::add(const point& p) {
     buffer[cnt] = p;
     cnt++;
     if (cnt >= point_buffer_size) {
-        ssize_t r = write(fd, buffer, point_buffer_size * sizeof(point));
-        if (r!=point_buffer_size * (ssize_t)sizeof(point)) {
-            perror("Error while writing to pointfile"); exit(1);
-        }
+        write_all(fd, buffer, point_buffer_size * sizeof(point));
         cnt = 0;
     }
 }
+
+void pointfile::add(const point * p, uint64_t count) {
+    write_all(fd, buffer, cnt * sizeof(point));
+    cnt = 0;
+    write_all(fd, p, count * sizeof(point));
+}
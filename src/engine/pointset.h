@@ -34,8 +34,8 @@ struct point {
  */
 struct pointset {
     bool write;
-    uint32_t size; /// Number of bytes in the pointfile.
-    uint32_t length; /// Number of points in the pointfile.
+    uint64_t size; /// Number of bytes in the pointfile.
+    uint64_t length; /// Number of points in the pointfile.
     int32_t fd;
     point * list;
     pointset(const char* filename, bool write=false);
@@ -53,6 +53,8 @@ struct pointfile {
     pointfile(const char* filename);
     ~pointfile();
     void add(const point &p);
+    /** Adds count points, which are written directly rather than copied into the buffer. */
+    void add(const point * p, uint64_t count);
 };
 
 #endif
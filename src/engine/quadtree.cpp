@@ -17,47 +17,87 @@
 */
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include "quadtree.h"
-
-static const uint32_t B[] = {0x00FF00FF, 0x0F0F0F0F, 0x33333333, 0x55555555};
-static const uint32_t S[] = {8, 4, 2, 1};
+#include "spatial_key.h"
+#include "trace.h"
 
 void quadtree::set(uint32_t x, uint32_t y) {
-    for (int i=0; i<4; i++) {
-        x = (x | (x << S[i])) & B[i];
-        y = (y | (y << S[i])) & B[i];
-    }
-    uint32_t v = N + (x | (y<<1));
+    uint32_t v = N + morton2d(x, y);
     children[v/4] &= ~(16<<(v&3));
 }
 
 void quadtree::draw(uint32_t v, uint32_t color, uint32_t depth) {
     // Uses 5-10 ms per frame.
     // children[v/4] &= ~(16<<(v&3)); // Moved to octree_draw.
-    v -= N;
-    uint32_t x = v;
-    uint32_t y = v>>1;
-    for (int i=3; i>=0; i--) {
-        x &= B[i];
-        y &= B[i];
-        x = (x | (x >> S[i]));
-        y = (y | (y >> S[i]));
-    }
-    x &= 0xffff;
-    y &= 0xffff;
+    uint32_t x, y;
+    morton2d_decode(v - N, x, y);
 
-    assert(x<surf.width && y<surf.height);
-    int64_t i = x+y*surf.width;
+    assert(x<width && y<height);
+    int64_t i = offset+x+y*surf.width;
     surf.data[i] = color;
     if (surf.depth) {
         surf.depth[i] = depth;
     }
 }
 
-quadtree::quadtree() {}
-quadtree::quadtree(surface surf) : surf(surf) {
-    memset(children, 0, sizeof(children));
+uint32_t quadtree::fill(uint32_t v, uint32_t color, uint32_t depth) {
+    if (v >= (uint32_t)N) {
+        draw(v, color, depth);
+        return 1;
+    }
+    uint32_t mask = children[v];
+    uint32_t pixels = 0;
+    children[v] = 0;
+    for (int i=4; i<8; i++) {
+        if (mask & (1<<i)) {
+            pixels += fill(v*4+i, color, depth);
+        }
+    }
+    return pixels;
+}
+
+quadtree::quadtree() : offset(0), width(0), height(0), cache_next(0) {
+    resize(1);
+}
+
+quadtree::quadtree(surface surf) : surf(surf), offset(0), width(surf.width), height(surf.height), cache_next(0) {
+    resize(required_dim(width, height));
+    memset(children, 0, N*sizeof(uint32_t));
+}
+
+uint32_t quadtree::required_dim(uint32_t width, uint32_t height) {
+    // The root node has a mask for its 4 children, hence at least 1 level is required.
+    uint32_t dim = 1;
+    while (dim <= MAX_DIM && ((1u<<dim) < width || (1u<<dim) < height)) dim++;
+    if (dim > MAX_DIM) {
+        fprintf(stderr, "Cannot render a viewport of %ux%u pixels, which exceeds %ux%u.\n", width, height, 1u<<MAX_DIM, 1u<<MAX_DIM);
+        exit(2);
+    }
+    return dim;
+}
+
+void quadtree::resize(uint32_t dim) {
+    assert(1 <= dim && dim <= MAX_DIM);
+    this->dim = dim;
+    SIZE = 1<<dim;
+    N = ((uint64_t)1<<(2*dim))/3-1;
+    M = N/4-1;
+    nodes.resize(N+1);
+    children = nodes.data()+1;
+}
+
+void quadtree::set_viewport(surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    assert(x+width <= surf.width && y+height <= surf.height);
+    this->surf = surf;
+    this->offset = x+y*(int64_t)surf.width;
+    this->width = width;
+    this->height = height;
+    uint32_t new_dim = required_dim(width, height);
+    if (new_dim != dim) resize(new_dim);
 }
 
 void quadtree::build_fill(int i) {
@@ -94,13 +134,67 @@ bool quadtree::build_check(int w, int h, int i, int size) {
     return true;
 }
 
-void quadtree::build() {
-    build_check(surf.width, surf.height, -1, SIZE);
+double quadtree::build() {
+    TRACE_ZONE("quadtree::build");
+    for (pristine &p : cache) {
+        if (p.width == width && p.height == height) {
+            assert(p.nodes.size() == nodes.size());
+            tsc_timer t;
+            if (p.copy_time < p.build_time) {
+                std::copy(p.nodes.begin(), p.nodes.end(), nodes.begin());
+                p.copy_time = t.elapsed();
+                return std::max(0.0, p.build_time - p.copy_time);
+            } else {
+                // For large quadtrees that are not in cache, copying can be slower than building.
+                build_check(width, height, -1, SIZE);
+                p.build_time = t.elapsed();
+                return 0;
+            }
+        }
+    }
+    tsc_timer t;
+    build_check(width, height, -1, SIZE);
+    double build_time = t.elapsed();
+    // Store the result, replacing the oldest cache entry if the cache is full.
+    if (cache.size() < PRISTINE_CACHE_SIZE) {
+        cache.push_back(pristine());
+    }
+    pristine &p = cache[cache_next];
+    cache_next = (cache_next + 1) % PRISTINE_CACHE_SIZE;
+    p.width = width;
+    p.height = height;
+    p.build_time = build_time;
+    p.copy_time = 0;
+    p.nodes.assign(nodes.begin(), nodes.end());
+    return 0;
+}
+
+/** Clears the bits of the children of node i, which covers the size * size pixels at (x,y), that are already drawn.
+ * @return true if some of its pixels are not yet drawn. */
+bool quadtree::reuse_check(int i, uint32_t x, uint32_t y, uint32_t size) {
+    uint32_t mask = children[i];
+    size /= 2;
+    for (int k=4; k<8; k++) {
+        if (!(mask & (1<<k))) continue;
+        int c = i*4+k;
+        uint32_t cx = x + (k&1 ? size : 0);
+        uint32_t cy = y + (k&2 ? size : 0);
+        if (c >= N) {
+            if (surf.depth[offset+cx+cy*surf.width] != ~0u) mask &= ~(1<<k);
+        } else {
+            if (!reuse_check(c, cx, cy, size)) mask &= ~(1<<k);
+        }
+    }
+    children[i] = mask;
+    return mask != 0;
+}
+
+void quadtree::reuse() {
+    assert(surf.depth);
+    reuse_check(-1, 0, 0, SIZE);
 }
 
-const unsigned int quadtree::dim;
-const unsigned int quadtree::SIZE;
-const int quadtree::N;
-const int quadtree::M;
+const uint32_t quadtree::MAX_DIM;
+const uint32_t quadtree::PRISTINE_CACHE_SIZE;
 
     
\ No newline at end of file
@@ -19,47 +19,104 @@
 #ifndef VOXEL_QUADTREE_H
 #define VOXEL_QUADTREE_H
 #include <stdint.h>
+#include <vector>
+#include "huge_pages.h"
 #include "surface.h"
 
 struct quadtree {
 public:
+    /** The maximum number of levels in the quadtree, which covers at most 32768x32768 pixels. 
+     * Limited by the node indices, which are stored as int and reach 4^(dim+1)/3. */
+    static const uint32_t MAX_DIM = 15;
+
     /** The number of levels in the quadtree.
-     * This should be the lowest number such that width and height are at most (1<<dim). 
+     * This is the lowest number such that width and height are at most (1<<dim). 
      */
-    static const uint32_t dim = 10;
-    static const uint32_t SIZE = 1<<dim;
-    static const int N = (1<<dim<<dim)/3-1;
-    static const int M = N/4-1;
+    uint32_t dim;
+    uint32_t SIZE;
+    int N;
+    int M;
     
     surface surf;
-
-    /** children[-1] */
-    uint32_t rootnode;
     
+    /** The part of surf that is rendered to. 
+     * Its top-left pixel is surf.data[offset] and it has a size of width * height pixels. */
+    int64_t offset;
+    uint32_t width;
+    uint32_t height;
+
     /** 
      * The quadtree is stored in a heap-like fashion as a single array.
      * The child nodes of map[i] are map[4*i+4], ..., map[4*i+7].
+     * The rootnode is stored at children[-1].
      */
-    uint32_t children[N];
+    uint32_t * children;
 
     /** Creates a new quadtree, to be used for rendering to the width * height * 32bit image buffer in pixels. 
      * It is assumed that the second row of pixels starts at pixels[width]. */
     quadtree();
     quadtree(surface surf);
 
+    /** Returns the number of levels required for a quadtree covering width * height pixels.
+     * Exits with an error if this exceeds MAX_DIM. */
+    static uint32_t required_dim(uint32_t width, uint32_t height);
+
+    /** Restricts rendering to the width * height rectangle of surf whose top-left corner is at (x,y). 
+     * Resizes the quadtree to the number of levels required for this rectangle. */
+    void set_viewport(surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
     /** Draws the pixel associated with the given leafnode. */
     void draw(uint32_t v, uint32_t color, uint32_t depth);
+
+    /** Draws all pixels below the given node that are not yet rendered and marks them as rendered.
+     * @return the number of pixels drawn. */
+    uint32_t fill(uint32_t v, uint32_t color, uint32_t depth);
     
-    /** Initializes the quadtree such that all quadtree nodes within view are set to 1. */    
-    void build();
+    /** Initializes the quadtree such that all quadtree nodes within view are set to 1. 
+     * The result only depends on the size of the viewport. Hence it is cached and,
+     * for viewport sizes that were seen before, restored with a single bulk copy,
+     * unless restoring turned out to be slower than building.
+     * @return the time in milliseconds saved by restoring from the cache, or 0 if the quadtree was built. */    
+    double build();
+
+    /** Marks the pixels of the viewport that are already drawn as rendered, such that they are not drawn again.
+     * These are the pixels whose depth differs from the ~0u written by surface::clear.
+     * Must be called after build() and requires a surface with a depth buffer. */
+    void reuse();
     
 private:
+    /** A copy of a freshly built quadtree for a given viewport size. */
+    struct pristine {
+        uint32_t width;
+        uint32_t height;
+        double build_time; //< Time in milliseconds spent building the tree.
+        double copy_time; //< Time in milliseconds spent restoring the tree, or 0 if it was not yet restored.
+        std::vector<uint32_t> nodes;
+    };
+    /** The number of viewport sizes for which the built quadtree is cached. 
+     * A few are needed, as the tiles at the edges of the parallel renderer are smaller. */
+    static const uint32_t PRISTINE_CACHE_SIZE = 4;
+    std::vector<pristine> cache;
+    uint32_t cache_next;
+
+    /** Storage for the nodes, including the rootnode. 
+     * Its capacity is retained when the quadtree shrinks, such that alternating sizes do not cause reallocations.
+     * Large quadtrees are stored in huge pages, as the traversal accesses their nodes at random. */
+    std::vector<uint32_t, huge_page_allocator<uint32_t>> nodes;
+
+    /** Changes the number of levels of the quadtree. The contents of the nodes are undefined afterwards. */
+    void resize(uint32_t dim);
+
     /** Sets a single value at given coordinates on the bottom level of the tree. (unused) 
      * Does not propagate this value through the rest of the tree. */
     void set(uint32_t x, uint32_t y);
     
     void build_fill(int i);
     bool build_check(int w, int h, int i, int size);
+    bool reuse_check(int i, uint32_t x, uint32_t y, uint32_t size);
+
+    quadtree(const quadtree&);
+    quadtree& operator=(const quadtree&);
 };
 
 
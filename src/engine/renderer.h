@@ -0,0 +1,169 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDERER_H
+#define RENDERER_H
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "surface.h"
+#include "octree.h"
+#include "scene.h"
+
+struct traversal;
+struct entry_caches;
+class thread_pool;
+class octree_replicas;
+
+/** Renders octrees.
+ * A renderer owns all state that is used during rendering: its occlusion quadtree, counters and camera state.
+ * Hence independent renderers can be used concurrently from different threads, without any locking.
+ * A single renderer must not be used by multiple threads at the same time.
+ */
+class renderer {
+public:
+    renderer();
+    ~renderer();
+
+    /** Render the octree to the provided surface for the given viewpane, position and orientation.
+     * @param file the octree that is being rendered.
+     * @param surf the surface that is being rendered to.
+     * @param position the position of the camera.
+     * @param orientation the orientation of the camera (which is assumed to be orthogonal).
+     */
+    void render(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Render the octree to the width * height rectangle of surf whose top-left corner is at (x,y).
+     * @param view the view pane of this rectangle (rather than that of the entire surface).
+     */
+    void render(octree_file* file, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Render the instances of the scene, see scene.h. The beam pre-pass and the entry cache are not used for scenes. */
+    void render(const scene &s, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Render the layers to the rectangle of surf in the given order, sharing the occlusion quadtree,
+     * such that each layer only draws the pixels that are not drawn by the layers before it.
+     * The beam pre-pass and the entry cache are only used if there is a single layer. */
+    void render(const scene_layer * layers, uint32_t count, surface surf, uint32_t x, uint32_t y, uint32_t width, uint32_t height, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Sets the level of detail. At level n, rendering stops at blocks of 2^n * 2^n pixels,
+     * which are filled with the color of the octree node that is being traversed (the average
+     * color for interior nodes). Level 0, the default, renders each pixel individually. */
+    void set_detail(uint32_t level);
+    uint32_t detail() const;
+
+    /** Sets whether the pixels of the target that are already drawn, i.e. whose depth is not the ~0u
+     * written by surface::clear, are kept. Only the remaining pixels are rendered, which is used to
+     * fill the gaps of a reprojected frame (see reprojection.h). Requires a target with a depth buffer. */
+    void set_reuse(bool reuse);
+    bool reuse() const;
+
+    /** Sets whether the octree is traversed using an explicit stack, rather than recursively.
+     * The iterative traversal tests the children of an octree node at once (using AVX2, if available)
+     * and renders the same image, but its statistics differ slightly, as it tests children that are skipped by the recursion. */
+    void set_iterative(bool iterative);
+    bool iterative() const;
+
+    /** Sets whether the image is rendered per tile of 16x16 pixels by a beam pre-pass, which tests the upper
+     * octree levels against the frustum of the tile, rather than against the much larger quadtree nodes above it,
+     * and starts the traversal from the octree nodes that reach the tile. This renders the same image. */
+    void set_beam(bool beam);
+    bool beam() const;
+
+    /** Sets whether the octree nodes from which the tiles of the beam pre-pass (see set_beam) were rendered are cached.
+     * If the octree and camera are unchanged, the next frame first traverses each tile from these nodes, which renders
+     * the same image. The cache also stores the number of nodes visited per rectangle, which is kept while the camera
+     * moves and by which a parallel_renderer orders its tiles. The cache is kept for the last rendered rectangle,
+     * and cleared when disabled. */
+    void set_entry_cache(bool enabled);
+    bool entry_cache() const;
+
+    /** Statistics of the last call to render. */
+    const render_stats& stats() const;
+
+private:
+    friend class parallel_renderer;
+    traversal * data;
+    renderer(const renderer&);
+    renderer& operator=(const renderer&);
+};
+
+/** Renders octrees using multiple threads.
+ * The surface is split into tiles, which are distributed over a pool of threads,
+ * each of which has its own renderer and quadtree. The quadtrees are sized to the tiles,
+ * such that they remain cache resident.
+ */
+class parallel_renderer {
+public:
+    /** Creates a parallel renderer using the given number of threads.
+     * If threads <= 0, one thread per hardware thread is used.
+     * If pin is set, the threads are pinned to CPUs spread over the NUMA nodes (see thread_pool), including the calling
+     * thread, which must then be the thread that renders. Each thread allocates its quadtree on its own node. */
+    explicit parallel_renderer(int threads = 0, bool pin = false);
+    ~parallel_renderer();
+
+    /** Renders the octree like renderer::render. */
+    void render(octree_file* file, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Renders the instances of the scene like renderer::render. */
+    void render(const scene &s, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Renders the octree like renderer::render, where each thread traverses the copy of its upper levels on its
+     * NUMA node (see octree_edit.h), which is best combined with pinned threads. This renders the same image. */
+    void render(const octree_replicas &replicas, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Sets the level of detail of all threads, see renderer::set_detail. */
+    void set_detail(uint32_t level);
+    uint32_t detail() const;
+
+    /** Sets whether all threads keep the pixels that are already drawn, see renderer::set_reuse. */
+    void set_reuse(bool reuse);
+    bool reuse() const;
+
+    /** Sets whether all threads use the iterative traversal, see renderer::set_iterative. */
+    void set_iterative(bool iterative);
+    bool iterative() const;
+
+    /** Sets whether all threads use the beam pre-pass, see renderer::set_beam. */
+    void set_beam(bool beam);
+    bool beam() const;
+
+    /** Sets whether the entry nodes of the tiles are cached, see renderer::set_entry_cache.
+     * The cache of each tile is shared by all threads, as a tile is not always rendered by the same thread.
+     * The tiles that visited the most nodes in the previous frame are started first, also while the camera moves,
+     * such that the threads finish at about the same time. */
+    void set_entry_cache(bool enabled);
+    bool entry_cache() const;
+
+    /** Statistics of the last call to render, summed over all tiles. */
+    const render_stats& stats() const { return total; }
+    int threads() const;
+
+private:
+    std::unique_ptr<thread_pool> pool;
+    std::vector<std::unique_ptr<renderer>> workers;
+    std::unique_ptr<entry_caches> caches; ///< The entry caches of the tiles, shared by the workers.
+    render_stats total;
+    std::vector<scene_layer> layers; ///< The layers of the scene that is being rendered.
+    void render(const scene_layer * layers, uint32_t count, surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, const octree_replicas * replicas = nullptr);
+    parallel_renderer(const parallel_renderer&);
+    parallel_renderer& operator=(const parallel_renderer&);
+};
+
+#endif
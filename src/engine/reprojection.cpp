@@ -0,0 +1,82 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <algorithm>
+
+#include "reprojection.h"
+#include "trace.h"
+
+reprojection::reprojection(uint32_t max_age) : max_age(max_age), age(0), valid(false) {}
+
+void reprojection::store(surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, bool reprojected) {
+    if (reprojected) {
+        age++;
+        return;
+    }
+    if (history.width != surf.width || history.height != surf.height) {
+        history = surface(surf.width, surf.height, true);
+    }
+    std::copy_n(surf.data, surf.width * surf.height, history.data);
+    std::copy_n(surf.depth, surf.width * surf.height, history.depth);
+    this->view = view;
+    this->position = position;
+    this->orientation = orientation;
+    age = 0;
+    valid = true;
+}
+
+bool reprojection::project(surface surf, uint32_t background, view_pane view, glm::dvec3 position, glm::dmat3 orientation) {
+    if (!valid || age >= max_age) return false;
+    if (!surf.depth || surf.width != history.width || surf.height != history.height) return false;
+    TRACE_ZONE("reprojection::project");
+    surf.clear(background);
+
+    // Transformation from the old to the new camera space.
+    glm::dmat3 rotate = orientation * glm::transpose(this->orientation);
+    glm::dvec3 translate = orientation * (this->position - position);
+    // The direction through the center of pixel (x,y) of the old view is base + x*step_x + y*step_y.
+    double width = surf.width, height = surf.height;
+    glm::dvec3 step_x = rotate * glm::dvec3((this->view.right - this->view.left) / width, 0, 0);
+    glm::dvec3 step_y = rotate * glm::dvec3(0, (this->view.bottom - this->view.top) / height, 0);
+    glm::dvec3 base = rotate * glm::dvec3(this->view.left, this->view.top, 1) + (step_x + step_y) * 0.5;
+    // Maps the projected point to pixel coordinates of the new view.
+    double scale_x = width / (view.right - view.left);
+    double scale_y = height / (view.bottom - view.top);
+
+    for (uint32_t y=0; y<surf.height; y++) {
+        glm::dvec3 dir = base + step_y * (double)y;
+        for (uint32_t x=0; x<surf.width; x++, dir += step_x) {
+            uint32_t i = x + y*surf.width;
+            uint32_t depth = history.depth[i];
+            if (depth == ~0u) continue;
+            glm::dvec3 p = dir * (double)depth + translate;
+            if (p.z < 1) continue;
+            double nx = std::floor((p.x / p.z - view.left) * scale_x);
+            double ny = std::floor((p.y / p.z - view.top ) * scale_y);
+            if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+            uint32_t j = (uint32_t)nx + (uint32_t)ny * surf.width;
+            uint32_t new_depth = std::min(p.z, 4294967294.0);
+            if (new_depth < surf.depth[j]) {
+                surf.data[j] = history.data[i];
+                surf.depth[j] = new_depth;
+            }
+        }
+    }
+    return true;
+}
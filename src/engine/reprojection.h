@@ -0,0 +1,69 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPROJECTION_H
+#define REPROJECTION_H
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "surface.h"
+#include "octree.h"
+
+/** Reuses the previous frame when the camera moves slightly.
+ *
+ * The color and depth of each pixel of the previous frame are projected onto the new camera,
+ * where the z-buffer resolves the pixels that are now occluded. Rendering with renderer::set_reuse
+ * then only traverses the octree for the pixels that were not covered, such as the regions that
+ * became visible and the gaps between the projected pixels.
+ *
+ * Only frames that were rendered from scratch are stored: as each projected pixel is moved to the
+ * nearest pixel center, reprojecting a reprojected frame would accumulate these errors. Instead the
+ * stored frame is reprojected for each following frame, which requires rendering more pixels as the
+ * camera moves away from it. Furthermore geometry that enters the view is not rendered over the
+ * projected pixels. Hence a frame is reprojected at most max_age times, after which it must be
+ * rendered from scratch.
+ */
+class reprojection {
+public:
+    reprojection(uint32_t max_age = 8);
+
+    /** Stores the rendered frame with the camera it was rendered from.
+     * @param reprojected whether the frame was rendered on top of the result of project(),
+     *                    in which case only the number of reprojections is updated. */
+    void store(surface surf, view_pane view, glm::dvec3 position, glm::dmat3 orientation, bool reprojected);
+
+    /** Clears surf to the background color and projects the stored frame onto it for the given camera.
+     * @return false if there is no frame that can be reused, in which case surf is not modified. */
+    bool project(surface surf, uint32_t background, view_pane view, glm::dvec3 position, glm::dmat3 orientation);
+
+    /** Discards the stored frame. */
+    void invalidate() { valid = false; age = 0; }
+
+    /** The number of times the stored frame has been reprojected, 0 if the last frame was rendered from scratch. */
+    uint32_t reprojected() const { return age; }
+
+private:
+    uint32_t max_age;
+    uint32_t age;
+    bool valid;
+    surface history;
+    view_pane view;
+    glm::dvec3 position;
+    glm::dmat3 orientation;
+};
+
+#endif
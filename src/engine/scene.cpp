@@ -0,0 +1,75 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+#include <algorithm>
+
+#include "scene.h"
+#include "octree_edit.h"
+
+static const int32_t SCENE_DEPTH = 26;
+
+/** The size in bytes of the pool of each model, which stores the paths of its instances. */
+static const uint32_t INSTANCE_CAPACITY = 16u<<20;
+
+scene::scene() {}
+scene::~scene() {}
+
+int scene::add_model(const octree_file * file) {
+    model.emplace_back(new octree_edit(file, INSTANCE_CAPACITY));
+    return model.size() - 1;
+}
+
+int scene::add_instance(int m, uint32_t x, uint32_t y, uint32_t z, int depth) {
+    assert(0 <= m && m < (int)model.size());
+    assert(0 <= depth && depth <= SCENE_DEPTH);
+    assert(std::max(x, std::max(y, z)) >> depth == 0);
+    placement p = {m, x, y, z, depth, model[m]->place(x, y, z, depth)};
+    instance.push_back(p);
+    return instance.size() - 1;
+}
+
+void scene::layers(glm::dvec3 position, std::vector<scene_layer> &out) const {
+    std::vector<const placement*> order;
+    for (const placement &p : instance) {
+        order.push_back(&p);
+    }
+    // Compares the paths to the cubes of the instances, where the children of each node are ordered
+    // like in the traversal, starting with the child nearest to the camera.
+    std::sort(order.begin(), order.end(), [position](const placement * a, const placement * b){
+        glm::dvec3 center(0);
+        double size = 1<<SCENE_DEPTH;
+        for (int l=0; l<std::min(a->depth, b->depth); l++) {
+            int sa = a->depth - 1 - l, sb = b->depth - 1 - l;
+            int i = ((a->x >> sa) & 1) << 2 | ((a->y >> sa) & 1) << 1 | ((a->z >> sa) & 1);
+            int j = ((b->x >> sb) & 1) << 2 | ((b->y >> sb) & 1) << 1 | ((b->z >> sb) & 1);
+            if (i != j) {
+                int nearest = (position.x > center.x ? 4 : 0) | (position.y > center.y ? 2 : 0) | (position.z > center.z ? 1 : 0);
+                return (i ^ nearest) < (j ^ nearest);
+            }
+            size /= 2;
+            center += glm::dvec3(i&4 ? size : -size, i&2 ? size : -size, i&1 ? size : -size);
+        }
+        return a->depth > b->depth;
+    });
+    out.clear();
+    for (const placement * p : order) {
+        scene_layer layer = {model[p->model]->file()->root, p->top, nullptr};
+        out.push_back(layer);
+    }
+}
@@ -0,0 +1,81 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCENE_H
+#define SCENE_H
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "octree.h"
+
+class octree_edit;
+
+/** An octree that is rendered as part of a frame: the nodes of an octree file, traversed from the given root node. */
+struct scene_layer {
+    octree * root;
+    uint32_t top;
+    octree_stream * stream; ///< See octree_file::stream.
+};
+
+/** A set of models, of which instances are placed in a shared space, that are rendered together (see renderer.h).
+ *
+ * Instances are placed at the cubes of an octree that spans the space of a single octree file. The cube (x,y,z)
+ * at depth d below its root, with coordinates ranging from 0 to 2^d-1, contains the model scaled down by 2^d.
+ * Hence an instance at depth 0 is rendered like its octree file.
+ *
+ * Instances do not copy the nodes of their model. Each is rendered from a path of d nodes that leads from the
+ * root of the space to the root of the model, which is added to its model's nodes (see octree_edit::place).
+ * The instances are rendered one after the other in front to back order, sharing the occlusion quadtree,
+ * such that each only draws the pixels that are not drawn by the instances in front of it.
+ * This order is exact for instances whose cubes do not overlap. Of two instances that do,
+ * the instance with the smaller cube is rendered first, hence it is never hidden by the other.
+ */
+class scene {
+public:
+    scene();
+    ~scene();
+
+    /** Adds the octree file as a model, which does not need to outlive the scene. Returns the number of the model.
+     * The file is mapped like octree_edit, such that its pages are shared with other mappings of the file. */
+    int add_model(const octree_file * file);
+
+    /** Places an instance of the model at the cube (x,y,z) at the given depth. Returns the number of the instance. */
+    int add_instance(int model, uint32_t x, uint32_t y, uint32_t z, int depth);
+
+    uint32_t models() const { return model.size(); }
+    uint32_t instances() const { return instance.size(); }
+
+    /** Stores the instances in out, in the order in which they are rendered by a camera at the given position. */
+    void layers(glm::dvec3 position, std::vector<scene_layer> &out) const;
+
+private:
+    struct placement {
+        int model;
+        uint32_t x, y, z;
+        int depth;
+        uint32_t top; ///< The root of the path that leads to the model.
+    };
+    std::vector<std::unique_ptr<octree_edit>> model;
+    std::vector<placement> instance;
+
+    scene(const scene&);
+    scene& operator=(const scene&);
+};
+
+#endif
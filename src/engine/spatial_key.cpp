@@ -0,0 +1,136 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "spatial_key.h"
+
+/** A single step along the Hilbert curve.
+ * Maps the 3-bit morton digit rg onto the position i of that octant along the curve
+ * and updates the entry (start) and exit (end) corner of the curve within that octant.
+ */
+static inline uint64_t hilbert_step(uint64_t rg, uint64_t &start, uint64_t &end) {
+    rg ^= start;
+    uint64_t travel_shift = (0x30210 >> (start ^ end)*4)&3;
+    uint64_t i = (((rg << 3) | rg) >> travel_shift ) & 7;
+    i = (0x54672310 >> i*4) & 7;
+    uint64_t si = (0x64422000 >> i*4 ) & 7; // next lower even number, or 0
+    uint64_t ei = (0x77755331 >> i*4 ) & 7; // next higher odd number, or 7
+    uint64_t sg = ( si ^ (si>>1) ) << travel_shift;
+    uint64_t eg = ( ei ^ (ei>>1) ) << travel_shift;
+    end   = ( ( eg | ( eg >> 3 ) ) & 7 ) ^ start;
+    start = ( ( sg | ( sg >> 3 ) ) & 7 ) ^ start;
+    return i;
+}
+
+/** Lookup table that performs two hilbert_steps at once.
+ * It is indexed by the state (start | end<<3) and two morton digits,
+ * and stores the two curve positions in the lower 6 bits and the new state above that.
+ */
+struct hilbert_table {
+    uint32_t step[64*64]; // 32-bit entries, such that they can be gathered.
+    hilbert_table() {
+        for (uint64_t s=0; s<64; s++) {
+            for (uint64_t d=0; d<64; d++) {
+                uint64_t start = s&7, end = s>>3;
+                uint64_t i = hilbert_step(d>>3, start, end) << 3;
+                i |= hilbert_step(d&7, start, end);
+                step[s<<6|d] = i | (start | end<<3) << 6;
+            }
+        }
+    }
+};
+static const hilbert_table table;
+static const uint64_t INITIAL_STATE = 0 | 1<<3; // start = 0, end = 1.
+
+uint64_t hilbert3d(const point &p) {
+    uint64_t val = morton3d(p.x, p.y, p.z);
+    uint64_t state = INITIAL_STATE;
+    uint64_t ret = 0;
+    for (int64_t j=18; j>=0; j-=2) {
+        uint64_t v = table.step[state<<6 | ((val>>(3*j))&63)];
+        ret = (ret<<6) | (v&63);
+        state = v>>6;
+    }
+    return ret;
+}
+
+#ifdef __AVX2__
+/** Loads 4 points and stores their coordinates in 64-bit lanes. */
+static inline void load_points(const point * p, __m256i &x, __m256i &y, __m256i &z) {
+    __m128 a = _mm_loadu_ps((const float*)&p[0]);
+    __m128 b = _mm_loadu_ps((const float*)&p[1]);
+    __m128 c = _mm_loadu_ps((const float*)&p[2]);
+    __m128 d = _mm_loadu_ps((const float*)&p[3]);
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    x = _mm256_cvtepu32_epi64(_mm_castps_si128(a));
+    y = _mm256_cvtepu32_epi64(_mm_castps_si128(b));
+    z = _mm256_cvtepu32_epi64(_mm_castps_si128(c));
+}
+
+/** Spreads the bits of each lane such that there are 2 zero bits between each of them. */
+static inline __m256i spread3(__m256i x) {
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 32)), _mm256_set1_epi64x(0xFFFF00000000FFFF));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x, 16)), _mm256_set1_epi64x(0x00FF0000FF0000FF));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x,  8)), _mm256_set1_epi64x(0xF00F00F00F00F00F));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x,  4)), _mm256_set1_epi64x(0x30C30C30C30C30C3));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi64(x,  2)), _mm256_set1_epi64x(0x9249249249249249));
+    return x;
+}
+
+/** Computes the hilbert keys of 8 points, as two interleaved sets of 4, to hide the latency of the gathers.
+ * Uses the same lookup table as the scalar code, where the lookups are done using gather instructions. */
+static inline void hilbert3d_x8(const point * p, uint64_t * keys) {
+    const __m256i mask = _mm256_set1_epi64x(63);
+    __m256i x, y, z;
+    load_points(p, x, y, z);
+    __m256i val_a = _mm256_or_si256(spread3(x), _mm256_or_si256(_mm256_slli_epi64(spread3(y), 1), _mm256_slli_epi64(spread3(z), 2)));
+    load_points(p+4, x, y, z);
+    __m256i val_b = _mm256_or_si256(spread3(x), _mm256_or_si256(_mm256_slli_epi64(spread3(y), 1), _mm256_slli_epi64(spread3(z), 2)));
+    // The state is kept pre-shifted, such that it can be or-ed with the digits to obtain the table index.
+    __m256i state_a = _mm256_set1_epi64x(INITIAL_STATE << 6), ret_a = _mm256_setzero_si256();
+    __m256i state_b = _mm256_set1_epi64x(INITIAL_STATE << 6), ret_b = _mm256_setzero_si256();
+    for (int j=18; j>=0; j-=2) {
+        __m128i shift = _mm_cvtsi32_si128(3*j);
+        __m256i index_a = _mm256_or_si256(state_a, _mm256_and_si256(_mm256_srl_epi64(val_a, shift), mask));
+        __m256i index_b = _mm256_or_si256(state_b, _mm256_and_si256(_mm256_srl_epi64(val_b, shift), mask));
+        __m256i v_a = _mm256_cvtepu32_epi64(_mm256_i64gather_epi32((const int*)table.step, index_a, 4));
+        __m256i v_b = _mm256_cvtepu32_epi64(_mm256_i64gather_epi32((const int*)table.step, index_b, 4));
+        ret_a = _mm256_or_si256(_mm256_slli_epi64(ret_a, 6), _mm256_and_si256(v_a, mask));
+        ret_b = _mm256_or_si256(_mm256_slli_epi64(ret_b, 6), _mm256_and_si256(v_b, mask));
+        state_a = _mm256_andnot_si256(mask, v_a);
+        state_b = _mm256_andnot_si256(mask, v_b);
+    }
+    _mm256_storeu_si256((__m256i*)&keys[0], ret_a);
+    _mm256_storeu_si256((__m256i*)&keys[4], ret_b);
+}
+#endif
+
+void hilbert3d(const point * points, uint64_t * keys, size_t n) {
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i+8 <= n; i+=8) {
+        hilbert3d_x8(points + i, keys + i);
+    }
+#endif
+    for (; i<n; i++) {
+        keys[i] = hilbert3d(points[i]);
+    }
+}
@@ -0,0 +1,107 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPATIAL_KEY_H
+#define SPATIAL_KEY_H
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+#include "pointset.h"
+
+/* Morton (Z-order) and Hilbert curve keys.
+ *
+ * The BMI2 (pdep/pext) and AVX2 code paths are selected at compile time, like the SSE4.1 code
+ * in octree_draw.cpp, and have bit shifting fall-backs for older CPUs.
+ * Note that pdep/pext are very slow on AMD CPUs prior to Zen 3. Define SPATIAL_KEY_NO_BMI2
+ * when compiling with -march=native on such a CPU.
+ */
+
+#if defined(__BMI2__) && !defined(SPATIAL_KEY_NO_BMI2)
+# define SPATIAL_KEY_BMI2
+#endif
+
+/** Pack 3 32-bit indices into a 96-bit Morton code, except that the result is truncated to 64-bit.
+ * Bit 0 of the result is bit 0 of x. */
+static inline uint64_t morton3d(uint64_t x, uint64_t y, uint64_t z) {
+#ifdef SPATIAL_KEY_BMI2
+    const uint64_t M = 0x9249249249249249;
+    return _pdep_u64(x, M) | (_pdep_u64(y, M)<<1) | (_pdep_u64(z, M)<<2);
+#else
+    static const uint64_t B[] = {
+        0xFFFF00000000FFFF,
+        0x00FF0000FF0000FF,
+        0xF00F00F00F00F00F,
+        0x30C30C30C30C30C3,
+        0x9249249249249249,
+    };
+    static const uint64_t S[] = {32, 16, 8, 4, 2};
+    for (uint64_t i=0; i<5; i++) {
+        x = (x | (x << S[i])) & B[i];
+        y = (y | (y << S[i])) & B[i];
+        z = (z | (z << S[i])) & B[i];
+    }
+    return x | (y<<1) | (z<<2);
+#endif
+}
+
+/** Pack 2 16-bit indices into a 32-bit Morton code. Bit 0 of the result is bit 0 of x. */
+static inline uint32_t morton2d(uint32_t x, uint32_t y) {
+#ifdef SPATIAL_KEY_BMI2
+    return _pdep_u32(x, 0x55555555) | _pdep_u32(y, 0xaaaaaaaa);
+#else
+    static const uint32_t B[] = {0x00FF00FF, 0x0F0F0F0F, 0x33333333, 0x55555555};
+    static const uint32_t S[] = {8, 4, 2, 1};
+    for (int i=0; i<4; i++) {
+        x = (x | (x << S[i])) & B[i];
+        y = (y | (y << S[i])) & B[i];
+    }
+    return x | (y<<1);
+#endif
+}
+
+/** Extracts the index stored in the even bits of a 2D Morton code. */
+static inline uint32_t morton2d_even(uint32_t v) {
+#ifdef SPATIAL_KEY_BMI2
+    return _pext_u32(v, 0x55555555);
+#else
+    static const uint32_t B[] = {0x00FF00FF, 0x0F0F0F0F, 0x33333333, 0x55555555};
+    static const uint32_t S[] = {8, 4, 2, 1};
+    for (int i=3; i>=0; i--) {
+        v &= B[i];
+        v = (v | (v >> S[i]));
+    }
+    return v & 0xffff;
+#endif
+}
+
+/** Decodes a 2D Morton code into its x (even bits) and y (odd bits) index. */
+static inline void morton2d_decode(uint32_t v, uint32_t &x, uint32_t &y) {
+    x = morton2d_even(v);
+    y = morton2d_even(v>>1);
+}
+
+/** Computes the position of the point along a 3D Hilbert curve covering the lower 20 bits of its coordinates. */
+uint64_t hilbert3d(const point &p);
+
+/** Computes hilbert3d for the points[0..n) and stores the results in keys[0..n).
+ * Uses AVX2 to process 8 points at a time, if available. */
+void hilbert3d(const point * points, uint64_t * keys, size_t n);
+
+#endif
@@ -22,7 +22,12 @@
 
 #include <algorithm>
 #include <cassert>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "surface.h"
+#include "thread_pool.h"
 
 surface::surface() : refs(nullptr), data(nullptr), depth(nullptr), width(0), height(0) {}
 
@@ -102,58 +107,114 @@ surface surface::scale(int n, bool depth) {
     return surface(width*n, height*n, depth);
 }
 
-void surface::copy(surface source) {
+/** Box filters n x n blocks of the source rows starting at src into width pixels at dst, using per channel sums. */
+static void downscale_row(const uint32_t * src, uint32_t stride, uint32_t * dst, uint32_t width, uint32_t n) {
+    uint32_t area = n * n;
+    for (uint32_t x=0; x<width; x++) {
+        uint32_t r = area / 2, g = area / 2, b = area / 2;
+        for (uint32_t j=0; j<n; j++) {
+            const uint32_t * row = src + j * stride + x * n;
+            for (uint32_t i=0; i<n; i++) {
+                r += (row[i]>> 0) & 0xff;
+                g += (row[i]>> 8) & 0xff;
+                b += (row[i]>>16) & 0xff;
+            }
+        }
+        dst[x] = (r / area) | (g / area) << 8 | (b / area) << 16;
+    }
+}
+
+#ifdef __AVX2__
+/** Sums the even (red, blue) and odd (green, alpha) bytes of 8 pixels into the 16-bit lanes of even and odd. */
+static inline void accumulate_channels(__m256i v, __m256i &even, __m256i &odd) {
+    const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    even = _mm256_add_epi16(even, _mm256_and_si256(v, mask));
+    odd = _mm256_add_epi16(odd, _mm256_and_si256(_mm256_srli_epi32(v, 8), mask));
+}
+
+/** Merges the summed channels of 8 pixels, divided by 1 << shift, rounded to nearest. */
+static inline __m256i merge_channels(__m256i even, __m256i odd, int shift) {
+    const __m256i bias = _mm256_set1_epi16(1 << (shift - 1));
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    even = _mm256_srl_epi16(_mm256_add_epi16(even, bias), count);
+    odd = _mm256_srl_epi16(_mm256_add_epi16(odd, bias), count);
+    return _mm256_and_si256(_mm256_or_si256(even, _mm256_slli_epi32(odd, 8)), _mm256_set1_epi32(0xffffff));
+}
+
+/** Computes 8 pixels of a 2x downscale.
+ * As the channel sums fit in 16 bits, two of them can be added at once by adding 32-bit lanes. */
+static inline __m256i downscale2_x8(const uint32_t * src, uint32_t stride) {
+    __m256i even[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+    __m256i odd[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+    for (int j=0; j<2; j++) {
+        for (int k=0; k<2; k++) {
+            accumulate_channels(_mm256_loadu_si256((const __m256i*)(src + j * stride + k * 8)), even[k], odd[k]);
+        }
+    }
+    // hadd works per 128-bit lane, which leaves the pairs of pixels in the order 0 1 4 5 2 3 6 7.
+    __m256i e = _mm256_permute4x64_epi64(_mm256_hadd_epi32(even[0], even[1]), _MM_SHUFFLE(3,1,2,0));
+    __m256i o = _mm256_permute4x64_epi64(_mm256_hadd_epi32(odd[0], odd[1]), _MM_SHUFFLE(3,1,2,0));
+    return merge_channels(e, o, 2);
+}
+
+/** Computes 8 pixels of a 4x downscale. */
+static inline __m256i downscale4_x8(const uint32_t * src, uint32_t stride) {
+    __m256i even[4], odd[4];
+    for (int k=0; k<4; k++) {
+        even[k] = odd[k] = _mm256_setzero_si256();
+    }
+    for (int j=0; j<4; j++) {
+        for (int k=0; k<4; k++) {
+            accumulate_channels(_mm256_loadu_si256((const __m256i*)(src + j * stride + k * 8)), even[k], odd[k]);
+        }
+    }
+    // Two rounds of hadd leave the pixels in the order 0 2 4 6 1 3 5 7.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i e = _mm256_hadd_epi32(_mm256_hadd_epi32(even[0], even[1]), _mm256_hadd_epi32(even[2], even[3]));
+    __m256i o = _mm256_hadd_epi32(_mm256_hadd_epi32(odd[0], odd[1]), _mm256_hadd_epi32(odd[2], odd[3]));
+    return merge_channels(_mm256_permutevar8x32_epi32(e, order), _mm256_permutevar8x32_epi32(o, order), 4);
+}
+#endif
+
+void surface::copy_rows(const surface &source, uint32_t begin, uint32_t end) {
     assert(data);
     assert(source.data);
-    if (width == source.width) {
-        assert(height == source.height);
-        std::copy_n(source.data, width*height, data);
-    } else if (2*width == source.width) {
-        assert(2*height == source.height);
-        for (unsigned int y=0; y<height; y++) {
-            for (unsigned int x=0; x<width; x++) {
-                uint64_t c = 0x0200020002;
-                c += (source.data[x*2+0+(y*2+0)*width*2] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*2+1+(y*2+0)*width*2] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*2+0+(y*2+1)*width*2] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*2+1+(y*2+1)*width*2] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c >>= 2;
-                c &= 0x0000ff0000ff00ff;
-                c |= c >> 32;
-                c &= 0xffffff;
-                pixel(x,y,c);
+    assert(end <= height);
+    uint32_t n = source.width / width;
+    assert(n * width == source.width);
+    assert(n * height == source.height);
+    if (n == 1) {
+        std::copy(source.data + begin * width, source.data + end * width, data + begin * width);
+        return;
+    }
+    for (uint32_t y=begin; y<end; y++) {
+        const uint32_t * src = source.data + y * n * source.width;
+        uint32_t * dst = data + y * width;
+        uint32_t x = 0;
+#ifdef __AVX2__
+        if (n == 2) {
+            for (; x + 8 <= width; x += 8) {
+                _mm256_storeu_si256((__m256i*)(dst + x), downscale2_x8(src + x * 2, source.width));
             }
-        }
-    } else if (4*width == source.width) {
-        assert(4*height == source.height);
-        for (unsigned int y=0; y<height; y++) {
-            for (unsigned int x=0; x<width; x++) {
-                uint64_t c = 0x0200020002;
-                c += (source.data[x*4+0+(y*4+0)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+1+(y*4+0)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+2+(y*4+0)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+3+(y*4+0)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+0+(y*4+1)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+1+(y*4+1)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+2+(y*4+1)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+3+(y*4+1)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+0+(y*4+2)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+1+(y*4+2)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+2+(y*4+2)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+3+(y*4+2)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+0+(y*4+3)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+1+(y*4+3)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+2+(y*4+3)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c += (source.data[x*4+3+(y*4+3)*width*4] * 0x100000001uL) & 0x0000ff0000ff00ff;
-                c >>= 4;
-                c &= 0x0000ff0000ff00ff;
-                c |= c >> 32;
-                c &= 0xffffff;
-                pixel(x,y,c);
+        } else if (n == 4) {
+            for (; x + 8 <= width; x += 8) {
+                _mm256_storeu_si256((__m256i*)(dst + x), downscale4_x8(src + x * 4, source.width));
             }
         }
-    } else {
-        assert(!"Cannot match sizes");
+#endif
+        downscale_row(src + x * n, source.width, dst + x, width - x, n);
     }
 }
 
+void surface::copy(const surface &source, thread_pool * pool) {
+    if (!pool) {
+        copy_rows(source, 0, height);
+        return;
+    }
+    // Copy bands of rows, such that the jobs are large enough to outweigh their overhead.
+    static const uint32_t BAND = 16;
+    uint32_t bands = (height + BAND - 1) / BAND;
+    pool->run(bands, [&](int band, int){
+        copy_rows(source, band * BAND, std::min(band * BAND + BAND, height));
+    });
+}
@@ -20,6 +20,8 @@
 #define SURFACE_H
 #include <stdint.h>
 
+class thread_pool;
+
 struct surface {
     uint32_t * refs;
     uint32_t * data;
@@ -60,8 +62,14 @@ struct surface {
     surface scale(int n, bool depth = false);
     
     /** Copy the source onto this surface. 
-     * The sizes of the surfaces must match, or source must be 2x or 4x as big as this surface. */
-    void copy(surface source);
+     * The sizes of the surfaces must match, or source must be n times as big in both dimensions as this surface,
+     * for some integer n, in which case each pixel becomes the average of a block of n x n pixels.
+     * Downscaling by 2x and 4x uses AVX2, if available.
+     * \param pool If given, the rows are distributed over the threads of the pool. */
+    void copy(const surface &source, thread_pool * pool = nullptr);
+    
+    /** Copy or downscale the rows [begin, end) of this surface from the source, as in copy(). */
+    void copy_rows(const surface &source, uint32_t begin, uint32_t end);
 };
 
 #endif
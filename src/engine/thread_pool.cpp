@@ -0,0 +1,135 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+#include "thread_pool.h"
+#include "numa.h"
+
+static int default_threads() {
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+thread_pool::thread_pool(int threads, bool pin)
+  : queues(threads > 0 ? threads : default_threads())
+  , remaining(0)
+  , current(nullptr)
+  , generation(0)
+  , stop(false)
+{
+    std::vector<int> cpus = pin ? numa_cpus() : std::vector<int>();
+    for (int i=0; i<size() && !cpus.empty(); i++) {
+        // Workers are spread evenly over the CPUs, which are ordered by NUMA node.
+        cpu.push_back(cpus[(uint64_t)i * cpus.size() / size()]);
+        nodes.push_back(numa_node_of_cpu(cpu[i]));
+    }
+    if (!cpu.empty()) numa_pin_thread(cpu[0]);
+    for (int i=1; i<size(); i++) {
+        this->threads.push_back(std::thread(&thread_pool::main, this, i));
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stop = true;
+    }
+    start.notify_all();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+void thread_pool::run(int n, const job_function &job) {
+    assert(remaining == 0);
+    if (n <= 0) return;
+    // The job must be published before the first job is queued,
+    // as workers that are still busy with the previous batch might pick it up immediately.
+    {
+        std::lock_guard<std::mutex> l(lock);
+        current = &job;
+        remaining = n;
+        generation++;
+    }
+    // Deal out the jobs, such that each worker starts with the lowest indices in its queue.
+    int workers = size();
+    for (int w=0; w<workers; w++) {
+        std::lock_guard<std::mutex> l(queues[w].lock);
+        for (int i=w; i<n; i+=workers) {
+            queues[w].jobs.push_back(i);
+        }
+    }
+    start.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> l(lock);
+    done.wait(l, [this]{ return remaining == 0; });
+    current = nullptr;
+}
+
+int thread_pool::node(int worker) const {
+    return nodes.empty() ? numa_current_node() : nodes[worker];
+}
+
+void thread_pool::main(int worker) {
+    if (!cpu.empty()) numa_pin_thread(cpu[worker]);
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            start.wait(l, [&]{ return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+        }
+        work(worker);
+    }
+}
+
+void thread_pool::work(int worker) {
+    int job;
+    while (take(worker, job)) {
+        (*current)(job, worker);
+        if (remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> l(lock);
+            done.notify_all();
+        }
+    }
+}
+
+/** Takes a job from the front of the worker's own queue, or steals one from the back of another queue. */
+bool thread_pool::take(int worker, int &job) {
+    int workers = size();
+    {
+        queue &q = queues[worker];
+        std::lock_guard<std::mutex> l(q.lock);
+        if (!q.jobs.empty()) {
+            job = q.jobs.front();
+            q.jobs.pop_front();
+            return true;
+        }
+    }
+    for (int i=1; i<workers; i++) {
+        queue &q = queues[(worker + i) % workers];
+        std::lock_guard<std::mutex> l(q.lock);
+        if (!q.jobs.empty()) {
+            job = q.jobs.back();
+            q.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
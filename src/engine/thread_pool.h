@@ -0,0 +1,90 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** A fixed set of worker threads that executes batches of jobs.
+ *
+ * The jobs of a batch are dealt out over per-worker queues. Each worker takes
+ * jobs from the front of its own queue and, once that runs dry, steals jobs
+ * from the back of the queues of the other workers.
+ *
+ * The thread calling run() acts as worker 0, hence only size()-1 threads are spawned.
+ * A thread pool can only run one batch at a time.
+ *
+ * The workers can be pinned to CPUs that are spread evenly over the NUMA nodes (see numa.h), such that
+ * the memory they allocate and the data they copy (see octree_replicas) stay on their node.
+ */
+class thread_pool {
+public:
+    typedef std::function<void(int job, int worker)> job_function;
+
+    /** Creates a pool with the given number of workers.
+     * If threads <= 0, one worker per hardware thread is used.
+     * If pin is set, each worker is restricted to a single CPU, including the calling thread, which must then
+     * also be the thread that calls run(). */
+    explicit thread_pool(int threads = 0, bool pin = false);
+    ~thread_pool();
+
+    /** The number of workers, including the calling thread. */
+    int size() const { return queues.size(); }
+
+    /** Executes job(i, worker) for all i in [0, n) and waits until all are done.
+     * Jobs with a low index are started first.
+     * The worker index is in [0, size()) and can be used to access per-worker data. */
+    void run(int n, const job_function &job);
+
+    /** The NUMA node on which the worker runs, which is fixed if the workers are pinned. */
+    int node(int worker) const;
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<int> jobs;
+    };
+    std::vector<queue> queues;
+    std::vector<std::thread> threads;
+    std::vector<int> cpu;  ///< The CPU of each worker, if pinned.
+    std::vector<int> nodes; ///< The NUMA node of each worker, if pinned.
+
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+    std::atomic<int> remaining;
+    const job_function * current;
+    uint64_t generation;
+    bool stop;
+
+    void main(int worker);
+    void work(int worker);
+    bool take(int worker, int &job);
+
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+    typedef std::chrono::steady_clock clock;
+    clock::time_point t0 = clock::now();
+    uint64_t c0 = tsc_now();
+    while (clock::now() - t0 < std::chrono::milliseconds(5)) {}
+    uint64_t c1 = tsc_now();
+    clock::time_point t1 = clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count() / (c1 - c0);
+#else
+    return 1e-6;
+#endif
+}
+
+double tsc_period() {
+    static const double period = calibrate();
+    return period;
+}
+
+namespace {
+    struct zone {
+        const char * name;
+        uint64_t begin, end;
+    };
+
+    /** The zones recorded by a single thread. Only written by that thread. */
+    struct trace_buffer {
+        uint32_t thread;
+        uint64_t head; //< Number of zones recorded, the last TRACE_BUFFER_SIZE of which are in zones.
+        zone zones[TRACE_BUFFER_SIZE];
+    };
+
+    std::mutex trace_lock; //< Protects buffers.
+    std::vector<std::unique_ptr<trace_buffer>> buffers;
+    std::atomic<uint64_t> trace_origin(0); //< Zones that started before trace_start are not written.
+    thread_local trace_buffer * local_buffer = nullptr;
+}
+
+std::atomic<bool> trace_enabled(false);
+
+void trace_start() {
+    tsc_period(); // Calibrate before recording, as it takes a few milliseconds.
+    trace_origin = tsc_now();
+    trace_enabled = true;
+}
+
+void trace_stop() {
+    trace_enabled = false;
+}
+
+void trace_record(const char * name, uint64_t begin, uint64_t end) {
+    if (!local_buffer) {
+        // Buffers are never freed, such that the zones of threads that have exited can still be written.
+        std::lock_guard<std::mutex> l(trace_lock);
+        buffers.emplace_back(new trace_buffer());
+        local_buffer = buffers.back().get();
+        local_buffer->thread = buffers.size();
+        local_buffer->head = 0;
+    }
+    zone &z = local_buffer->zones[local_buffer->head++ % TRACE_BUFFER_SIZE];
+    z.name = name;
+    z.begin = begin;
+    z.end = end;
+}
+
+void trace_write(const char * filename) {
+    FILE * f = fopen(filename, "w");
+    if (!f) {perror("Could not open trace file"); exit(1);}
+    std::lock_guard<std::mutex> l(trace_lock);
+    uint64_t origin = trace_origin;
+    double us_per_tick = tsc_period() * 1000;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char * separator = "\n";
+    for (const std::unique_ptr<trace_buffer> &b : buffers) {
+        uint64_t first = b->head > TRACE_BUFFER_SIZE ? b->head - TRACE_BUFFER_SIZE : 0;
+        for (uint64_t i = first; i < b->head; i++) {
+            const zone &z = b->zones[i % TRACE_BUFFER_SIZE];
+            if (z.begin < origin) continue;
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                separator, z.name, b->thread, (z.begin - origin) * us_per_tick, (z.end - z.begin) * us_per_tick);
+            separator = ",\n";
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f)) {perror("Could not write trace file"); exit(1);}
+}
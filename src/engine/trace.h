@@ -0,0 +1,95 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/* Low overhead profiling.
+ *
+ * tsc_timer measures short durations using the time stamp counter, without allocating memory
+ * or making system calls, such that it can be used in the inner loops of the renderer.
+ *
+ * TRACE_ZONE(name) records the duration of the enclosing scope while tracing is enabled.
+ * Each thread records its zones in its own ring buffer, which retains the most recent
+ * TRACE_BUFFER_SIZE zones. trace_write stores the recorded zones as a Chrome trace
+ * (see chrome://tracing or https://ui.perfetto.dev), in which nested zones are shown stacked.
+ * When tracing is disabled, a zone costs a single relaxed load.
+ */
+
+/** Returns the current value of the time stamp counter, or of a nanosecond clock on other architectures. */
+inline uint64_t tsc_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/** Duration of a tick of tsc_now in milliseconds. Calibrated during the first call, which takes a few milliseconds. */
+double tsc_period();
+
+/** Measures the elapsed time since its construction, like Timer. */
+struct tsc_timer {
+    uint64_t begin;
+    tsc_timer() : begin(tsc_now()) {}
+    /** Returns the number of ticks elapsed since construction. */
+    uint64_t ticks() const { return tsc_now() - begin; }
+    /** Return time elapsed since construction in milliseconds. */
+    double elapsed() const { return ticks() * tsc_period(); }
+};
+
+/** The number of zones retained per thread. */
+static const uint32_t TRACE_BUFFER_SIZE = 1<<16;
+
+extern std::atomic<bool> trace_enabled;
+
+/** Discards all recorded zones and starts recording. */
+void trace_start();
+/** Stops recording zones. */
+void trace_stop();
+/** Writes the recorded zones to filename as Chrome trace event JSON.
+ * Must not be called while other threads are recording zones. */
+void trace_write(const char * filename);
+
+/** Appends a completed zone to the ring buffer of the calling thread. */
+void trace_record(const char * name, uint64_t begin, uint64_t end);
+
+/** Records the lifetime of this object as a zone. The name must be a string with static storage duration. */
+struct trace_zone {
+    const char * name;
+    uint64_t begin;
+    explicit trace_zone(const char * name) : name(name), begin(trace_enabled.load(std::memory_order_relaxed) ? tsc_now() : 0) {}
+    ~trace_zone() { if (begin) trace_record(name, begin, tsc_now()); }
+private:
+    trace_zone(const trace_zone&);
+    trace_zone& operator=(const trace_zone&);
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+/** Records the enclosing scope as a zone with the given name. */
+#define TRACE_ZONE(name) trace_zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+
+#endif
@@ -0,0 +1,145 @@
+/*
+    Voxel-Engine - A CPU based sparse octree renderer.
+    Copyright (C) 2015  B.J. Conijn <bcmpinc@users.sourceforge.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "timing.h"
+#include "octree.h"
+#include "renderer.h"
+
+/* Compares the effect of the node layout of octree files (see build_db -layout) on rendering.
+ * Renders a fixed set of views off-screen and reports for each view:
+ *  - the time and page faults of the first frame, after evicting the octree from memory and the page cache;
+ *  - the median time of the subsequent frames.
+ * Fault-around is disabled for the first frame, hence the number of page faults equals the number
+ * of distinct pages of the octree touched by a frame. These are major faults if the kernel was able
+ * to drop the file from the page cache and minor faults otherwise.
+ */
+
+struct View {
+    double x, y, z;    ///< Position, relative to the size of the scene.
+    double yaw, pitch; ///< Orientation, in radians.
+};
+
+static const View view[] = {
+    { 0.0,  0.0, -1.5,  0.0,  0.0},
+    { 0.3,  0.2, -1.2,  0.3,  0.2},
+    {-0.5,  0.1,  0.2,  1.2, -0.3},
+    { 0.0,  0.0,  0.0,  0.0,  0.0},
+    { 0.9,  0.9,  0.9,  3.5,  0.6},
+};
+static const int views = sizeof(view)/sizeof(view[0]);
+
+static const int32_t SCENE_DEPTH = 26;
+static const double SCALE = 1<<SCENE_DEPTH;
+static const int WIDTH = 1024;
+static const int HEIGHT = 768;
+
+static glm::dmat3 orientation(double yaw, double pitch) {
+    glm::dmat3 y(cos(yaw), 0, -sin(yaw),  0, 1, 0,  sin(yaw), 0, cos(yaw));
+    glm::dmat3 x(1, 0, 0,  0, cos(pitch), sin(pitch),  0, -sin(pitch), cos(pitch));
+    return x * y;
+}
+
+/** Removes the octree file from the address space of this process and tries to drop it from the page cache. */
+static void evict(octree_file &in) {
+    if (in.fd == -1) return; // Octrees loaded into huge pages are not backed by the file.
+    if (madvise(in.root, in.size, MADV_DONTNEED)) {perror("Could not evict octree"); exit(1);}
+    posix_fadvise(in.fd, 0, 0, POSIX_FADV_DONTNEED);
+    // Prevent read-ahead and fault-around, such that each page that is touched causes a fault.
+    madvise(in.root, in.size, MADV_RANDOM);
+}
+
+static void restore(octree_file &in) {
+    if (in.fd == -1) return;
+    madvise(in.root, in.size, MADV_NORMAL);
+}
+
+static void faults(long &minor, long &major) {
+    rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    minor = r.ru_minflt;
+    major = r.ru_majflt;
+}
+
+int main(int argc, char ** argv) {
+    int frames = 10;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-frames") == 0) {
+        frames = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || frames < 1) {
+        fprintf(stderr, "Usage: %s [-frames N] octree_file...\n", argv[0]);
+        fprintf(stderr, "Compares the rendering performance of octree files, which store the same model in different layouts.\n");
+        exit(2);
+    }
+
+    surface surf(WIDTH, HEIGHT, true);
+    view_pane pane = {-WIDTH/2/(double)HEIGHT, WIDTH/2/(double)HEIGHT, 0.5, -0.5};
+    renderer r;
+    printf("%-32s %4s | %8s %8s %8s | %8s\n", "File", "View", "Cold ms", "Minor", "Major", "Warm ms");
+    for (int f=first; f<argc; f++) {
+        octree_file in(argv[f]);
+        double cold_sum = 0, warm_sum = 0;
+        long minor_sum = 0, major_sum = 0;
+        // Warm up, such that the buffers of the renderer are allocated.
+        r.render(&in, surf, pane, glm::dvec3(0), glm::dmat3(1));
+        for (int i=0; i<views; i++) {
+            glm::dvec3 position = glm::dvec3(view[i].x, view[i].y, view[i].z) * SCALE;
+            glm::dmat3 rotation = orientation(view[i].yaw, view[i].pitch);
+
+            evict(in);
+            long minor, major, minor_end, major_end;
+            surf.clear(0);
+            faults(minor, major);
+            Timer t;
+            r.render(&in, surf, pane, position, rotation);
+            double cold = t.elapsed();
+            faults(minor_end, major_end);
+            restore(in);
+
+            double times[frames];
+            for (int j=0; j<frames; j++) {
+                surf.clear(0);
+                Timer t;
+                r.render(&in, surf, pane, position, rotation);
+                times[j] = t.elapsed();
+            }
+            std::sort(times, times + frames);
+            double warm = times[frames/2];
+
+            printf("%-32.32s %4d | %8.2f %8ld %8ld | %8.2f\n", argv[f], i, cold, minor_end - minor, major_end - major, warm);
+            cold_sum += cold;
+            warm_sum += warm;
+            minor_sum += minor_end - minor;
+            major_sum += major_end - major;
+        }
+        printf("%-32.32s %4s | %8.2f %8ld %8ld | %8.2f\n", argv[f], "avg", cold_sum/views, minor_sum/views, major_sum/views, warm_sum/views);
+        fflush(stdout);
+    }
+    return 0;
+}
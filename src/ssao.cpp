@@ -1,13 +1,30 @@
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
 #include <random>
 #include <glm/glm.hpp>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "surface.h"
 #include "ssao.h"
+#include "thread_pool.h"
+#include "trace.h"
 
-ssao::ssao(int radius, double projection, int stride)
+/** The number of rows per job. */
+static const int SSAO_BAND = 16;
+/** Determines how fast the weight of a block decreases with the relative difference between its depth and that of the pixel. */
+static const float SSAO_DEPTH_SENSITIVITY = 256;
+
+ssao::ssao(int radius, double projection, int stride, int scale, int threads)
   : projection(projection)
-  , radius(radius)
-  , stride(stride)
+  , scale(scale)
+  , radius(std::max(1, radius / scale))
+  , stride((stride + scale - 1) / scale)
+  , vectorize(true)
+  , pool(new thread_pool(threads))
 {
     static const int PROBE_COUNT = sizeof(probes) / sizeof(probes[0]);
     std::mt19937_64 rand;
@@ -19,22 +36,43 @@ ssao::ssao(int radius, double projection, int stride)
         } while (glm::dot(v,v) > 1);
         probes[i].z = v.z*projection*(1<<30);
         probes[i].range = -sqrt(1 - v.x*v.x - v.y*v.y)*projection*(1<<30);
-        probes[i].dx = v.x*radius + 0.5;
-        probes[i].dy = v.y*radius + 0.5;
-        probes[i].offset = probes[i].dx + probes[i].dy * stride;
+        probes[i].dx = v.x*this->radius + 0.5;
+        probes[i].dy = v.y*this->radius + 0.5;
+        probes[i].offset = probes[i].dx + probes[i].dy * this->stride;
+        vectorize &= std::abs(probes[i].z) < (1ll<<32) && -probes[i].range < (1ll<<32);
+    }
+    for (int y=0; y<SSAO_SIZE; y++) {
+        for (int j=0; j<SSAO_PROBES_PER_PIXEL; j++) {
+            for (int x=0; x<SSAO_SIZE; x++) {
+                const probe &p(probes[(x + y * SSAO_SIZE) * SSAO_PROBES_PER_PIXEL + j]);
+                lanes[y][j].offset[x] = p.offset;
+                lanes[y][j].z[x] = std::abs(p.z);
+                lanes[y][j].z_sign[x] = p.z < 0 ? -1 : 0;
+                lanes[y][j].range[x] = -p.range;
+            }
+        }
     }
     
-    for (int i=0; i<SSAO_PROBES_PER_PIXEL; i++) {
+    for (int i=0; i<=SSAO_PROBES_PER_PIXEL; i++) {
         double light = i/(double)SSAO_PROBES_PER_PIXEL;
         light *= light;
         light *= light;
-        for (int j=0; j<256; j++) {
-            lightmap[i][j] = j*light;
+        if (i < SSAO_PROBES_PER_PIXEL) {
+            for (int j=0; j<256; j++) {
+                lightmap[i][j] = j*light;
+            }
         }
+        light_factor[i] = light * 256;
+    }
+    for (int i=0; i<SSAO_WEIGHT_STEPS; i++) {
+        double relative = SSAO_DEPTH_SENSITIVITY * i / (16.0 * SSAO_WEIGHT_STEPS);
+        depth_weight[i] = 1 / (1 + relative * relative);
     }
 }
 
 
+ssao::~ssao() {}
+
 uint32_t ssao::modulate(uint32_t color, int light) {
     assert(light >= 0);
     assert(light < SSAO_PROBES_PER_PIXEL);
@@ -44,47 +82,247 @@ uint32_t ssao::modulate(uint32_t color, int light) {
     return r | (g<<8) | (b<<16);
 }
 
+/** Stores the number of unoccluded probes of pixel i, by either applying it to the pixel or,
+ * when computing the occlusion of the blocks, storing it in the lowres buffer.
+ * As a probe can count twice, count can exceed SSAO_PROBES_PER_PIXEL, which means the pixel is fully lit. */
+inline void ssao::shade(const surface &target, int i, int count) {
+    if (scale > 1) {
+        target.data[i] = std::min(count, SSAO_PROBES_PER_PIXEL);
+    } else if (count < SSAO_PROBES_PER_PIXEL) {
+        target.data[i] = modulate(target.data[i], count);
+    }
+}
+
 static int clamp(int val, int low, int high) {
     if (val <= low) return low;
     if (val >= high) return high;
     return val;
 }
 
-void ssao::apply(const surface& target) {
+/** Returns the number of occluded probes of the pixel at (x,y). */
+int ssao::occlusion(const surface& target, int x, int y) const {
     int width = target.width;
     int height = target.height;
-    int i=0;
-    for (int y=0; y<height; y++) {
-        for (int x=0; x<width; x++) {
-            int probe_offset = (x%SSAO_SIZE + (y%SSAO_SIZE) * SSAO_SIZE) * SSAO_PROBES_PER_PIXEL;
-            int count = 0;
-            int64_t md = target.depth[i];
-            for (int j=0; j<SSAO_PROBES_PER_PIXEL; j++) {
-                const probe &p(probes[probe_offset+j]);
-                int64_t pd1;
-                int64_t pd2;
-                if (x>=abs(p.dx) && y>=abs(p.dy) && x+abs(p.dx)<width && y+abs(p.dy)<height) {
-                    pd1 = target.depth[i + p.offset];
-                    pd2 = target.depth[i - p.offset];
-                } else {
-                    pd1 = target.depth[clamp(x+p.dx,0,width-1) + clamp(y+p.dy,0,height-1) * stride];
-                    pd2 = target.depth[clamp(x-p.dx,0,width-1) + clamp(y-p.dy,0,height-1) * stride];
+    int i = x + y * width;
+    int probe_offset = (x%SSAO_SIZE + (y%SSAO_SIZE) * SSAO_SIZE) * SSAO_PROBES_PER_PIXEL;
+    int count = 0;
+    int64_t md = target.depth[i];
+    for (int j=0; j<SSAO_PROBES_PER_PIXEL; j++) {
+        const probe &p(probes[probe_offset+j]);
+        int64_t pd1;
+        int64_t pd2;
+        if (x>=abs(p.dx) && y>=abs(p.dy) && x+abs(p.dx)<width && y+abs(p.dy)<height) {
+            pd1 = target.depth[i + p.offset];
+            pd2 = target.depth[i - p.offset];
+        } else {
+            pd1 = target.depth[clamp(x+p.dx,0,width-1) + clamp(y+p.dy,0,height-1) * stride];
+            pd2 = target.depth[clamp(x-p.dx,0,width-1) + clamp(y-p.dy,0,height-1) * stride];
+        }
+        int64_t reld1 = (pd1-md)<<30;
+        int64_t reld2 = (pd2-md)<<30;
+        // Range check
+        if (reld1 < p.range*md || reld2 < p.range*md) {
+            count++;
+        } else {
+            // Occlusion check
+            if (reld1 >  p.z*md) count++;
+            if (reld2 > -p.z*md) count++;
+        }
+    }
+    return count;
+}
+
+#ifdef __AVX2__
+/** Counts the occluded probes of 4 pixels, whose depths are in md and whose probe depths are in pd1 and pd2.
+ * Performs the same computation as ssao::occlusion, using 64-bit lanes. */
+static inline __m256i occlusion_x4(__m256i md, __m256i pd1, __m256i pd2, __m256i z, __m256i z_sign, __m256i range) {
+    __m256i reld1 = _mm256_slli_epi64(_mm256_sub_epi64(pd1, md), 30);
+    __m256i reld2 = _mm256_slli_epi64(_mm256_sub_epi64(pd2, md), 30);
+    __m256i range_md = _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_mul_epu32(range, md));
+    __m256i z_md = _mm256_mul_epu32(z, md);
+    z_md = _mm256_sub_epi64(_mm256_xor_si256(z_md, z_sign), z_sign); // Apply the sign of z.
+    // Range check
+    __m256i out_of_range = _mm256_or_si256(_mm256_cmpgt_epi64(range_md, reld1), _mm256_cmpgt_epi64(range_md, reld2));
+    // Occlusion check, the masks are -1 for each occluded probe.
+    __m256i occluded = _mm256_add_epi64(
+        _mm256_cmpgt_epi64(reld1, z_md),
+        _mm256_cmpgt_epi64(reld2, _mm256_sub_epi64(_mm256_setzero_si256(), z_md))
+    );
+    return _mm256_blendv_epi8(occluded, out_of_range, out_of_range);
+}
+#endif
+
+/** Applies the filter to the rows in [begin, end). */
+void ssao::apply_rows(const surface& target, int begin, int end) {
+    int width = target.width;
+    for (int y=begin; y<end; y++) {
+        int x = 0;
+#ifdef __AVX2__
+        int height = target.height;
+        // Interior of the image, where none of the probes need to be clamped.
+        if (vectorize && y >= radius && y + radius < height) {
+            // Process aligned blocks of 8 pixels, such that each lane uses the probes of the same column.
+            int x_begin = (radius + SSAO_SIZE - 1) / SSAO_SIZE * SSAO_SIZE;
+            for (; x < x_begin && x < width; x++) {
+                shade(target, x + y*width, occlusion(target, x, y));
+            }
+            for (; x + SSAO_SIZE + radius <= width; x += SSAO_SIZE) {
+                int i = x + y * width;
+                const int * depth = (const int*)target.depth;
+                __m256i md = _mm256_loadu_si256((const __m256i*)(depth + i));
+                __m256i md_lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(md));
+                __m256i md_hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(md, 1));
+                __m256i count_lo = _mm256_setzero_si256();
+                __m256i count_hi = _mm256_setzero_si256();
+                for (int j=0; j<SSAO_PROBES_PER_PIXEL; j++) {
+                    const probe_lanes &p(lanes[y%SSAO_SIZE][j]);
+                    __m256i offset = _mm256_loadu_si256((const __m256i*)p.offset);
+                    __m256i pixel = _mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+                    __m256i pd1 = _mm256_i32gather_epi32(depth, _mm256_add_epi32(pixel, offset), 4);
+                    __m256i pd2 = _mm256_i32gather_epi32(depth, _mm256_sub_epi32(pixel, offset), 4);
+                    count_lo = _mm256_sub_epi64(count_lo, occlusion_x4(md_lo,
+                        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pd1)), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pd2)),
+                        _mm256_loadu_si256((const __m256i*)&p.z[0]), _mm256_loadu_si256((const __m256i*)&p.z_sign[0]),
+                        _mm256_loadu_si256((const __m256i*)&p.range[0])));
+                    count_hi = _mm256_sub_epi64(count_hi, occlusion_x4(md_hi,
+                        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pd1, 1)), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pd2, 1)),
+                        _mm256_loadu_si256((const __m256i*)&p.z[4]), _mm256_loadu_si256((const __m256i*)&p.z_sign[4]),
+                        _mm256_loadu_si256((const __m256i*)&p.range[4])));
                 }
-                int64_t reld1 = (pd1-md)<<30;
-                int64_t reld2 = (pd2-md)<<30;
-                // Range check
-                if (reld1 < p.range*md || reld2 < p.range*md) {
-                    count++;
-                } else {
-                    // Occlusion check
-                    if (reld1 >  p.z*md) count++;
-                    if (reld2 > -p.z*md) count++;
+                int64_t count[SSAO_SIZE];
+                _mm256_storeu_si256((__m256i*)&count[0], count_lo);
+                _mm256_storeu_si256((__m256i*)&count[4], count_hi);
+                for (int k=0; k<SSAO_SIZE; k++) {
+                    shade(target, i+k, (int)count[k]);
                 }
             }
-            if (count < SSAO_PROBES_PER_PIXEL) {
-                target.data[i] = modulate(target.data[i], count);
+        }
+#endif
+        // Borders, where the probes are clamped to the image.
+        for (; x<width; x++) {
+            shade(target, x + y*width, occlusion(target, x, y));
+        }
+    }
+}
+
+/** Stores the minimum depth of the blocks in the rows [begin, end) of the lowres buffer. */
+void ssao::downsample_rows(const surface& target, int begin, int end) {
+    int width = target.width;
+    int height = target.height;
+    for (int y=begin; y<end; y++) {
+        uint32_t * row = lowres.depth + y * lowres.width;
+        std::fill_n(row, lowres.width, ~0u);
+        for (int sy=y*scale; sy<std::min(y*scale+scale, height); sy++) {
+            const uint32_t * src = target.depth + sy * width;
+            for (int x=0, bx=0; x<width; bx++) {
+                uint32_t d = row[bx];
+                for (int end=std::min(x+scale, width); x<end; x++) {
+                    d = std::min(d, src[x]);
+                }
+                row[bx] = d;
             }
-            i++;
         }
     }
 }
+
+/** Applies the light factors of the blocks to the rows [begin, end) of the target. */
+void ssao::upsample_rows(const surface& target, int begin, int end) {
+    int width = target.width;
+    int lw = lowres.width;
+    int lh = lowres.height;
+    const uint32_t * block_depth = lowres.depth;
+    const uint32_t * block_light = lowres.data;
+    for (int y=begin; y<end; y++) {
+        // The center of the pixel relative to the centers of the blocks.
+        float v = (y + 0.5f) / scale - 0.5f;
+        int y0 = std::floor(v);
+        float fy = v - y0;
+        int y1 = std::min(y0 + 1, lh - 1);
+        y0 = std::max(y0, 0);
+        for (int x=0; x<width; x++) {
+            const upsample_column &col(columns[x]);
+            const int block[4] = {col.x0 + y0*lw, col.x1 + y0*lw, col.x0 + y1*lw, col.x1 + y1*lw};
+            // Skip the pixel if none of the blocks is occluded.
+            if (block_light[block[0]] == SSAO_PROBES_PER_PIXEL && block_light[block[1]] == SSAO_PROBES_PER_PIXEL &&
+                block_light[block[2]] == SSAO_PROBES_PER_PIXEL && block_light[block[3]] == SSAO_PROBES_PER_PIXEL) continue;
+            int i = x + y * width;
+            float depth = target.depth[i];
+            float step = 16 * SSAO_WEIGHT_STEPS / (depth + 1);
+            const float bilinear[4] = {(1-col.fx)*(1-fy), col.fx*(1-fy), (1-col.fx)*fy, col.fx*fy};
+            float sum = 0, weight = 0;
+            for (int k=0; k<4; k++) {
+                float relative = std::abs(depth - block_depth[block[k]]) * step;
+                float w = bilinear[k] * depth_weight[(int)std::min<float>(relative, SSAO_WEIGHT_STEPS - 1)];
+                sum += w * light_factor[block_light[block[k]]];
+                weight += w;
+            }
+            int factor = sum / weight + 0.5f;
+            if (factor >= 256) continue;
+            uint32_t c = target.data[i];
+            uint32_t r = ((c>> 0) & 0xff) * factor >> 8;
+            uint32_t g = ((c>> 8) & 0xff) * factor >> 8;
+            uint32_t b = ((c>>16) & 0xff) * factor >> 8;
+            target.data[i] = r | (g<<8) | (b<<16);
+        }
+    }
+}
+
+/** Calls f(begin, end) for consecutive ranges of the given number of rows, using the thread pool. */
+void ssao::for_bands(int rows, int band_size, const std::function<void(int, int)> &f) {
+    int bands = (rows + band_size - 1) / band_size;
+    pool->run(bands, [&](int band, int){
+        f(band * band_size, std::min<int>((band + 1) * band_size, rows));
+    });
+}
+
+/** Computes the occlusion of the blocks of the target, if scale > 1. */
+void ssao::prepare(const surface& target) {
+    if (scale == 1) return;
+    uint32_t lw = (target.width + scale - 1) / scale;
+    uint32_t lh = (target.height + scale - 1) / scale;
+    assert(lw == (uint32_t)stride);
+    if (lowres.width != lw || lowres.height != lh) {
+        lowres = surface(lw, lh, true);
+    }
+    if (columns.size() != target.width) {
+        columns.resize(target.width);
+        for (uint32_t x=0; x<target.width; x++) {
+            float u = (x + 0.5f) / scale - 0.5f;
+            int x0 = std::floor(u);
+            columns[x].fx = u - x0;
+            columns[x].x1 = std::min<int>(x0 + 1, lw - 1);
+            columns[x].x0 = std::max(x0, 0);
+        }
+    }
+    for_bands(lh, SSAO_BAND, [&](int begin, int end){ downsample_rows(target, begin, end); });
+    for_bands(lh, SSAO_BAND, [&](int begin, int end){ apply_rows(lowres, begin, end); });
+}
+
+/** Applies the occlusion to the rows [begin, end) of the target. */
+void ssao::shade_rows(const surface& target, int begin, int end) {
+    if (scale == 1) {
+        apply_rows(target, begin, end);
+    } else {
+        upsample_rows(target, begin, end);
+    }
+}
+
+void ssao::apply(const surface& target) {
+    TRACE_ZONE("ssao::apply");
+    // The filter only reads the depth buffer, hence the bands can be processed independently.
+    prepare(target);
+    for_bands(target.height, SSAO_BAND, [&](int begin, int end){ shade_rows(target, begin, end); });
+}
+
+void ssao::apply(const surface& source, surface& target) {
+    TRACE_ZONE("ssao::apply");
+    int n = source.width / target.width;
+    assert(n * target.width == source.width);
+    assert(n * target.height == source.height);
+    prepare(source);
+    // Each band is downscaled right after shading it, while it is still in the cache.
+    for_bands(target.height, std::max(1, SSAO_BAND / n), [&](int begin, int end){
+        shade_rows(source, begin * n, end * n);
+        target.copy_rows(source, begin, end);
+    });
+}
@@ -20,12 +20,28 @@
 #define SSAO_H
 
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "surface.h"
 
-struct surface;
+class thread_pool;
 
 static const int SSAO_SIZE = 8;
 static const int SSAO_PROBES_PER_PIXEL = 8;
+/** The number of entries in the depth weight table, which covers relative depth differences up to 1/16. */
+static const int SSAO_WEIGHT_STEPS = 4096;
 
+/** Screen space ambient occlusion.
+ * Darkens each pixel depending on how many of its probes are occluded according to the depth buffer.
+ * The image is processed in bands of rows, which are distributed over a thread pool.
+ * Pixels that are at least radius pixels away from the borders are processed 8 at a time using AVX2, if available.
+ *
+ * With a scale larger than 1, the occlusion is computed on a buffer that is scale times smaller in both dimensions,
+ * which stores the minimum depth of each block of pixels. The resulting light factors are upsampled bilaterally:
+ * each pixel interpolates the factors of the 4 nearest blocks, weighted by how close their depth is to its own depth,
+ * such that the occlusion does not bleed across depth discontinuities.
+ */
 struct ssao {
     struct probe {
         int dx, dy;
@@ -33,16 +49,61 @@ struct ssao {
         int64_t z;
         int64_t range;
     };
+    /** The probes used by 8 horizontally adjacent pixels, one per lane, for the vectorized interior.
+     * Stores the absolute values of z and range, as AVX2 only has an unsigned 32 bit multiply. */
+    struct probe_lanes {
+        int32_t offset[SSAO_SIZE];
+        int64_t z[SSAO_SIZE];
+        int64_t z_sign[SSAO_SIZE]; //< -1 if z is negative, 0 otherwise.
+        int64_t range[SSAO_SIZE];  //< -range, as range is never positive.
+    };
     const double projection;
-    const int radius;
-    const int stride;
+    const int scale;
+    const int radius; //< In pixels of the buffer on which the occlusion is computed.
+    const int stride; //< Idem.
     
     int lightmap[SSAO_PROBES_PER_PIXEL][256];
     probe probes[SSAO_SIZE*SSAO_SIZE*SSAO_PROBES_PER_PIXEL];
+    probe_lanes lanes[SSAO_SIZE][SSAO_PROBES_PER_PIXEL]; //< Indexed by y%SSAO_SIZE and probe.
+    bool vectorize; //< Whether z and range fit in 32 bits, which requires projection < 4.
+    std::unique_ptr<thread_pool> pool;
+    
+    /** The blocks that are interpolated by a column of pixels, and the weight of the right block. */
+    struct upsample_column {
+        int x0, x1;
+        float fx;
+    };
+    surface lowres; //< The minimum depth and the number of unoccluded probes of each block, if scale > 1.
+    std::vector<upsample_column> columns;
+    float light_factor[SSAO_PROBES_PER_PIXEL + 1]; //< The light factor times 256, indexed by the number of unoccluded probes.
+    float depth_weight[SSAO_WEIGHT_STEPS]; //< Weight of a block, indexed by 65536 times the relative difference in depth.
     
-    ssao(int radius, double projection, int stride);
+    /** @param radius the radius of the probes, in pixels of the target.
+     * @param stride the width of the target.
+     * @param scale the size of the blocks of pixels that share their occlusion; 1 computes the occlusion of every pixel,
+     * 2 or 4 give ambient occlusion at roughly 1/4 or 1/16 of the cost, at the expense of detail in the shadows.
+     * @param threads the number of threads, if <= 0, one per hardware thread is used. */
+    ssao(int radius, double projection, int stride, int scale = 1, int threads = 0);
+    ~ssao();
     uint32_t modulate(uint32_t color, int light);
     void apply(const surface &target);
+    /** Applies the filter to the supersampled source and stores the source, downscaled to the size of the target, in the target.
+     * This is faster than applying the filter and calling target.copy(source), as each band of rows is downscaled while it is in the cache.
+     * The source must be n times as big in both dimensions as the target, for some integer n. */
+    void apply(const surface &source, surface &target);
+
+private:
+    int occlusion(const surface &target, int x, int y) const;
+    void shade(const surface &target, int i, int count);
+    void apply_rows(const surface &target, int begin, int end);
+    void downsample_rows(const surface &target, int begin, int end);
+    void upsample_rows(const surface &target, int begin, int end);
+    void for_bands(int rows, int band_size, const std::function<void(int, int)> &f);
+    void prepare(const surface &target);
+    void shade_rows(const surface &target, int begin, int end);
+
+    ssao(const ssao&);
+    ssao& operator=(const ssao&);
 };
 
 #endif
@@ -22,29 +22,67 @@
 #include <cassert>
 #include <algorithm>
 #include <cstring>
+#include <memory>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "timing.h"
+#include "trace.h"
 #include "events.h"
 #include "art.h"
 #include "octree.h"
+#include "octree_stream.h"
+#include "detail_budget.h"
+#include "reprojection.h"
 #include "capture.h"
 #include "ssao.h"
 
-// #define APPLY_SSAO
-
 using namespace std;
 
 
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char *argv[]) {
     bool capture = false;
+    capture_settings capture_config;
+    bool reproject = false;
+    bool apply_ssao = true;
+    int ssao_scale = 1;
+    uint64_t memory = 0;
+    bool huge_pages = false;
+    double budget = 0;
     const char * filename = nullptr;
+    const char * tracefile = nullptr;
     for (int i=1; i<argc; i++) { 
         if (argv[i][0]=='-') {
             if (strcmp(argv[i], "-capture") == 0) {
                 capture = true;
+            } else if (strcmp(argv[i], "-fps") == 0 && i+1 < argc) {
+                capture_config.framerate = atoi(argv[++i]);
+                if (capture_config.framerate <= 0) goto usage;
+            } else if (strcmp(argv[i], "-bitrate") == 0 && i+1 < argc) {
+                capture_config.bitrate = atoi(argv[++i]) * 1000;
+                if (capture_config.bitrate <= 0) goto usage;
+            } else if (strcmp(argv[i], "-codec") == 0 && i+1 < argc) {
+                capture_config.codec = argv[++i];
+            } else if (strcmp(argv[i], "-reproject") == 0) {
+                reproject = true;
+            } else if (strcmp(argv[i], "-nossao") == 0) {
+                apply_ssao = false;
+            } else if (strcmp(argv[i], "-ssaoscale") == 0 && i+1 < argc) {
+                ssao_scale = atoi(argv[++i]);
+                if (ssao_scale < 1) goto usage;
+            } else if (strcmp(argv[i], "-quiet") == 0) {
+                octree_draw_verbose = false;
+            } else if (strcmp(argv[i], "-trace") == 0 && i+1 < argc) {
+                tracefile = argv[++i];
+            } else if (strcmp(argv[i], "-memory") == 0 && i+1 < argc) {
+                memory = strtoull(argv[++i], nullptr, 10) << 20;
+                if (memory == 0) goto usage;
+            } else if (strcmp(argv[i], "-hugepages") == 0) {
+                huge_pages = true;
+            } else if (strcmp(argv[i], "-budget") == 0 && i+1 < argc) {
+                budget = strtod(argv[++i], nullptr);
+                if (budget <= 0) goto usage;
             } else {
                 fprintf(stderr,"unrecognized option: %s\n", argv[i]);
             }
@@ -53,16 +91,24 @@ int main(int argc, char *argv[]) {
             filename = argv[i];
         }
     }
-    if (filename == nullptr) {
+    if (filename == nullptr || (huge_pages && memory)) {
         usage:
-        fprintf(stderr,"Usage: %s [-capture] octree_file\n", argv[0]);
+        fprintf(stderr,"Usage: %s [-capture [-fps n] [-bitrate kbps] [-codec name]] [-reproject] [-nossao] [-ssaoscale n] [-quiet] [-trace file.json] [-memory MiB | -hugepages] [-budget ms] octree_file\n", argv[0]);
         exit(2);
     }
 
     // Determine the file names.
     octree_file in(filename);
+    // Limit the amount of memory used by the octree, if requested.
+    std::unique_ptr<octree_stream> stream;
+    if (memory) {
+        stream.reset(new octree_stream(&in, memory));
+    }
+    if (huge_pages) {
+        in.load_huge_pages();
+    }
 
-    init_screen("Voxel renderer");
+    init_screen("Voxel renderer", apply_ssao || reproject || capture);
     position = glm::dvec3(0, 0, 0);
     Capture c;
     if (capture) {
@@ -70,34 +116,53 @@ int main(int argc, char *argv[]) {
         char capturefile[32];
         mkdir("capture",0755);
         sprintf(capturefile, "capture/cap%08d.mp4", getpid());
-        c = Capture(capturefile, get_screen());
+        c = Capture(capturefile, get_screen(), capture_config);
 #else
         fprintf(stderr, "Cannot capture: compiled without libffmpeg\n");
 #endif
     }
 
     surface surf = get_screen();
-    surf.depth = new uint32_t[surf.width * surf.height];
 
-#ifdef APPLY_SSAO    
-    ssao filter(20, 0.1, surf.width);
-#endif
+    ssao filter(20, 0.1, surf.width, ssao_scale);
+
+    // Reduce the level of detail while moving to stay within the time budget, if requested.
+    // A budget of 0 never reduces the level of detail.
+    detail_budget lod(budget, budget > 0 ? 4 : 0);
+    // Reuse the last rendered frame while moving, if requested.
+    reprojection history;
+
+    if (tracefile) trace_start();
 
     // mainloop
     while (!quit) {
+        TRACE_ZONE("frame");
         Timer t;
-        if (moves) {
-            surf.clear(0xaaccffu);
-            octree_draw(&in, surf, get_view_pane(),position, orientation);
-            // Timer tt;
-#ifdef APPLY_SSAO
-            filter.apply(surf);
-#endif
-            // printf("SSAO: %lf\n", tt.elapsed());
+        // A reprojected frame is rendered again once the camera stops.
+        if (moves || !lod.refined() || history.reprojected()) {
+            // Without SSAO, reprojection and capture, the renderer draws into the texture that is presented, which changes after every flip.
+            surf = get_screen();
+            uint32_t detail = lod.next(moves);
+            bool reused = reproject && moves && detail == 0 && history.project(surf, 0xaaccffu, get_view_pane(), position, orientation);
+            if (!reused) surf.clear(0xaaccffu);
+            if (stream) stream->update(get_view_pane(), position, orientation);
+            octree_draw_parallel(&in, surf, get_view_pane(),position, orientation, detail, reused);
+            if (reproject) {
+                if (detail == 0) {
+                    history.store(surf, get_view_pane(), position, orientation, reused);
+                } else {
+                    history.invalidate();
+                }
+            }
+            if (apply_ssao) filter.apply(surf);
+            lod.report(t.elapsed());
             //draw_box(orientation);
 
-            c.shoot();
-            flip_screen();
+            c.shoot(surf);
+            {
+                TRACE_ZONE("flip_screen");
+                flip_screen();
+            }
             
             if (false) {
                 printf("{\"%s\",  glm::dvec3(%10.0lf, %10.0lf, %10.0lf),  glm::dmat3(%6.3lf, %6.3lf, %6.3lf,  %6.3lf, %6.3lf, %6.3lf,  %6.3lf, %6.3lf, %6.3lf)},\n", filename,
@@ -112,6 +177,11 @@ int main(int argc, char *argv[]) {
         next_frame(t.elapsed());
         handle_events();
     }
+    if (tracefile) {
+        stream.reset(); // Stops its thread, which also records zones.
+        trace_stop();
+        trace_write(tracefile);
+    }
     return 0;
 }
 